@@ -18,6 +18,7 @@
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
 #include "kermond.h"
+#include <ctype.h>
 
 /**
  * Translate GNode to path/value to simulate watch events at startup
@@ -54,6 +55,111 @@ apteryx_rewatch_tree (char *path, apteryx_watch_callback cb)
     }
 }
 
+/* Hash of an enum name, the table seed is chosen so no two names collide */
+static int
+apteryx_enum_hash (const apteryx_enum_table *table, const char *name)
+{
+    uint32_t hash = 2166136261u ^ table->seed;
+
+    for (; *name; name++)
+    {
+        hash ^= table->nocase ? (uint8_t) tolower ((uint8_t) *name) : (uint8_t) *name;
+        hash *= 16777619u;
+    }
+    return hash % table->size;
+}
+
+/**
+ * Find the value of an enum name
+ * @param table generated enum table (e.g. <leaf define in lower case>_enum)
+ * @param name name to look up
+ * @param value returns the value for the name
+ * @return true if the name is in the table
+ */
+bool
+apteryx_enum_lookup (const apteryx_enum_table *table, const char *name, int *value)
+{
+    const apteryx_enum *slot;
+
+    if (!name)
+        return false;
+    slot = &table->slots[apteryx_enum_hash (table, name)];
+    if (!slot->name ||
+        (table->nocase ? strcasecmp (slot->name, name) : strcmp (slot->name, name)) != 0)
+        return false;
+    *value = slot->value;
+    return true;
+}
+
+/**
+ * Find the name of an enum value
+ * @param table generated enum table
+ * @param value value to look up
+ * @return the name for the value, or NULL if there is none
+ */
+const char *
+apteryx_enum_name (const apteryx_enum_table *table, int value)
+{
+    int lo = 0;
+    int hi = table->count - 1;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (table->values[mid].value == value)
+            return table->values[mid].name;
+        if (table->values[mid].value < value)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+/**
+ * Parse an enum
+ * @param path path the value was set on (for errors)
+ * @param value name of the enum
+ * @param table generated enum table
+ * @param defvalue result if there is no match or value is null
+ * @return value for the name
+ */
+int
+apteryx_parse_enum (const char *path, const char *value,
+                    const apteryx_enum_table *table, int defvalue)
+{
+    int result;
+
+    if (apteryx_enum_lookup (table, value, &result))
+    {
+        return result;
+    }
+    else if (value)
+    {
+        ERROR ("Invalid %s value (%s) using default (%d)\n",
+                path, value, defvalue);
+    }
+    return defvalue;
+}
+
+/* Accepted forms of true/false, laid out the way cpaths.py lays out enums */
+static const apteryx_enum boolean_slots[] = {
+    { "yes", 1 },
+    { "false", 0 },
+    { "1", 1 },
+    { "true", 1 },
+    { "0", 0 },
+    { NULL, 0 },
+    { "no", 0 },
+};
+static const apteryx_enum boolean_values[] = {
+    { "false", 0 },
+    { "true", 1 },
+};
+static const apteryx_enum_table boolean_enum = {
+    7, 25, true, boolean_slots, 2, boolean_values
+};
+
 /**
  * Parse true/false
  * @param value string containing formatted true/false
@@ -63,24 +169,730 @@ apteryx_rewatch_tree (char *path, apteryx_watch_callback cb)
 bool
 apteryx_parse_boolean (const char *path, const char *value, bool defvalue)
 {
-    if (value &&
-       (strcasecmp (value, "true") == 0 ||
-        strcasecmp (value, "yes") == 0 ||
-        strcmp (value, "1") == 0))
+    return apteryx_parse_enum (path, value, &boolean_enum, defvalue);
+}
+
+/**
+ * Match a path against a schema generated from a YANG model
+ * Each path component is matched once, list keys are captured as they go.
+ * @param schema generated schema (e.g. iprouting_schema)
+ * @param path path to match
+ * @param match returns the node ids and keys for the path
+ * @return true if every component of the path is in the schema, otherwise
+ *         match->depth is the number of leading components that matched
+ */
+bool
+apteryx_path_match (const apteryx_schema *schema, const char *path, apteryx_match *match)
+{
+    const char *seg;
+    const char *end;
+    int node = 0;
+    int len;
+    int i;
+
+    match->id = 0;
+    match->depth = 0;
+    match->nkeys = 0;
+    if (!path || path[0] != '/')
+        return false;
+
+    for (seg = path + 1; *seg; seg = *end ? end + 1 : end)
     {
+        end = strchrnul (seg, '/');
+        len = end - seg;
+        if (len == 0 || match->depth >= APTERYX_MATCH_DEPTH)
+            return false;
+        for (i = schema[node].child; i; i = schema[i].sibling)
+        {
+            const char *name = schema[i].name;
+            if (strcmp (name, "*") == 0 ||
+                (strncmp (name, seg, len) == 0 && name[len] == '\0'))
+                break;
+        }
+        if (!i)
+            return false;
+        if (strcmp (schema[i].name, "*") == 0)
+        {
+            if (match->nkeys >= APTERYX_MATCH_KEYS || len >= sizeof (match->keys[0]))
+                return false;
+            memcpy (match->keys[match->nkeys], seg, len);
+            match->keys[match->nkeys++][len] = '\0';
+        }
+        else
+            match->id = i;
+        match->ids[match->depth++] = i;
+        node = i;
+    }
+    return match->depth > 0;
+}
+
+/* Batching of Apteryx updates */
+#define APTERYX_BATCH_SIZE 1000
+#define APTERYX_BATCH_MS 50
+#define APTERYX_BATCH_BULK_SIZE 65536
+
+static bool batch_enabled = false;
+static GMutex batch_lock = { };
+static GNode *batch_tree = NULL;
+static GHashTable *batch_index = NULL;
+static GHashTable *batch_prunes = NULL;
+static int batch_count = 0;
+static int batch_limit = APTERYX_BATCH_SIZE;
+static guint batch_source = 0;
+
+/* Startup reconciliation against what is already in Apteryx */
+static GHashTable *reconcile_leaves = NULL;
+static GHashTable *reconcile_live = NULL;
+static GHashTable *reconcile_roots = NULL;
+static bool reconcile_batch = false;
+
+/**
+ * Check a leaf against the reconciliation snapshot
+ * Must be called with the batch lock held
+ * @param path full path to the leaf
+ * @param value value about to be set
+ * @return true if the leaf needs to be set
+ */
+static bool
+reconcile_claim (const char *path, const char *value)
+{
+    const char *existing;
+    char *parent;
+    char *sep;
+    bool changed = true;
+
+    if (!reconcile_leaves)
         return true;
+
+    existing = (const char *) g_hash_table_lookup (reconcile_leaves, path);
+    if (existing)
+    {
+        changed = strcmp (existing, value) != 0;
+        g_hash_table_remove (reconcile_leaves, path);
     }
-    else if (value &&
-            (strcasecmp (value, "false") == 0 ||
-             strcasecmp (value, "no") == 0 ||
-             strcmp (value, "0") == 0))
+
+    /* Anything above a published leaf must survive the sweep */
+    parent = g_strdup (path);
+    while ((sep = strrchr (parent, '/')) != NULL && sep != parent)
     {
-        return false;
+        *sep = '\0';
+        if (g_hash_table_contains (reconcile_live, parent))
+            break;
+        g_hash_table_add (reconcile_live, strdup (parent));
     }
-    else if (value)
+    free (parent);
+    return changed;
+}
+
+/**
+ * Find or create the node for a path in the pending batch
+ * @param path full path to the node ("" for the root)
+ * @return the node in the batch tree
+ */
+static GNode *
+batch_node (const char *path)
+{
+    GNode *node = (GNode *) g_hash_table_lookup (batch_index, path);
+    if (!node)
     {
-        ERROR ("Invalid %s value (%s) using default (%d)\n",
-                path, value, defvalue);
+        const char *name = strrchr (path, '/');
+        char *parent = g_strndup (path, name ? name - path : 0);
+        node = APTERYX_NODE (batch_node (parent), strdup (name ? name + 1 : path));
+        g_hash_table_insert (batch_index, strdup (path), node);
+        free (parent);
     }
-    return defvalue;
+    return node;
+}
+
+/**
+ * Remove a subtree from the batch index
+ * @param node root of the subtree
+ * @param path full path to the node
+ */
+static void
+batch_unindex (GNode *node, const char *path)
+{
+    GNode *child;
+
+    g_hash_table_remove (batch_index, path);
+    for (child = g_node_first_child (node); child; child = g_node_next_sibling (child))
+    {
+        if (G_NODE_IS_LEAF (child))
+            continue;
+        char *cpath = g_strdup_printf ("%s/%s", path, APTERYX_NAME (child));
+        batch_unindex (child, cpath);
+        free (cpath);
+    }
+}
+
+/**
+ * Remove a path, and any parents left empty, from the pending batch
+ * @param path full path to remove
+ */
+static void
+batch_remove (const char *path)
+{
+    GNode *node = (GNode *) g_hash_table_lookup (batch_index, path);
+    char *npath = g_strdup (path);
+
+    while (node && node != batch_tree)
+    {
+        GNode *parent = node->parent;
+        char *name = strrchr (npath, '/');
+
+        batch_unindex (node, npath);
+        g_node_unlink (node);
+        apteryx_free_tree (node);
+        if (g_node_first_child (parent) || !name)
+            break;
+        *name = '\0';
+        node = parent;
+    }
+    free (npath);
+}
+
+/**
+ * Set a single value in the pending batch
+ * @param path full path to the leaf
+ * @param value new value for the leaf
+ */
+static void
+batch_set_leaf (const char *path, const char *value)
+{
+    GNode *node;
+
+    if (!reconcile_claim (path, value))
+        return;
+    node = batch_node (path);
+    if (node->children && G_NODE_IS_LEAF (node->children))
+    {
+        free (node->children->data);
+        node->children->data = strdup (value);
+    }
+    else
+    {
+        g_node_append_data (node, strdup (value));
+        batch_count++;
+    }
+}
+
+/**
+ * Merge the leaves of a tree into the pending batch
+ * @param node node of the tree to merge
+ * @param parent full path to the parent of the node (NULL for the root)
+ */
+static void
+batch_merge (GNode *node, const char *parent)
+{
+    GNode *child;
+    char *path;
+
+    if (parent)
+        path = g_strdup_printf ("%s/%s", parent, APTERYX_NAME (node));
+    else
+        path = g_strdup (APTERYX_NAME (node));
+    if (strlen (path) && path[strlen (path) - 1] == '/')
+        path[strlen (path) - 1] = '\0';
+
+    if (node->children && G_NODE_IS_LEAF (node->children))
+    {
+        batch_set_leaf (path, APTERYX_NAME (node->children));
+    }
+    else
+    {
+        for (child = g_node_first_child (node); child; child = g_node_next_sibling (child))
+            batch_merge (child, path);
+    }
+    free (path);
+}
+
+/**
+ * Queue removal of a path from Apteryx
+ * @param path path to prune
+ */
+static void
+batch_prune (const char *path)
+{
+    char *npath = g_strdup (path);
+    char *parent;
+    char *sep;
+
+    if (strlen (npath) && npath[strlen (npath) - 1] == '/')
+        npath[strlen (npath) - 1] = '\0';
+
+    /* Anything we were about to set here is no longer needed */
+    batch_remove (npath);
+
+    /* Nothing to do if a parent is already being pruned */
+    parent = g_strdup (npath);
+    sep = parent + strlen (parent);
+    while (sep)
+    {
+        *sep = '\0';
+        if (g_hash_table_contains (batch_prunes, parent))
+        {
+            free (parent);
+            free (npath);
+            return;
+        }
+        sep = strrchr (parent, '/');
+    }
+    free (parent);
+    g_hash_table_add (batch_prunes, npath);
+    batch_count++;
+}
+
+/**
+ * Send the pending batch to Apteryx
+ * Must be called with the batch lock held
+ */
+static void
+batch_flush (void)
+{
+    GHashTableIter iter;
+    gpointer path;
+
+    if (batch_count == 0)
+        return;
+
+    VERBOSE ("APTERYX: Flushing batch of %d changes\n", batch_count);
+
+    /* Removals first as anything set afterwards was added since */
+    g_hash_table_iter_init (&iter, batch_prunes);
+    while (g_hash_table_iter_next (&iter, &path, NULL))
+        apteryx_prune ((const char *) path);
+    g_hash_table_remove_all (batch_prunes);
+
+    /* One transaction for everything else */
+    if (g_node_first_child (batch_tree))
+        apteryx_set_tree (batch_tree);
+    apteryx_free_tree (batch_tree);
+    g_hash_table_remove_all (batch_index);
+    batch_tree = g_node_new (strdup ("/"));
+    g_hash_table_insert (batch_index, strdup (""), batch_tree);
+    batch_count = 0;
+}
+
+static gboolean
+batch_timeout (gpointer data)
+{
+    g_mutex_lock (&batch_lock);
+    batch_source = 0;
+    batch_flush ();
+    g_mutex_unlock (&batch_lock);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * Flush the batch if it is big enough, otherwise make sure it gets flushed soon
+ * Must be called with the batch lock held
+ */
+static void
+batch_check (void)
+{
+    if (batch_count >= batch_limit)
+        batch_flush ();
+    else if (batch_count && !batch_source)
+        batch_source = g_timeout_add (APTERYX_BATCH_MS, batch_timeout, NULL);
+}
+
+/**
+ * Enable or disable batching of Apteryx updates
+ * Disabling batching flushes any pending changes.
+ * @param enable true to batch updates, false to send them straight away
+ */
+void
+apteryx_batch_enable (bool enable)
+{
+    g_mutex_lock (&batch_lock);
+    if (enable && !batch_enabled)
+    {
+        batch_index = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+        batch_prunes = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+        batch_tree = g_node_new (strdup ("/"));
+        g_hash_table_insert (batch_index, strdup (""), batch_tree);
+        batch_count = 0;
+    }
+    else if (!enable && batch_enabled)
+    {
+        batch_flush ();
+        if (batch_source)
+            g_source_remove (batch_source);
+        batch_source = 0;
+        apteryx_free_tree (batch_tree);
+        batch_tree = NULL;
+        g_hash_table_destroy (batch_index);
+        batch_index = NULL;
+        g_hash_table_destroy (batch_prunes);
+        batch_prunes = NULL;
+    }
+    batch_enabled = enable;
+    g_mutex_unlock (&batch_lock);
+}
+
+/**
+ * Switch the batch between normal and bulk sizes
+ * Bulk mode allows much larger transactions for the initial sync of a
+ * kernel table. Leaving bulk mode flushes any pending changes.
+ * @param bulk true to use large transactions
+ */
+void
+apteryx_batch_bulk (bool bulk)
+{
+    g_mutex_lock (&batch_lock);
+    batch_limit = bulk ? APTERYX_BATCH_BULK_SIZE : APTERYX_BATCH_SIZE;
+    if (batch_enabled && !bulk)
+        batch_flush ();
+    g_mutex_unlock (&batch_lock);
+}
+
+/**
+ * Send any pending batched changes to Apteryx
+ */
+void
+apteryx_batch_flush (void)
+{
+    g_mutex_lock (&batch_lock);
+    if (batch_enabled)
+        batch_flush ();
+    g_mutex_unlock (&batch_lock);
+}
+
+/**
+ * Set a tree of values as part of the current batch
+ * @param tree tree to set (not consumed)
+ * @return true on success
+ */
+bool
+apteryx_batch_set_tree (GNode *tree)
+{
+    g_mutex_lock (&batch_lock);
+    if (!batch_enabled)
+    {
+        g_mutex_unlock (&batch_lock);
+        return apteryx_set_tree (tree);
+    }
+    batch_merge (tree, NULL);
+    batch_check ();
+    g_mutex_unlock (&batch_lock);
+    return true;
+}
+
+/**
+ * Set a single value as part of the current batch
+ * @param path path to the value
+ * @param value new value (NULL to remove)
+ * @return true on success
+ */
+bool
+apteryx_batch_set (const char *path, const char *value)
+{
+    g_mutex_lock (&batch_lock);
+    if (!batch_enabled)
+    {
+        g_mutex_unlock (&batch_lock);
+        return apteryx_set (path, value);
+    }
+    if (value)
+        batch_set_leaf (path, value);
+    else
+        batch_prune (path);
+    batch_check ();
+    g_mutex_unlock (&batch_lock);
+    return true;
+}
+
+/**
+ * Prune a path as part of the current batch
+ * @param path path to prune
+ * @return true on success
+ */
+bool
+apteryx_batch_prune (const char *path)
+{
+    g_mutex_lock (&batch_lock);
+    if (!batch_enabled)
+    {
+        g_mutex_unlock (&batch_lock);
+        return apteryx_prune (path);
+    }
+    batch_prune (path);
+    batch_check ();
+    g_mutex_unlock (&batch_lock);
+    return true;
+}
+
+/**
+ * Record the leaves of an existing tree for reconciliation
+ * @param node node of the tree
+ * @param parent full path to the parent of the node (NULL for the root)
+ * @param leaves table of leaf path to value
+ */
+static void
+reconcile_index (GNode *node, const char *parent, GHashTable *leaves)
+{
+    GNode *child;
+    char *path;
+
+    if (parent)
+        path = g_strdup_printf ("%s/%s", parent, APTERYX_NAME (node));
+    else
+        path = g_strdup (APTERYX_NAME (node));
+    if (strlen (path) && path[strlen (path) - 1] == '/')
+        path[strlen (path) - 1] = '\0';
+
+    if (node->children && G_NODE_IS_LEAF (node->children))
+    {
+        g_hash_table_replace (leaves, path, strdup (APTERYX_NAME (node->children)));
+        return;
+    }
+    for (child = g_node_first_child (node); child; child = g_node_next_sibling (child))
+        reconcile_index (child, path, leaves);
+    free (path);
+}
+
+/**
+ * Read the existing tree at a path, expanding any "*" components
+ * @param path path to read
+ * @param leaves table of leaf path to value
+ * @param roots set of the expanded paths
+ */
+static void
+reconcile_load (const char *path, GHashTable *leaves, GHashTable *roots)
+{
+    const char *wild = strstr (path, "/*");
+    GNode *tree;
+
+    if (wild && (wild[2] == '/' || wild[2] == '\0'))
+    {
+        char *parent = g_strndup (path, wild - path + 1);
+        GList *children = apteryx_search (parent);
+
+        for (GList *iter = children; iter; iter = iter->next)
+        {
+            char *cpath = g_strdup_printf ("%s%s", (char *) iter->data, wild + 2);
+            reconcile_load (cpath, leaves, roots);
+            free (cpath);
+        }
+        g_list_free_full (children, free);
+        free (parent);
+        return;
+    }
+
+    g_hash_table_add (roots, strdup (path));
+    tree = apteryx_get_tree (path);
+    if (tree)
+    {
+        reconcile_index (tree, NULL, leaves);
+        apteryx_free_tree (tree);
+    }
+}
+
+/**
+ * Start reconciling a subtree with what is already in Apteryx
+ * Until apteryx_reconcile_end, batched leaves that already hold the same
+ * value are not sent again. May be called for several subtrees.
+ * @param path root of the subtree (components may be "*")
+ */
+void
+apteryx_reconcile_begin (const char *path)
+{
+    GHashTable *leaves = g_hash_table_new_full (g_str_hash, g_str_equal, free, free);
+    GHashTable *roots = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    reconcile_load (path, leaves, roots);
+
+    g_mutex_lock (&batch_lock);
+    if (!reconcile_leaves)
+    {
+        reconcile_leaves = g_hash_table_new_full (g_str_hash, g_str_equal, free, free);
+        reconcile_live = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+        reconcile_roots = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+        reconcile_batch = !batch_enabled;
+    }
+    g_hash_table_iter_init (&iter, leaves);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        g_hash_table_iter_steal (&iter);
+        g_hash_table_replace (reconcile_leaves, key, value);
+    }
+    g_hash_table_iter_init (&iter, roots);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+        g_hash_table_iter_steal (&iter);
+        g_hash_table_add (reconcile_roots, key);
+    }
+    g_mutex_unlock (&batch_lock);
+    g_hash_table_destroy (leaves);
+    g_hash_table_destroy (roots);
+
+    /* Only batched updates are reconciled */
+    if (reconcile_batch)
+        apteryx_batch_enable (true);
+    VERBOSE ("APTERYX: Reconciling %s\n", path);
+}
+
+static gint
+reconcile_shortest (gconstpointer a, gconstpointer b)
+{
+    return strlen ((const char *) a) - strlen ((const char *) b);
+}
+
+/**
+ * Finish reconciling, pruning everything that was not published again
+ * Stale leaves are pruned at the highest point that holds nothing new.
+ */
+void
+apteryx_reconcile_end (void)
+{
+    GHashTable *stale;
+    GHashTableIter iter;
+    gpointer key;
+    GList *paths;
+    bool disable;
+
+    g_mutex_lock (&batch_lock);
+    if (!reconcile_leaves)
+    {
+        g_mutex_unlock (&batch_lock);
+        return;
+    }
+    stale = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+    g_hash_table_iter_init (&iter, reconcile_leaves);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+        char *path = g_strdup ((const char *) key);
+        char *sep;
+
+        while (!g_hash_table_contains (reconcile_roots, path) &&
+               (sep = strrchr (path, '/')) != NULL && sep != path)
+        {
+            *sep = '\0';
+            if (g_hash_table_contains (reconcile_live, path))
+            {
+                *sep = '/';
+                break;
+            }
+        }
+        g_hash_table_add (stale, path);
+    }
+
+    /* Parents first so their children are skipped */
+    paths = g_list_sort (g_hash_table_get_keys (stale), reconcile_shortest);
+    VERBOSE ("APTERYX: Reconcile pruning %d paths\n", g_list_length (paths));
+    for (GList *iter = paths; iter; iter = iter->next)
+        batch_prune ((const char *) iter->data);
+    g_list_free (paths);
+    g_hash_table_destroy (stale);
+
+    g_hash_table_destroy (reconcile_leaves);
+    g_hash_table_destroy (reconcile_live);
+    g_hash_table_destroy (reconcile_roots);
+    reconcile_leaves = reconcile_live = reconcile_roots = NULL;
+    batch_flush ();
+    disable = reconcile_batch;
+    reconcile_batch = false;
+    g_mutex_unlock (&batch_lock);
+
+    if (disable)
+        apteryx_batch_enable (false);
+}
+
+/**
+ * Append the leaves of a tree to a string
+ * @param str string to append to
+ * @param node node of the tree
+ * @param depth depth of the node below the root
+ */
+static void
+tree_projection (GString *str, GNode *node, int depth)
+{
+    GNode *child;
+
+    if (node->children && G_NODE_IS_LEAF (node->children))
+    {
+        g_string_append_printf (str, "%d:%s=%s\n", depth, APTERYX_NAME (node),
+                                APTERYX_NAME (node->children));
+        return;
+    }
+    g_string_append_printf (str, "%d:%s\n", depth, APTERYX_NAME (node));
+    for (child = g_node_first_child (node); child; child = g_node_next_sibling (child))
+        tree_projection (str, child, depth + 1);
+}
+
+/**
+ * Check whether a tree differs from what was last published at its root path
+ * The table is updated with the new tree when it has changed.
+ * @param published table of root path to published projection
+ * @param tree tree about to be published
+ * @return true if the tree needs to be published
+ */
+bool
+apteryx_tree_changed (GHashTable *published, GNode *tree)
+{
+    GString *str = g_string_new (NULL);
+    const char *last;
+    char *projection;
+
+    tree_projection (str, tree, 0);
+    projection = g_string_free (str, false);
+    last = (const char *) g_hash_table_lookup (published, APTERYX_NAME (tree));
+    if (last && strcmp (last, projection) == 0)
+    {
+        g_free (projection);
+        return false;
+    }
+    g_hash_table_insert (published, strdup (APTERYX_NAME (tree)), projection);
+    return true;
+}
+
+/* Counters we provide to Apteryx */
+static GHashTable *counters = NULL;
+static GMutex counters_lock = { };
+
+static char *
+counter_provide (const char *path)
+{
+    uint64_t *counter;
+    char *value = NULL;
+
+    g_mutex_lock (&counters_lock);
+    counter = counters ? (uint64_t *) g_hash_table_lookup (counters, path) : NULL;
+    if (counter)
+        value = g_strdup_printf ("%" PRIu64, *counter);
+    g_mutex_unlock (&counters_lock);
+    return value;
+}
+
+/**
+ * Make a counter readable from Apteryx
+ * @param path path to provide the counter at
+ * @param counter the counter (must remain valid until unregistered)
+ * @return true on success
+ */
+bool
+apteryx_counter_register (const char *path, uint64_t *counter)
+{
+    g_mutex_lock (&counters_lock);
+    if (!counters)
+        counters = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+    g_hash_table_insert (counters, strdup (path), counter);
+    g_mutex_unlock (&counters_lock);
+    return apteryx_provide (path, counter_provide);
+}
+
+/**
+ * Stop providing a counter to Apteryx
+ * @param path path the counter was provided at
+ */
+void
+apteryx_counter_unregister (const char *path)
+{
+    apteryx_unprovide (path, counter_provide);
+    g_mutex_lock (&counters_lock);
+    if (counters)
+        g_hash_table_remove (counters, path);
+    g_mutex_unlock (&counters_lock);
 }
@@ -24,12 +24,156 @@ class PathPlugin(plugin.PyangPlugin):
 
     def emit(self, ctx, modules, fd):
         for module in modules:
+            schema = SchemaNode('')
+            enums = []
             children = [child for child in module.i_children]
             for child in children:
-                print_node(child, module, fd, ctx)
+                print_node(child, module, fd, ctx, schema=schema, enums=enums)
+            print_schema(schema, module, fd)
+            print_enums(enums, module, fd)
         fd.write('\n')
 
 
+class SchemaNode(object):
+    """One path component in the schema used by apteryx_path_match"""
+
+    def __init__(self, name):
+        self.name = name
+        self.children = []
+        self.define = None
+        self.index = 0
+
+    def child(self, name):
+        for child in self.children:
+            if child.name == name:
+                return child
+        child = SchemaNode(name)
+        self.children.append(child)
+        return child
+
+
+def schema_add(schema, path, define, keyword):
+    node = schema
+    for name in [n for n in path.split('/') if n != '']:
+        node = node.child(name)
+    node.define = define[:-len('_PATH')] if define.endswith('_PATH') else define
+    # Keys and leaf-list values are wildcards below the node
+    if keyword in ['list', 'leaf-list']:
+        node.child('*')
+
+
+def schema_flatten(node, nodes):
+    # Wildcards go last so named components match first
+    node.children.sort(key=lambda c: c.name == '*')
+    node.index = len(nodes)
+    nodes.append(node)
+    for child in node.children:
+        schema_flatten(child, nodes)
+
+
+def print_schema(schema, module, fd):
+    nodes = []
+    schema_flatten(schema, nodes)
+    name = module.arg.replace('-', '_') + '_schema'
+
+    fd.write('\n/* Path schema for apteryx_path_match */\n')
+    fd.write('#ifndef ' + name.upper() + '\n')
+    fd.write('#define ' + name.upper() + ' ' + name + '\n')
+    fd.write('enum\n{\n')
+    for node in nodes:
+        if node.define is not None:
+            fd.write('    ' + node.define + '_NODE = ' + str(node.index) + ',\n')
+    fd.write('};\n')
+    fd.write('static const apteryx_schema ' + name + '[] __attribute__ ((unused)) = {\n')
+    for node in nodes:
+        child = node.children[0].index if node.children else 0
+        sibling = 0
+        if node.index != 0:
+            parent = [n for n in nodes if node in n.children][0]
+            pos = parent.children.index(node)
+            if pos + 1 < len(parent.children):
+                sibling = parent.children[pos + 1].index
+        fd.write('    { "' + node.name + '", ' + str(child) + ', ' + str(sibling) + ' },\n')
+    fd.write('};\n')
+    fd.write('#endif\n')
+
+
+def enum_type(type):
+    # Follow typedefs down to the enumeration they are built on
+    while type is not None and type.arg != 'enumeration':
+        typedef = getattr(type, 'i_typedef', None)
+        if typedef is None:
+            return None
+        type = typedef.search_one('type')
+    return type
+
+
+def enum_values(type):
+    values = []
+    count = 0
+    for enum in type.substmts:
+        if enum.keyword != 'enum':
+            continue
+        val = enum.search_one('value')
+        if val is not None:
+            try:
+                count = int(val.arg)
+            except ValueError:
+                pass
+        values.append((enum.arg, count))
+        count = count + 1
+    return values
+
+
+def fnv1a(name, seed):
+    hash = (2166136261 ^ seed) & 0xffffffff
+    for c in bytearray(name.encode('utf-8')):
+        hash = ((hash ^ c) * 16777619) & 0xffffffff
+    return hash
+
+
+def perfect_hash(names):
+    # Smallest table, and a seed for it, where no two names share a slot
+    size = max(len(names), 1)
+    while True:
+        for seed in range(256):
+            if len(set(fnv1a(n, seed) % size for n in names)) == len(names):
+                return size, seed
+        size = size + 1
+
+
+def print_enums(enums, module, fd):
+    if not enums:
+        return
+    guard = module.arg.replace('-', '_').upper() + '_ENUMS'
+
+    fd.write('\n/* Enum tables for apteryx_enum_lookup and apteryx_enum_name */\n')
+    fd.write('#ifndef ' + guard + '\n')
+    fd.write('#define ' + guard + '\n')
+    for define, values in enums:
+        name = define.lower() + '_enum'
+        size, seed = perfect_hash([n for n, v in values])
+        slots = [None] * size
+        for n, v in values:
+            slots[fnv1a(n, seed) % size] = (n, v)
+        fd.write('static const apteryx_enum ' + name + '_slots[] __attribute__ ((unused)) = {\n')
+        for slot in slots:
+            if slot is None:
+                fd.write('    { NULL, 0 },\n')
+            else:
+                fd.write('    { "' + slot[0] + '", ' + str(slot[1]) + ' },\n')
+        fd.write('};\n')
+        fd.write('static const apteryx_enum ' + name + '_values[] __attribute__ ((unused)) = {\n')
+        for n, v in sorted(values, key=lambda nv: nv[1]):
+            fd.write('    { "' + n + '", ' + str(v) + ' },\n')
+        fd.write('};\n')
+        fd.write('static const apteryx_enum_table ' + name + ' __attribute__ ((unused)) = {\n')
+        fd.write('    ' + str(size) + ', ' + str(seed) + ', false, ' + name + '_slots, ' +
+                 str(len(values)) + ', ' + name + '_values\n')
+        fd.write('};\n')
+    fd.write('#endif\n')
+
+
 def mk_path_str(s, level=0, strip=0, fd=None):
     #print('LEVEL: ' + str(level) + ' STRIP:' + str(strip) + ' ' + s.arg)
     if level > strip:
@@ -51,7 +195,7 @@ def mk_path_str_define(s):
         return p + "/" + s.arg
 
 
-def print_node(node, module, fd, ctx, level=0, strip=0):
+def print_node(node, module, fd, ctx, level=0, strip=0, base='', schema=None, enums=None):
     #print('TYPE:' + node.keyword + 'LEVEL:' + str(level) + 'STRIP:' + str(strip))
 
     # No need to include these nodes
@@ -87,6 +231,13 @@ def print_node(node, module, fd, ctx, level=0, strip=0):
     # Ouput define
     fd.write('#define ' + define + ' "' + value + '"\n')
 
+    # Full path with "*" for each list key, as used in Apteryx
+    path = value if strip == 0 else base + '/' + value
+    if schema is not None:
+        schema_add(schema, path, define, node.keyword)
+    if node.keyword == 'list':
+        base = path + '/*'
+
     type = node.search_one('type')
     if type is not None:
         if type.arg == 'boolean':
@@ -109,6 +260,11 @@ def print_node(node, module, fd, ctx, level=0, strip=0):
                     fd.write('#define ' + define + '_' + enum.arg.upper().replace('-', '_') + ' ' + str(count) + '\n')
                 count = count + 1
 
+    # Lookup tables for every enumeration, including those from typedefs
+    if enums is not None and enum_type(type) is not None:
+        enums.append((define[:-len('_PATH')] if define.endswith('_PATH') else define,
+                      enum_values(enum_type(type))))
+
     # Default value
     def_val = node.search_one('default')
     if def_val is not None:
@@ -125,4 +281,4 @@ def print_node(node, module, fd, ctx, level=0, strip=0):
     # Process children
     if hasattr(node, 'i_children'):
         for child in node.i_children:
-            print_node(child, module, fd, ctx, level + 1, strip)
+            print_node(child, module, fd, ctx, level + 1, strip, base, schema, enums)
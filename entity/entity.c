@@ -19,7 +19,7 @@
  */
 #include "kermond.h"
 #include <netlink/route/addr.h>
-#include <netlink/route/link.h>
+#include <linux/netfilter.h>
 #include "entity.h"
 
 typedef enum
@@ -30,26 +30,298 @@ typedef enum
 struct dynamic_entity_info
 {
     char *entity;
+    char *name;
     dynamic_type type;
     int family;
     char *interface;
     bool deleted;
 };
 
-/* Fallback if we have no link cache */
-extern unsigned int if_nametoindex (const char *ifname);
-extern char *if_indextoname (unsigned int ifindex, char *ifname);
-
 /* Required caches */
 static struct nl_cache *addr_cache = NULL;
-static struct nl_cache *link_cache = NULL;
 
-/* Dynamic entity lists */
-static GList *dynamic_entities = NULL;
-static GMutex list_lock = { };
+/* Dynamic entities by address family and interface name. Address
+ * events only read the index so they share the lock. */
+static GHashTable *dynamic_entities = NULL;
+static GRWLock entities_lock = { };
+
+static char *
+dynamic_key (int family, const char *ifname)
+{
+    return g_strdup_printf ("%d/%s", family, ifname);
+}
+
+static void
+dynamic_entity_free (struct dynamic_entity_info *info)
+{
+    free (info->entity);
+    free (info->name);
+    free (info->interface);
+    free (info);
+}
+
+/* Optional export of each dynamic host's subnets to an nftables
+ * interval set. Prefixes are counted as several addresses can share one
+ * and only prefixes not covered by another are put in the set. Each
+ * address is counted once per entity as the cache walk and the address
+ * event can both report it. */
+#define EXPORT_IPV4_ADDR 7 /* nft ipv4_addr type */
+#define EXPORT_IPV6_ADDR 8 /* nft ipv6_addr type */
+typedef struct export_prefix
+{
+    int family;
+    int plen;
+    int refcount;
+    uint8_t addr[16];
+} export_prefix;
+static char *export_table = NULL;
+static GHashTable *export_entities = NULL;
+static GHashTable *export_sets = NULL;
+static GHashTable *export_addresses = NULL;
+static nft_batch *export_batch = NULL;
+static GMutex export_lock = { };
+
+static guint
+export_prefix_hash (gconstpointer key)
+{
+    const export_prefix *p = (const export_prefix *) key;
+    guint hash = p->family * 131 + p->plen;
+    int i;
+
+    for (i = 0; i < sizeof (p->addr); i++)
+        hash = hash * 31 + p->addr[i];
+    return hash;
+}
+
+static gboolean
+export_prefix_equal (gconstpointer a, gconstpointer b)
+{
+    const export_prefix *pa = (const export_prefix *) a;
+    const export_prefix *pb = (const export_prefix *) b;
+
+    return pa->family == pb->family && pa->plen == pb->plen &&
+        memcmp (pa->addr, pb->addr, sizeof (pa->addr)) == 0;
+}
+
+/* True if a is a shorter prefix that contains b */
+static bool
+export_covers (export_prefix *a, export_prefix *b)
+{
+    int i;
+
+    if (a->family != b->family || a->plen >= b->plen)
+        return false;
+    for (i = 0; i < a->plen; i++)
+    {
+        if (((a->addr[i >> 3] ^ b->addr[i >> 3]) >> (7 - (i & 7))) & 1)
+            return false;
+    }
+    return true;
+}
+
+/* True if p belongs in the kernel set, ignoring skip */
+static bool
+export_visible (GHashTable *prefixes, export_prefix *p, export_prefix *skip)
+{
+    GHashTableIter iter;
+    export_prefix *q;
+
+    g_hash_table_iter_init (&iter, prefixes);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &q, NULL))
+    {
+        if (q != p && q != skip && export_covers (q, p))
+            return false;
+    }
+    return true;
+}
+
+/* Queue a set change, creating and emptying the set on first use */
+static void
+export_send (const char *entity, export_prefix *p, bool add)
+{
+    char *set;
+    int len = p->family == AF_INET ? 4 : 16;
+
+    if (!export_table)
+        return;
+    if (!export_batch)
+        export_batch = nft_batch_new ();
+    set = g_strdup_printf ("%s_ipv%d", entity, p->family == AF_INET ? 4 : 6);
+    if (!g_hash_table_contains (export_sets, set))
+    {
+        nft_batch_add_table (export_batch, NFPROTO_INET, export_table);
+        nft_batch_add_set (export_batch, NFPROTO_INET, export_table, set,
+                           p->family == AF_INET ? EXPORT_IPV4_ADDR : EXPORT_IPV6_ADDR, len, true);
+        nft_batch_flush_set (export_batch, NFPROTO_INET, export_table, set);
+        g_hash_table_add (export_sets, strdup (set));
+    }
+    VERBOSE ("ENTITY: %s prefix /%d %s %s\n", add ? "adding" : "removing", p->plen,
+             add ? "to" : "from", set);
+    nft_batch_set_prefix (export_batch, NFPROTO_INET, export_table, set, p->addr, len,
+                          p->plen, add);
+    free (set);
+}
+
+/* Rebuild every set from our state
+ * Must be called with the export lock held */
+static void
+export_resync (void)
+{
+    GHashTableIter iter, piter;
+    gpointer entity, set;
+    GHashTable *prefixes;
+    export_prefix *p;
+
+    if (export_batch)
+        nft_batch_free (export_batch);
+    export_batch = NULL;
+    if (!export_table)
+        return;
+    export_batch = nft_batch_new ();
+    g_hash_table_iter_init (&iter, export_sets);
+    while (g_hash_table_iter_next (&iter, &set, NULL))
+        nft_batch_flush_set (export_batch, NFPROTO_INET, export_table, set);
+    g_hash_table_remove_all (export_sets);
+
+    g_hash_table_iter_init (&iter, export_entities);
+    while (g_hash_table_iter_next (&iter, &entity, (gpointer *) &prefixes))
+    {
+        g_hash_table_iter_init (&piter, prefixes);
+        while (g_hash_table_iter_next (&piter, (gpointer *) &p, NULL))
+        {
+            if (export_visible (prefixes, p, NULL))
+                export_send (entity, p, true);
+        }
+    }
+    if (!nft_batch_commit (export_batch))
+        ERROR ("ENTITY: Failed to export entities to \"%s\"\n", export_table);
+    export_batch = NULL;
+}
+
+static void
+export_begin (void)
+{
+    g_mutex_lock (&export_lock);
+    if (!export_entities)
+    {
+        export_entities = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+                                                 (GDestroyNotify) g_hash_table_destroy);
+        export_sets = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+        export_addresses = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+    }
+}
+
+/* Commit the changes queued since export_begin */
+static void
+export_end (void)
+{
+    if (export_batch && !nft_batch_commit (export_batch))
+    {
+        /* The kernel no longer matches what we sent so start again */
+        export_batch = NULL;
+        export_resync ();
+    }
+    export_batch = NULL;
+    g_mutex_unlock (&export_lock);
+}
+
+/* Count an address for an entity, updating its set if the covering prefixes change
+ * Adding an address already counted, or removing one that is not, does nothing
+ * Must be called between export_begin and export_end */
+static void
+export_update (const char *entity, struct nl_addr *addr, bool add)
+{
+    export_prefix key = { };
+    export_prefix *p, *q;
+    GHashTable *prefixes;
+    GHashTableIter iter;
+    char addr_str[INET6_ADDRSTRLEN + 5];
+    char *counted;
+    int i;
+
+    key.family = nl_addr_get_family (addr);
+    key.plen = nl_addr_get_prefixlen (addr);
+    if (nl_addr_get_len (addr) > sizeof (key.addr) || key.plen > nl_addr_get_len (addr) * 8)
+        return;
+    memcpy (key.addr, nl_addr_get_binary_addr (addr), nl_addr_get_len (addr));
+    for (i = 0; i < sizeof (key.addr); i++)
+    {
+        int bits = MIN (MAX (key.plen - i * 8, 0), 8);
+        key.addr[i] &= bits ? 0xff << (8 - bits) : 0;
+    }
+
+    /* Only the first report of an address counts */
+    nl_addr2str (addr, addr_str, sizeof (addr_str));
+    counted = g_strdup_printf ("%s %s", entity, addr_str);
+    if (add == g_hash_table_contains (export_addresses, counted))
+    {
+        free (counted);
+        return;
+    }
+    if (add)
+        g_hash_table_add (export_addresses, counted);
+    else
+    {
+        g_hash_table_remove (export_addresses, counted);
+        free (counted);
+    }
+
+    prefixes = g_hash_table_lookup (export_entities, entity);
+    if (!prefixes && !add)
+        return;
+    if (!prefixes)
+    {
+        prefixes = g_hash_table_new_full (export_prefix_hash, export_prefix_equal, free, NULL);
+        g_hash_table_insert (export_entities, strdup (entity), prefixes);
+    }
+    p = g_hash_table_lookup (prefixes, &key);
+
+    if (add)
+    {
+        if (p)
+        {
+            p->refcount++;
+            return;
+        }
+        p = calloc (1, sizeof (export_prefix));
+        *p = key;
+        p->refcount = 1;
+        g_hash_table_add (prefixes, p);
+        if (!export_visible (prefixes, p, NULL))
+            return;
+        /* Replace any prefixes this one now covers */
+        g_hash_table_iter_init (&iter, prefixes);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &q, NULL))
+        {
+            if (export_covers (p, q) && export_visible (prefixes, q, p))
+                export_send (entity, q, false);
+        }
+        export_send (entity, p, true);
+    }
+    else
+    {
+        if (!p || --p->refcount > 0)
+            return;
+        g_hash_table_steal (prefixes, p);
+        if (export_visible (prefixes, p, NULL))
+        {
+            /* Uncover any prefixes this one was hiding */
+            export_send (entity, p, false);
+            g_hash_table_iter_init (&iter, prefixes);
+            while (g_hash_table_iter_next (&iter, (gpointer *) &q, NULL))
+            {
+                if (export_covers (p, q) && export_visible (prefixes, q, NULL))
+                    export_send (entity, q, true);
+            }
+        }
+        free (p);
+        if (g_hash_table_size (prefixes) == 0)
+            g_hash_table_remove (export_entities, entity);
+    }
+}
 
 static char*
-entity_path (char *zone, char *network, char *host)
+entity_path (const char *zone, const char *network, const char *host)
 {
     if (zone && network && host)
         return g_strdup_printf (ENTITIES_PATH "/%s/" ENTITIES_CHILDREN_PATH "/%s/"
@@ -86,6 +358,7 @@ dynamic_enitity_add_del_address (struct nl_object *obj, void *arg)
     apteryx_set (path, value);
     free (path);
     free (value);
+    export_update (info->name, addr, !info->deleted);
 }
 
 static void
@@ -102,10 +375,7 @@ dynamic_enitity_add_del_addresses (struct dynamic_entity_info *info)
     }
 
     /* Find ifindex for interface */
-    if (link_cache)
-        ifindex = rtnl_link_name2i (link_cache, info->interface);
-    else
-        ifindex = if_nametoindex (info->interface);
+    ifindex = iftable_name2i (info->interface);
     if (ifindex == 0)
     {
         DEBUG ("ENTITY: No ifindex for \"%s\"\n", info->interface);
@@ -114,54 +384,66 @@ dynamic_enitity_add_del_addresses (struct dynamic_entity_info *info)
     addr = rtnl_addr_alloc ();
     rtnl_addr_set_family (addr, info->family);
     rtnl_addr_set_ifindex (addr, ifindex);
+    export_begin ();
     nl_cache_foreach_filter (addr_cache, OBJ_CAST(addr),
             dynamic_enitity_add_del_address, info);
+    export_end ();
     rtnl_addr_put (addr);
 }
 
 static bool
 dynamic_enitity_interface_change (int family,
-        char *zone, char *network, char *host,
+        const char *zone, const char *network, const char *host,
         const char *ifname, bool add)
 {
     char *entity = entity_path (zone, network, host);
+    char *key = dynamic_key (family, ifname);
+    GList *list;
+
     if (add)
     {
         struct dynamic_entity_info *info = calloc (1, sizeof (*info));
         info->entity = entity;
+        info->name = g_strdup_printf ("%s.%s.%s", zone, network, host);
         info->family = family;
         info->type = dynamic_source_interface;
         info->interface = strdup (ifname);
         info->deleted = false;
-        g_mutex_lock (&list_lock);
-        dynamic_entities = g_list_append (dynamic_entities, info);
-        g_mutex_unlock (&list_lock);
+        g_rw_lock_writer_lock (&entities_lock);
+        if (!dynamic_entities)
+            dynamic_entities = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+        list = g_hash_table_lookup (dynamic_entities, key);
+        list = g_list_append (list, info);
+        g_hash_table_replace (dynamic_entities, key, list);
         dynamic_enitity_add_del_addresses (info);
+        g_rw_lock_writer_unlock (&entities_lock);
     }
     else
     {
         GList *iter = NULL, *next = NULL;
-        g_mutex_lock (&list_lock);
-        for (iter = g_list_first (dynamic_entities); iter; iter = next)
+        g_rw_lock_writer_lock (&entities_lock);
+        list = dynamic_entities ? g_hash_table_lookup (dynamic_entities, key) : NULL;
+        for (iter = list; iter; iter = next)
         {
             next = g_list_next (iter);
             struct dynamic_entity_info *info = iter->data;
-            if (info->family == family &&
-                info->type == dynamic_source_interface &&
-                strcmp (info->interface, ifname) == 0 &&
+            if (info->type == dynamic_source_interface &&
                 strcmp (info->entity, entity) == 0)
             {
-                dynamic_entities = g_list_remove_link (dynamic_entities, iter);
+                list = g_list_remove_link (list, iter);
                 info->deleted = true;
                 dynamic_enitity_add_del_addresses (info);
-                free (info->entity);
-                free (info->interface);
-                free (info);
+                dynamic_entity_free (info);
                 g_list_free (iter);
             }
         }
-        g_mutex_unlock (&list_lock);
+        if (list)
+            g_hash_table_replace (dynamic_entities, strdup (key), list);
+        else if (dynamic_entities)
+            g_hash_table_remove (dynamic_entities, key);
+        g_rw_lock_writer_unlock (&entities_lock);
         free (entity);
+        free (key);
     }
 
     return true;
@@ -202,28 +484,25 @@ nl_addr_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj)
     ra = (struct rtnl_addr *) new_obj;
     family = rtnl_addr_get_family (ra);
     addr = rtnl_addr_get_local (ra);
-    if (link_cache)
-        rtnl_link_i2name (link_cache, rtnl_addr_get_ifindex (ra), ifname, sizeof (ifname));
-    else
-        if_indextoname (rtnl_addr_get_ifindex (ra), ifname);
-    if ((family != AF_INET && family != AF_INET6) ||
-        !addr || rtnl_addr_get_ifindex (ra) == 0 || strlen (ifname) == 0)
+    if ((family != AF_INET && family != AF_INET6) || !addr ||
+        rtnl_addr_get_ifindex (ra) == 0 ||
+        !iftable_i2name (rtnl_addr_get_ifindex (ra), ifname) || strlen (ifname) == 0)
     {
         ERROR ("ENTITY: invalid address object\n");
         return;
     }
 
-    /* Find a dynamic entity */
+    /* Find the dynamic entities for this interface */
     GList *iter = NULL;
-    g_mutex_lock (&list_lock);
-    for (iter = g_list_first (dynamic_entities); iter; iter = g_list_next (iter))
+    char *key = dynamic_key (family, ifname);
+    g_rw_lock_reader_lock (&entities_lock);
+    export_begin ();
+    iter = dynamic_entities ? g_hash_table_lookup (dynamic_entities, key) : NULL;
+    for (; iter; iter = g_list_next (iter))
     {
         struct dynamic_entity_info *info = iter->data;
-        if (info->type != dynamic_source_interface ||
-            family != info->family || strcmp (ifname, info->interface) != 0)
-        {
+        if (info->type != dynamic_source_interface)
             continue;
-        }
 
         char addr_str[INET6_ADDRSTRLEN + 1] = "";
         if (nl_addr2str (addr, addr_str, sizeof (addr_str)) == NULL)
@@ -240,8 +519,11 @@ nl_addr_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj)
         apteryx_set (path, value);
         free (path);
         free (value);
+        export_update (info->name, addr, action != NL_ACT_DEL);
     }
-    g_mutex_unlock (&list_lock);
+    export_end ();
+    g_rw_lock_reader_unlock (&entities_lock);
+    free (key);
 }
 
 /**
@@ -253,18 +535,23 @@ nl_addr_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj)
 static bool
 watch_entities (const char *path, const char *value)
 {
-    char zone[64];
-    char network[64];
-    char host[64];
+    apteryx_match match;
+    const char *zone;
+    const char *network;
+    const char *host;
+    const char *ifname;
     int family;
-    char ifname[64];
 
     /* Check dynamic host entities */
-    if (path && sscanf (path, ENTITIES_PATH "/%64[^/]/" ENTITIES_CHILDREN_PATH "/%64[^/]/"
-            ENTITIES_CHILDREN_CHILDREN_PATH "/%64[^/]/" ENTITIES_CHILDREN_CHILDREN_DYNAMIC_PATH
-            "/ipv%d/interfaces/%64s",
-            zone, network, host, &family, ifname) == 5)
+    if (apteryx_path_match (entity_schema, path, &match) && match.nkeys == 4 &&
+        (match.id == ENTITIES_CHILDREN_CHILDREN_DYNAMIC_IPV4_INTERFACES_NODE ||
+         match.id == ENTITIES_CHILDREN_CHILDREN_DYNAMIC_IPV6_INTERFACES_NODE))
     {
+        family = match.id == ENTITIES_CHILDREN_CHILDREN_DYNAMIC_IPV4_INTERFACES_NODE ? 4 : 6;
+        zone = match.keys[0];
+        network = match.keys[1];
+        host = match.keys[2];
+        ifname = match.keys[3];
         VERBOSE ("ENTITY: Dynamic ipv%d host: \"%s.%s.%s\" interface \"%s\"\n",
                 family, zone, network, host, ifname);
         if (value && strcmp (ifname, value) != 0)
@@ -284,6 +571,51 @@ watch_entities (const char *path, const char *value)
     return false;
 }
 
+/**
+ * Process apteryx watch callback for the entity export table
+ * @param path path to variable that has changed
+ * @param value new table name (NULL to stop exporting)
+ * @return true if the callback was expected, false otherwise
+ */
+static bool
+watch_entity_export (const char *path, const char *value)
+{
+    GHashTableIter iter;
+    gpointer set;
+
+    if (!path || strcmp (path, ENTITY_EXPORT_TABLE) != 0)
+    {
+        ERROR ("ENTITY: Unexpected path: %s\n", path);
+        return false;
+    }
+
+    export_begin ();
+    if (export_table && value && strcmp (export_table, value) == 0)
+    {
+        export_end ();
+        return true;
+    }
+
+    /* Remove our sets from the old table (fails while rules use them) */
+    if (export_table && g_hash_table_size (export_sets))
+    {
+        nft_batch *b = nft_batch_new ();
+        g_hash_table_iter_init (&iter, export_sets);
+        while (g_hash_table_iter_next (&iter, &set, NULL))
+            nft_batch_del_set (b, NFPROTO_INET, export_table, set);
+        nft_batch_commit (b);
+    }
+    g_hash_table_remove_all (export_sets);
+    free (export_table);
+    export_table = value ? strdup (value) : NULL;
+
+    /* Fill the new table with everything we know */
+    VERBOSE ("ENTITY: Exporting to \"%s\"\n", value ? value : "");
+    export_resync ();
+    export_end ();
+    return true;
+}
+
 /**
  * Module startup
  * @return true on success, false otherwise
@@ -296,11 +628,17 @@ entity_start ()
     /* Create the addr cache and register for callbacks */
     netlink_register ("route/addr", nl_addr_cb);
     addr_cache = nl_cache_mngt_require_safe ("route/addr");
-    link_cache = nl_cache_mngt_require_safe ("route/link");
 
     /* Watch for changes in configuration */
+    apteryx_watch (ENTITY_EXPORT_TABLE, watch_entity_export);
     apteryx_watch (ENTITIES_PATH "/*", watch_entities);
 
+    /* Pick the export table before loading the entities */
+    char *table = apteryx_get (ENTITY_EXPORT_TABLE);
+    if (table)
+        watch_entity_export (ENTITY_EXPORT_TABLE, table);
+    free (table);
+
     /* Load existing configuration */
     apteryx_rewatch_tree (ENTITIES_PATH, watch_entities);
 
@@ -317,13 +655,40 @@ entity_exit ()
 
     /* Remove watch from Apteryx */
     apteryx_unwatch (ENTITIES_PATH "/*", watch_entities);
+    apteryx_unwatch (ENTITY_EXPORT_TABLE, watch_entity_export);
 
     /* Detach our callback and unref the addr cache */
-    if (link_cache)
-        nl_cache_put (link_cache);
     if (addr_cache)
         nl_cache_put (addr_cache);
     netlink_unregister ("route/addr", nl_addr_cb);
+
+    /* Forget the dynamic entities */
+    g_rw_lock_writer_lock (&entities_lock);
+    if (dynamic_entities)
+    {
+        GHashTableIter iter;
+        gpointer list;
+
+        g_hash_table_iter_init (&iter, dynamic_entities);
+        while (g_hash_table_iter_next (&iter, NULL, &list))
+            g_list_free_full ((GList *) list, (GDestroyNotify) dynamic_entity_free);
+        g_hash_table_destroy (dynamic_entities);
+        dynamic_entities = NULL;
+    }
+    g_rw_lock_writer_unlock (&entities_lock);
+
+    /* Leave exported sets in place for any rules using them */
+    g_mutex_lock (&export_lock);
+    if (export_entities)
+    {
+        g_hash_table_destroy (export_entities);
+        g_hash_table_destroy (export_sets);
+        g_hash_table_destroy (export_addresses);
+    }
+    export_entities = export_sets = export_addresses = NULL;
+    free (export_table);
+    export_table = NULL;
+    g_mutex_unlock (&export_lock);
 }
 
 MODULE_CREATE ("entity", NULL, entity_start, entity_exit);
@@ -26,6 +26,8 @@
 #define HOST    NETWORK "/" ENTITIES_CHILDREN_CHILDREN_PATH "/server"
 #define DYNv4   HOST "/" ENTITIES_CHILDREN_CHILDREN_DYNAMIC_IPV4_INTERFACES "/" IFNAME
 #define DYNv6   HOST "/" ENTITIES_CHILDREN_CHILDREN_DYNAMIC_IPV6_INTERFACES "/" IFNAME
+#define EXPORTED NETWORK "/" ENTITIES_CHILDREN_CHILDREN_PATH "/exported"
+#define EXPv4   EXPORTED "/" ENTITIES_CHILDREN_CHILDREN_DYNAMIC_IPV4_INTERFACES "/" IFNAME
 
 static struct nl_object *
 make_addr (int family, char *addr_str)
@@ -134,6 +136,31 @@ void test_entity_del_dynamic_ipv4 ()
     NP_TEST_END ("")
 }
 
+void test_entity_export_dynamic_ipv4 ()
+{
+    NP_TEST_START
+    setup_test (true, AF_INET, NULL);
+    NP_ASSERT_TRUE (watch_entity_export (ENTITY_EXPORT_TABLE, "firewall"));
+    nft_commits = 0;
+    NP_ASSERT_TRUE (watch_entities (EXPv4, IFNAME));
+    NP_ASSERT_EQUAL (nft_commits, 1);
+    NP_ASSERT_TRUE (g_hash_table_contains (export_sets, "private.lan.exported_ipv4"));
+    NP_ASSERT_NOT_NULL (g_hash_table_lookup (export_entities, "private.lan.exported"));
+    free (apteryx_path);
+    apteryx_path = NULL;
+    free (apteryx_value);
+    apteryx_value = NULL;
+    NP_ASSERT_TRUE (watch_entities (EXPv4, NULL));
+    NP_ASSERT_EQUAL (nft_commits, 2);
+    NP_ASSERT_NULL (g_hash_table_lookup (export_entities, "private.lan.exported"));
+    free (apteryx_path);
+    apteryx_path = NULL;
+    NP_ASSERT_TRUE (watch_entity_export (ENTITY_EXPORT_TABLE, NULL));
+    NP_ASSERT_NULL (export_table);
+    NP_ASSERT_EQUAL (g_hash_table_size (export_sets), 0);
+    NP_TEST_END ("")
+}
+
 void test_entity_action_invalid ()
 {
     NP_TEST_START
@@ -298,3 +325,29 @@ void test_entity_dynamic_ipv6_del_address ()
     NP_ASSERT_NULL (apteryx_value);
     NP_TEST_END ("")
 }
+
+void test_entity_export_address_counted_once ()
+{
+    NP_TEST_START
+    setup_test (true, AF_INET, NULL);
+    NP_ASSERT_TRUE (watch_entity_export (ENTITY_EXPORT_TABLE, "firewall"));
+    NP_ASSERT_TRUE (watch_entities (EXPv4, IFNAME));
+    /* The address event follows the cache walk that already counted it */
+    struct nl_object *addr = make_addr (AF_INET, IP4ADDR);
+    nl_addr_cb (NL_ACT_NEW, NULL, addr);
+    GHashTable *prefixes = g_hash_table_lookup (export_entities, "private.lan.exported");
+    NP_ASSERT_NOT_NULL (prefixes);
+    NP_ASSERT_EQUAL (g_hash_table_size (prefixes), 1);
+    GHashTableIter iter;
+    export_prefix *p;
+    g_hash_table_iter_init (&iter, prefixes);
+    NP_ASSERT_TRUE (g_hash_table_iter_next (&iter, (gpointer *) &p, NULL));
+    NP_ASSERT_EQUAL (p->refcount, 1);
+    /* One delete releases it, a second is ignored */
+    nl_addr_cb (NL_ACT_DEL, NULL, addr);
+    NP_ASSERT_NULL (g_hash_table_lookup (export_entities, "private.lan.exported"));
+    nl_addr_cb (NL_ACT_DEL, NULL, addr);
+    NP_ASSERT_NULL (g_hash_table_lookup (export_entities, "private.lan.exported"));
+    nl_object_put (addr);
+    NP_TEST_END ("")
+}
@@ -19,6 +19,86 @@
  */
 #include "kermond.h"
 #include "ip-icmp.h"
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+
+/* nftables table and chain holding our rules */
+#define ICMP_TABLE "kermond"
+#define ICMP_CHAIN "icmp"
+
+/* Rules currently programmed into the ICMP chain */
+static bool drop_unreach_v4 = false;
+static bool drop_unreach_v6 = false;
+static bool icmp_chain_ready = false;
+static GMutex icmp_lock = { };
+
+/* Add the table and chain, flushing any rules left from a previous run */
+static void
+icmp_chain_add (nft_batch *b)
+{
+    nft_batch_add_table (b, NFPROTO_INET, ICMP_TABLE);
+    nft_batch_add_chain (b, NFPROTO_INET, ICMP_TABLE, ICMP_CHAIN,
+                         NF_INET_LOCAL_OUT, 0);
+    nft_batch_flush_chain (b, NFPROTO_INET, ICMP_TABLE, ICMP_CHAIN);
+}
+
+static void
+icmp_drop_rule (nft_batch *b, uint8_t nfproto, uint8_t l4proto, uint8_t type)
+{
+    nft_batch_rule_begin (b, NFPROTO_INET, ICMP_TABLE, ICMP_CHAIN);
+    nft_rule_meta (b, NFT_META_NFPROTO);
+    nft_rule_cmp (b, &nfproto, sizeof (nfproto));
+    nft_rule_meta (b, NFT_META_L4PROTO);
+    nft_rule_cmp (b, &l4proto, sizeof (l4proto));
+    nft_rule_payload (b, NFT_PAYLOAD_TRANSPORT_HEADER, 0, sizeof (type));
+    nft_rule_cmp (b, &type, sizeof (type));
+    nft_rule_verdict (b, NF_DROP);
+    nft_batch_rule_end (b);
+}
+
+/**
+ * Drop or allow outgoing destination unreachable messages. The chain is
+ * rebuilt in a single batch, and only when the cached state changes.
+ * @param v6 true for ICMPv6, false for ICMPv4
+ * @param drop true to drop destination unreachable messages
+ * @return true on success, false on failure
+ */
+static bool
+icmp_drop_unreachable (bool v6, bool drop)
+{
+    bool drop_v4;
+    bool drop_v6;
+    bool rc = true;
+
+    /* Both families share the chain, so work out the rules under the lock */
+    g_mutex_lock (&icmp_lock);
+    drop_v4 = v6 ? drop_unreach_v4 : drop;
+    drop_v6 = v6 ? drop : drop_unreach_v6;
+    if (drop_v4 != drop_unreach_v4 || drop_v6 != drop_unreach_v6)
+    {
+        nft_batch *b = nft_batch_new ();
+        /* Retry creating the chain if that failed at startup */
+        if (!icmp_chain_ready)
+            icmp_chain_add (b);
+        else
+            nft_batch_flush_chain (b, NFPROTO_INET, ICMP_TABLE, ICMP_CHAIN);
+        if (drop_v4)
+            icmp_drop_rule (b, NFPROTO_IPV4, IPPROTO_ICMP, ICMP_DEST_UNREACH);
+        if (drop_v6)
+            icmp_drop_rule (b, NFPROTO_IPV6, IPPROTO_ICMPV6, ICMP6_DST_UNREACH);
+        rc = nft_batch_commit (b);
+        if (rc)
+        {
+            icmp_chain_ready = true;
+            drop_unreach_v4 = drop_v4;
+            drop_unreach_v6 = drop_v6;
+        }
+    }
+    g_mutex_unlock (&icmp_lock);
+    return rc;
+}
 
 /**
  * Process apteryx watch callback for ICMPv4 settings
@@ -30,7 +110,6 @@ static bool
 watch_icmpv4_settings (const char *path, const char *value)
 {
     char parameter[64];
-    char *cmd = NULL;
     int val;
     int rc = 0;
 
@@ -44,22 +123,8 @@ watch_icmpv4_settings (const char *path, const char *value)
     /* send-destination-unreachable */
     if (strcmp (parameter, "send-destination-unreachable") == 0)
     {
-        if (apteryx_parse_boolean (path, value, true) == false)
-        {
-            /* Add the rule only if it does not exist in the table */
-            rc = system
-                ("iptables -C ICMP -p icmp --icmp-type destination-unreachable -j DROP");
-            if (rc != 0)
-            {
-                rc = system
-                    ("iptables -I ICMP -p icmp --icmp-type destination-unreachable -j DROP");
-            }
-        }
-        else
-        {
-            rc = system
-                ("iptables -D ICMP -p icmp --icmp-type destination-unreachable -j DROP");
-        }
+        bool send = apteryx_parse_boolean (path, value, true);
+        rc = icmp_drop_unreachable (false, !send) ? 0 : -1;
     }
     /* error-ratelimit */
     else if (strcmp (parameter, "error-ratelimit") == 0)
@@ -73,7 +138,7 @@ watch_icmpv4_settings (const char *path, const char *value)
                 ERROR ("ICMP: Invalid ratelimit value (%s) using default (%d)\n", value, val);
             }
         }
-        cmd = g_strdup_printf ("sysctl -w net.ipv4.icmp_ratelimit=%d", val);
+        sysctl_set ("net/ipv4/icmp_ratelimit", val);
     }
     else
     {
@@ -81,14 +146,6 @@ watch_icmpv4_settings (const char *path, const char *value)
         return true;
     }
 
-    /* Make a change if required */
-    if (cmd)
-    {
-        VERBOSE ("ICMP: %s\n", cmd);
-        rc = system (cmd);
-        free (cmd);
-    }
-
     return (rc == 0);
 }
 
@@ -102,7 +159,6 @@ static bool
 watch_icmpv6_settings (const char *path, const char *value)
 {
     char parameter[64];
-    char *cmd = NULL;
     int val;
     int rc = 0;
 
@@ -116,22 +172,8 @@ watch_icmpv6_settings (const char *path, const char *value)
     /* send-destination-unreachable */
     if (strcmp (parameter, "send-destination-unreachable") == 0)
     {
-        if (apteryx_parse_boolean (path, value, true) == false)
-        {
-            /* Add the rule only if it does not exist in the table */
-            rc = system
-                ("ip6tables -C ICMP -p icmpv6 --icmpv6-type destination-unreachable -j DROP");
-            if (rc != 0)
-            {
-                rc = system
-                    ("ip6tables -I ICMP -p icmpv6 --icmpv6-type destination-unreachable -j DROP");
-            }
-        }
-        else
-        {
-            rc = system
-                ("ip6tables -D ICMP -p icmpv6 --icmpv6-type destination-unreachable -j DROP");
-        }
+        bool send = apteryx_parse_boolean (path, value, true);
+        rc = icmp_drop_unreachable (true, !send) ? 0 : -1;
     }
     /* error-ratelimit */
     else if (strcmp (parameter, "error-ratelimit") == 0)
@@ -145,7 +187,7 @@ watch_icmpv6_settings (const char *path, const char *value)
                 ERROR ("ICMP: Invalid ratelimit value (%s) using default (%d)\n", value, val);
             }
         }
-        cmd = g_strdup_printf ("sysctl -w net.ipv6.icmp_ratelimit=%d", val);
+        sysctl_set ("net/ipv6/icmp_ratelimit", val);
     }
     else
     {
@@ -153,14 +195,6 @@ watch_icmpv6_settings (const char *path, const char *value)
         return true;
     }
 
-    /* Make a change if required */
-    if (cmd)
-    {
-        VERBOSE ("ICMP: %s\n", cmd);
-        rc = system (cmd);
-        free (cmd);
-    }
-
     return (rc == 0);
 }
 
@@ -171,15 +205,20 @@ watch_icmpv6_settings (const char *path, const char *value)
 static bool
 icmp_init (void)
 {
-    int rc;
+    nft_batch *b;
 
     DEBUG ("ICMP: Initialising\n");
 
-    /* Add chain for ICMP rules */
-    rc = system ("iptables -N ICMP");
-    syslog (LOG_DEBUG, "iptables add chain return value: %d", rc);
-    rc = system ("ip6tables -N ICMP");
-    syslog (LOG_DEBUG, "ip6tables add chain return value: %d", rc);
+    /* Add chain for ICMP rules, dropping any left from a previous run */
+    b = nft_batch_new ();
+    icmp_chain_add (b);
+    icmp_chain_ready = nft_batch_commit (b);
+    if (!icmp_chain_ready)
+    {
+        ERROR ("ICMP: Failed to create nftables chain, retrying on the first change\n");
+    }
+    drop_unreach_v4 = false;
+    drop_unreach_v6 = false;
 
     return true;
 }
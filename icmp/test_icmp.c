@@ -27,6 +27,7 @@ setup_test (char *cmd, char *ignore)
     if (cmd)
         cmds = g_list_append (cmds, strdup (cmd));
     np_mock (system, mock_system);
+    nft_commits = 0;
     if (ignore)
         np_syslog_ignore (ignore);
 }
@@ -61,40 +62,60 @@ void test_icmp4_invalid_parameter ()
 void test_icmpv4_dest_unreach_value_null ()
 {
     NP_TEST_START
-    setup_test ("iptables -D ICMP -p icmp --icmp-type destination-unreachable -j DROP", NULL);
+    setup_test (NULL, NULL);
     NP_ASSERT_TRUE (watch_icmpv4_settings (IP_ICMP_IPV4_SEND_DESTINATION_UNREACHABLE_PATH, NULL));
-    NP_ASSERT_NULL (cmds);
+    NP_ASSERT_FALSE (drop_unreach_v4);
+    NP_ASSERT_EQUAL (nft_commits, 0);
     NP_TEST_END ("");
 }
 
 void test_icmpv4_dest_unreach_enable ()
 {
     NP_TEST_START
-    setup_test ("iptables -D ICMP -p icmp --icmp-type destination-unreachable -j DROP", NULL);
+    setup_test (NULL, NULL);
+    NP_ASSERT_TRUE (watch_icmpv4_settings (IP_ICMP_IPV4_SEND_DESTINATION_UNREACHABLE_PATH, "0"));
     NP_ASSERT_TRUE (watch_icmpv4_settings (IP_ICMP_IPV4_SEND_DESTINATION_UNREACHABLE_PATH, "1"));
-    NP_ASSERT_NULL (cmds);
+    NP_ASSERT_FALSE (drop_unreach_v4);
+    NP_ASSERT_EQUAL (nft_commits, 2);
     NP_TEST_END ("");
 }
 
 void test_icmpv4_dest_unreach_disable ()
 {
     NP_TEST_START
-    setup_test ("iptables -C ICMP -p icmp --icmp-type destination-unreachable -j DROP", NULL);
+    setup_test (NULL, NULL);
     NP_ASSERT_TRUE (watch_icmpv4_settings (IP_ICMP_IPV4_SEND_DESTINATION_UNREACHABLE_PATH, "0"));
-    NP_ASSERT_NULL (cmds);
+    NP_ASSERT_TRUE (watch_icmpv4_settings (IP_ICMP_IPV4_SEND_DESTINATION_UNREACHABLE_PATH, "0"));
+    NP_ASSERT_TRUE (drop_unreach_v4);
+    NP_ASSERT_EQUAL (nft_commits, 1);
     NP_TEST_END ("");
 }
 
 void test_icmpv4_dest_unreach_value_invalid ()
 {
     NP_TEST_START
-    setup_test ("iptables -D ICMP -p icmp --icmp-type destination-unreachable -j DROP",
-            "Invalid /ip/icmp/ipv4/send-destination-unreachable value");
+    setup_test (NULL, "Invalid /ip/icmp/ipv4/send-destination-unreachable value");
     NP_ASSERT_TRUE (watch_icmpv4_settings (IP_ICMP_IPV4_SEND_DESTINATION_UNREACHABLE_PATH, "dog"));
-    NP_ASSERT_NULL (cmds);
+    NP_ASSERT_FALSE (drop_unreach_v4);
+    NP_ASSERT_EQUAL (nft_commits, 0);
     NP_TEST_END ("Invalid /ip/icmp/ipv4/send-destination-unreachable value (dog) using default (1)\n");
 }
 
+void test_icmp_dest_unreach_both ()
+{
+    NP_TEST_START
+    setup_test (NULL, NULL);
+    NP_ASSERT_TRUE (watch_icmpv4_settings (IP_ICMP_IPV4_SEND_DESTINATION_UNREACHABLE_PATH, "0"));
+    NP_ASSERT_TRUE (watch_icmpv6_settings (IP_ICMP_IPV6_SEND_DESTINATION_UNREACHABLE_PATH, "0"));
+    NP_ASSERT_TRUE (drop_unreach_v4);
+    NP_ASSERT_TRUE (drop_unreach_v6);
+    NP_ASSERT_TRUE (watch_icmpv4_settings (IP_ICMP_IPV4_SEND_DESTINATION_UNREACHABLE_PATH, "1"));
+    NP_ASSERT_FALSE (drop_unreach_v4);
+    NP_ASSERT_TRUE (drop_unreach_v6);
+    NP_ASSERT_EQUAL (nft_commits, 3);
+    NP_TEST_END ("");
+}
+
 void test_icmpv4_error_ratelimit_value_null ()
 {
     NP_TEST_START
@@ -179,37 +200,42 @@ void test_icmp6_invalid_parameter ()
 void test_icmpv6_dest_unreach_value_null ()
 {
     NP_TEST_START
-    setup_test ("ip6tables -D ICMP -p icmpv6 --icmpv6-type destination-unreachable -j DROP", NULL);
+    setup_test (NULL, NULL);
     NP_ASSERT_TRUE (watch_icmpv6_settings (IP_ICMP_IPV6_SEND_DESTINATION_UNREACHABLE_PATH, NULL));
-    NP_ASSERT_NULL (cmds);
+    NP_ASSERT_FALSE (drop_unreach_v6);
+    NP_ASSERT_EQUAL (nft_commits, 0);
     NP_TEST_END ("");
 }
 
 void test_icmpv6_dest_unreach_enable ()
 {
     NP_TEST_START
-    setup_test ("ip6tables -D ICMP -p icmpv6 --icmpv6-type destination-unreachable -j DROP", NULL);
+    setup_test (NULL, NULL);
+    NP_ASSERT_TRUE (watch_icmpv6_settings (IP_ICMP_IPV6_SEND_DESTINATION_UNREACHABLE_PATH, "0"));
     NP_ASSERT_TRUE (watch_icmpv6_settings (IP_ICMP_IPV6_SEND_DESTINATION_UNREACHABLE_PATH, "1"));
-    NP_ASSERT_NULL (cmds);
+    NP_ASSERT_FALSE (drop_unreach_v6);
+    NP_ASSERT_EQUAL (nft_commits, 2);
     NP_TEST_END ("");
 }
 
 void test_icmpv6_dest_unreach_disable ()
 {
     NP_TEST_START
-    setup_test ("ip6tables -C ICMP -p icmpv6 --icmpv6-type destination-unreachable -j DROP", NULL);
+    setup_test (NULL, NULL);
     NP_ASSERT_TRUE (watch_icmpv6_settings (IP_ICMP_IPV6_SEND_DESTINATION_UNREACHABLE_PATH, "0"));
-    NP_ASSERT_NULL (cmds);
+    NP_ASSERT_TRUE (watch_icmpv6_settings (IP_ICMP_IPV6_SEND_DESTINATION_UNREACHABLE_PATH, "0"));
+    NP_ASSERT_TRUE (drop_unreach_v6);
+    NP_ASSERT_EQUAL (nft_commits, 1);
     NP_TEST_END ("");
 }
 
 void test_icmpv6_dest_unreach_value_invalid ()
 {
     NP_TEST_START
-    setup_test ("ip6tables -D ICMP -p icmpv6 --icmpv6-type destination-unreachable -j DROP",
-            "Invalid /ip/icmp/ipv6/send-destination-unreachable value");
+    setup_test (NULL, "Invalid /ip/icmp/ipv6/send-destination-unreachable value");
     NP_ASSERT_TRUE (watch_icmpv6_settings (IP_ICMP_IPV6_SEND_DESTINATION_UNREACHABLE_PATH, "dog"));
-    NP_ASSERT_NULL (cmds);
+    NP_ASSERT_FALSE (drop_unreach_v6);
+    NP_ASSERT_EQUAL (nft_commits, 0);
     NP_TEST_END ("Invalid /ip/icmp/ipv6/send-destination-unreachable value (dog) using default (1)\n");
 }
 
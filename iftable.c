@@ -0,0 +1,144 @@
+/**
+ * @file iftable.c
+ * Interface index to name table
+ * - Kept current from route/link events for constant time lookups
+ *
+ * Copyright 2017, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "kermond.h"
+#include <netlink/route/link.h>
+
+/* Fallback if the table does not know the interface */
+extern unsigned int if_nametoindex (const char *ifname);
+extern char *if_indextoname (unsigned int ifindex, char *ifname);
+
+/* Interface names by index and indexes by name */
+static GHashTable *by_index = NULL;
+static GHashTable *by_name = NULL;
+static GRWLock iftable_lock = { };
+
+/**
+ * Remove an interface from the table
+ * Must be called with the write lock held
+ * @param ifindex index of the interface to remove
+ */
+static void
+iftable_remove (int ifindex)
+{
+    const char *ifname = g_hash_table_lookup (by_index, GINT_TO_POINTER (ifindex));
+    if (ifname)
+    {
+        if (GPOINTER_TO_INT (g_hash_table_lookup (by_name, ifname)) == ifindex)
+            g_hash_table_remove (by_name, ifname);
+        g_hash_table_remove (by_index, GINT_TO_POINTER (ifindex));
+    }
+}
+
+/**
+ * Netlink link callback
+ * @param action NL_ACT_NEW, NL_ACT_DEL or NL_ACT_CHANGE
+ * @param old_obj previous link object
+ * @param new_obj current link object
+ */
+static void
+nl_if_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj)
+{
+    struct rtnl_link *link = (struct rtnl_link *) (new_obj ? : old_obj);
+    const char *ifname;
+    int ifindex;
+
+    if (!link)
+        return;
+    ifindex = rtnl_link_get_ifindex (link);
+    ifname = rtnl_link_get_name (link);
+
+    g_rw_lock_writer_lock (&iftable_lock);
+    iftable_remove (ifindex);
+    if (action != NL_ACT_DEL && ifname)
+    {
+        VERBOSE ("IFTABLE: %d=%s\n", ifindex, ifname);
+        g_hash_table_insert (by_index, GINT_TO_POINTER (ifindex), strdup (ifname));
+        g_hash_table_insert (by_name, strdup (ifname), GINT_TO_POINTER (ifindex));
+    }
+    g_rw_lock_writer_unlock (&iftable_lock);
+}
+
+/**
+ * Find the name of an interface
+ * @param ifindex index of the interface
+ * @param ifname buffer of at least IFNAMSIZ bytes for the name
+ * @return ifname, or NULL if there is no such interface
+ */
+char *
+iftable_i2name (int ifindex, char *ifname)
+{
+    const char *name = NULL;
+
+    g_rw_lock_reader_lock (&iftable_lock);
+    if (by_index)
+        name = g_hash_table_lookup (by_index, GINT_TO_POINTER (ifindex));
+    if (name)
+        g_strlcpy (ifname, name, IFNAMSIZ);
+    g_rw_lock_reader_unlock (&iftable_lock);
+    if (!name)
+        return if_indextoname (ifindex, ifname);
+    return ifname;
+}
+
+/**
+ * Find the index of an interface
+ * @param ifname name of the interface
+ * @return the interface index, or 0 if there is no such interface
+ */
+int
+iftable_name2i (const char *ifname)
+{
+    int ifindex = 0;
+
+    g_rw_lock_reader_lock (&iftable_lock);
+    if (by_name)
+        ifindex = GPOINTER_TO_INT (g_hash_table_lookup (by_name, ifname));
+    g_rw_lock_reader_unlock (&iftable_lock);
+    if (!ifindex)
+        ifindex = if_nametoindex (ifname);
+    return ifindex;
+}
+
+bool
+iftable_init (void)
+{
+    DEBUG ("IFTABLE: Initialising\n");
+
+    by_index = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
+    by_name = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+    return netlink_register ("route/link", nl_if_cb);
+}
+
+void
+iftable_exit (void)
+{
+    DEBUG ("IFTABLE: Exiting\n");
+
+    netlink_unregister ("route/link", nl_if_cb);
+    g_rw_lock_writer_lock (&iftable_lock);
+    if (by_index)
+        g_hash_table_destroy (by_index);
+    by_index = NULL;
+    if (by_name)
+        g_hash_table_destroy (by_name);
+    by_name = NULL;
+    g_rw_lock_writer_unlock (&iftable_lock);
+}
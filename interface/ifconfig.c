@@ -38,17 +38,18 @@ apteryx_if_cb (const char *path, const char *value)
 {
     struct rtnl_link *link = NULL;
     struct rtnl_link *change;
-    char ifname[64];
-    char parameter[64];
+    apteryx_match match;
+    const char *ifname;
     int err;
 
-    /* Parse family, index and the parameter that has changed */
-    if (!path || sscanf (path, INTERFACE_INTERFACES_PATH "/%64[^/]/"
-                INTERFACE_INTERFACES_SETTINGS_PATH "/%64s", ifname, parameter) != 2)
+    /* Parse the interface and the parameter that has changed */
+    if (!apteryx_path_match (interface_schema, path, &match) || match.depth != 5 ||
+        match.ids[3] != INTERFACE_INTERFACES_SETTINGS_NODE)
     {
         ERROR ("IFCONFIG: Invalid interface settings path (%s)\n", path);
         return false;
     }
+    ifname = match.keys[0];
 
     /* Find link in the link cache */
     if (link_cache)
@@ -62,8 +63,10 @@ apteryx_if_cb (const char *path, const char *value)
     /* Create a link object to add the changes to */
     change = rtnl_link_alloc ();
 
+    switch (match.id)
+    {
     /* Admin status */
-    if (strcmp (parameter, "admin-status") == 0)
+    case INTERFACE_INTERFACES_SETTINGS_ADMIN_STATUS_NODE:
     {
         int status = INTERFACE_INTERFACES_SETTINGS_ADMIN_STATUS_DEFAULT;
         if ((value && sscanf (value, "%d", &status) != 1) ||
@@ -78,9 +81,10 @@ apteryx_if_cb (const char *path, const char *value)
             rtnl_link_set_flags (change, IFF_UP);
         else
             rtnl_link_unset_flags (change, IFF_UP);
+        break;
     }
     /* MTU */
-    else if (strcmp (parameter, "mtu") == 0)
+    case INTERFACE_INTERFACES_SETTINGS_MTU_NODE:
     {
         int mtu = 1500;
         if ((value && sscanf (value, "%d", &mtu) != 1) || mtu < 68 || mtu > 16535)
@@ -89,10 +93,11 @@ apteryx_if_cb (const char *path, const char *value)
             ERROR ("IFCONFIG: Invalid MTU (%s) using default (%d)\n", value, mtu);
         }
         rtnl_link_set_mtu (change, mtu);
+        break;
     }
-    else
-    {
-        DEBUG ("IFCONFIG: Unexpected \"%s\" setting \"%s\"\n", ifname, parameter);
+    default:
+        DEBUG ("IFCONFIG: Unexpected \"%s\" setting \"%s\"\n", ifname,
+               interface_schema[match.id].name);
         rtnl_link_put (change);
         return true;
     }
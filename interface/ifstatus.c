@@ -67,16 +67,133 @@ if_duplex_get (char *name)
     return duplex;
 }
 
+/* Leaves we publish for each interface */
+typedef enum
+{
+    IFSTATUS_NAME,
+    IFSTATUS_IF_INDEX,
+    IFSTATUS_L3,
+    IFSTATUS_ADMIN_STATUS,
+    IFSTATUS_OPER_STATUS,
+    IFSTATUS_FLAGS,
+    IFSTATUS_PHYS_ADDRESS,
+    IFSTATUS_PROMISC,
+    IFSTATUS_QDISC,
+    IFSTATUS_MTU,
+    IFSTATUS_SPEED,
+    IFSTATUS_DUPLEX,
+    IFSTATUS_ARPTYPE,
+    IFSTATUS_RXQ,
+    IFSTATUS_TXQLEN,
+    IFSTATUS_TXQ,
+    IFSTATUS_MAX,
+} ifstatus_leaf;
+
+static const struct
+{
+    const char *name;
+    bool status;
+} ifstatus_leaves[IFSTATUS_MAX] = {
+    [IFSTATUS_NAME] = { INTERFACE_INTERFACES_NAME, false },
+    [IFSTATUS_IF_INDEX] = { INTERFACE_INTERFACES_IF_INDEX, false },
+    [IFSTATUS_L3] = { INTERFACE_INTERFACES_L3, false },
+    [IFSTATUS_ADMIN_STATUS] = { "admin-status", true },
+    [IFSTATUS_OPER_STATUS] = { "oper-status", true },
+    [IFSTATUS_FLAGS] = { "flags", true },
+    [IFSTATUS_PHYS_ADDRESS] = { "phys-address", true },
+    [IFSTATUS_PROMISC] = { "promisc", true },
+    [IFSTATUS_QDISC] = { "qdisc", true },
+    [IFSTATUS_MTU] = { "mtu", true },
+    [IFSTATUS_SPEED] = { "speed", true },
+    [IFSTATUS_DUPLEX] = { "duplex", true },
+    [IFSTATUS_ARPTYPE] = { "arptype", true },
+    [IFSTATUS_RXQ] = { "rxq", true },
+    [IFSTATUS_TXQLEN] = { "txqlen", true },
+    [IFSTATUS_TXQ] = { "txq", true },
+};
+
+/* Last published state of an interface */
+#define IFSTATUS_VALUE_LEN 64
+typedef struct ifstatus_entry
+{
+    unsigned int flags;
+    uint8_t operstate;
+    char values[IFSTATUS_MAX][IFSTATUS_VALUE_LEN];
+} ifstatus_entry;
+
+/* Published state by ifindex */
+static GHashTable *ifstatus_table = NULL;
+
+/**
+ * Work out the value of every published leaf for a link
+ * @param link Netlink link object
+ * @param entry last published state for the link (NULL if there is none)
+ * @param values filled in with the current value of each leaf
+ */
+static void
+link_to_values (struct rtnl_link *link, ifstatus_entry *entry,
+                char values[IFSTATUS_MAX][IFSTATUS_VALUE_LEN])
+{
+    char *name = rtnl_link_get_name (link);
+
+#define SET_VALUE(leaf, fmt, args...) \
+    snprintf (values[leaf], IFSTATUS_VALUE_LEN, fmt, ## args)
+
+    SET_VALUE (IFSTATUS_NAME, "%s", name);
+    SET_VALUE (IFSTATUS_IF_INDEX, "%d", rtnl_link_get_ifindex (link));
+    SET_VALUE (IFSTATUS_L3, "%d", rtnl_link_get_master (link) ?
+               INTERFACE_INTERFACES_L3_DEFAULT : INTERFACE_INTERFACES_L3_L3_IF);
+    SET_VALUE (IFSTATUS_ADMIN_STATUS, "%d", rtnl_link_get_flags (link) & IFF_UP ?
+               INTERFACE_INTERFACES_STATUS_ADMIN_STATUS_ADMIN_UP :
+               INTERFACE_INTERFACES_STATUS_ADMIN_STATUS_ADMIN_DOWN);
+    SET_VALUE (IFSTATUS_OPER_STATUS, "%d", rtnl_link_get_operstate (link));
+    SET_VALUE (IFSTATUS_FLAGS, "%d", rtnl_link_get_flags (link));
+    nl_addr2str (rtnl_link_get_addr (link), values[IFSTATUS_PHYS_ADDRESS], IFSTATUS_VALUE_LEN);
+    SET_VALUE (IFSTATUS_PROMISC, "%d", rtnl_link_get_promiscuity (link) ?
+               INTERFACE_INTERFACES_STATUS_PROMISC_PROMISC_ON :
+               INTERFACE_INTERFACES_STATUS_PROMISC_PROMISC_OFF);
+    SET_VALUE (IFSTATUS_QDISC, "%s", rtnl_link_get_qdisc (link) ? : "");
+    SET_VALUE (IFSTATUS_MTU, "%d", rtnl_link_get_mtu (link) ? :
+               INTERFACE_INTERFACES_STATUS_MTU_DEFAULT);
+    SET_VALUE (IFSTATUS_ARPTYPE, "%d", rtnl_link_get_arptype (link) ? :
+               INTERFACE_INTERFACES_STATUS_ARPTYPE_DEFAULT);
+    SET_VALUE (IFSTATUS_RXQ, "%d", rtnl_link_get_num_rx_queues (link) ? :
+               INTERFACE_INTERFACES_STATUS_RXQ_DEFAULT);
+    SET_VALUE (IFSTATUS_TXQLEN, "%d", rtnl_link_get_txqlen (link) ? :
+               INTERFACE_INTERFACES_STATUS_TXQLEN_DEFAULT);
+    SET_VALUE (IFSTATUS_TXQ, "%d", rtnl_link_get_num_tx_queues (link) ? :
+               INTERFACE_INTERFACES_STATUS_TXQ_DEFAULT);
+
+    /* Speed and duplex only change with the link state so save the sysfs reads */
+    if (!entry || entry->flags != rtnl_link_get_flags (link) ||
+        entry->operstate != rtnl_link_get_operstate (link))
+    {
+        SET_VALUE (IFSTATUS_SPEED, "%d", if_speed_get (name));
+        SET_VALUE (IFSTATUS_DUPLEX, "%d", if_duplex_get (name));
+    }
+    else
+    {
+        memcpy (values[IFSTATUS_SPEED], entry->values[IFSTATUS_SPEED], IFSTATUS_VALUE_LEN);
+        memcpy (values[IFSTATUS_DUPLEX], entry->values[IFSTATUS_DUPLEX], IFSTATUS_VALUE_LEN);
+    }
+#undef SET_VALUE
+}
+
 /**
  * Convert a Netlink link object to an Apteryx tree for interface status
+ * Only the leaves that have changed since the last call are included.
  * @param link Netlink link object
- * @return the constructed tree
+ * @return the constructed tree, or NULL if nothing has changed
  */
 static GNode *
 link_to_apteryx (struct rtnl_link *link)
 {
-    char phys_address[128];
-    GNode *root, *ifalias, *node, *status;
+    char values[IFSTATUS_MAX][IFSTATUS_VALUE_LEN];
+    GNode *root, *node = NULL, *status = NULL;
+    ifstatus_entry *entry;
+    char *name;
+    int ifindex;
+    int i;
 
     /* Minimum requirements */
     if (!link || !rtnl_link_get_name (link) || !rtnl_link_get_ifindex (link))
@@ -84,86 +201,60 @@ link_to_apteryx (struct rtnl_link *link)
         ERROR ("IFSTATUS: invalid link object\n");
         return NULL;
     }
+    name = rtnl_link_get_name (link);
+    ifindex = rtnl_link_get_ifindex (link);
+
+    /* Find what we last published */
+    if (!ifstatus_table)
+        ifstatus_table = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
+    entry = (ifstatus_entry *) g_hash_table_lookup (ifstatus_table, GINT_TO_POINTER (ifindex));
+    if (entry && strcmp (entry->values[IFSTATUS_NAME], name) != 0)
+    {
+        /* Renamed so remove the old status and start again */
+        char *path = g_strdup_printf (INTERFACE_INTERFACES_PATH "/%s/" INTERFACE_INTERFACES_STATUS_PATH,
+                                      entry->values[IFSTATUS_NAME]);
+        apteryx_batch_prune (path);
+        free (path);
+        g_hash_table_remove (ifstatus_table, GINT_TO_POINTER (ifindex));
+        entry = NULL;
+    }
+    link_to_values (link, entry, values);
 
     /* Build tree */
     root = g_node_new (strdup ("/"));
-    ifalias = apteryx_path_to_node (root, INTERFACE_IF_ALIAS, NULL);
-    APTERYX_LEAF (ifalias, g_strdup_printf ("%d", rtnl_link_get_ifindex (link)),
-                  strdup (rtnl_link_get_name (link)));
-    node = apteryx_path_to_node (root, INTERFACE_INTERFACES_PATH, NULL);
-    node = APTERYX_NODE (node, strdup (rtnl_link_get_name (link)));
-    /* Name */
-    APTERYX_LEAF (node, strdup (INTERFACE_INTERFACES_NAME),
-                  strdup (rtnl_link_get_name (link)));
-    /* if-index */
-    APTERYX_LEAF (node, strdup (INTERFACE_INTERFACES_IF_INDEX),
-                  g_strdup_printf ("%d", rtnl_link_get_ifindex (link)));
-    /* L3 */
-    if (rtnl_link_get_master (link))
+    if (!entry)
     {
-        APTERYX_LEAF (node, strdup (INTERFACE_INTERFACES_L3),
-                      g_strdup_printf ("%d", INTERFACE_INTERFACES_L3_DEFAULT));
+        GNode *ifalias = apteryx_path_to_node (root, INTERFACE_IF_ALIAS, NULL);
+        APTERYX_LEAF (ifalias, g_strdup_printf ("%d", ifindex), strdup (name));
+        entry = (ifstatus_entry *) calloc (1, sizeof (ifstatus_entry));
+        g_hash_table_insert (ifstatus_table, GINT_TO_POINTER (ifindex), entry);
     }
-    else
+    entry->flags = rtnl_link_get_flags (link);
+    entry->operstate = rtnl_link_get_operstate (link);
+    for (i = 0; i < IFSTATUS_MAX; i++)
     {
-        APTERYX_LEAF (node, strdup (INTERFACE_INTERFACES_L3),
-                      g_strdup_printf ("%d", INTERFACE_INTERFACES_L3_L3_IF));
+        /* Unchanged or not set */
+        if (strcmp (entry->values[i], values[i]) == 0)
+            continue;
+        memcpy (entry->values[i], values[i], IFSTATUS_VALUE_LEN);
+
+        if (!node)
+        {
+            node = apteryx_path_to_node (root, INTERFACE_INTERFACES_PATH, NULL);
+            node = APTERYX_NODE (node, strdup (name));
+        }
+        if (ifstatus_leaves[i].status && !status)
+            status = APTERYX_NODE (node, strdup (INTERFACE_INTERFACES_STATUS_PATH));
+        APTERYX_LEAF (ifstatus_leaves[i].status ? status : node,
+                      strdup (ifstatus_leaves[i].name), strdup (values[i]));
     }
-    /* Status */
-    status = APTERYX_NODE (node, strdup (INTERFACE_INTERFACES_STATUS_PATH));
-    APTERYX_LEAF (status, strdup ("admin-status"),
-                  g_strdup_printf ("%d", rtnl_link_get_flags (link) & IFF_UP ?
-                                   INTERFACE_INTERFACES_STATUS_ADMIN_STATUS_ADMIN_UP :
-                                   INTERFACE_INTERFACES_STATUS_ADMIN_STATUS_ADMIN_DOWN));
-    APTERYX_LEAF (status, strdup ("oper-status"),
-                  g_strdup_printf ("%d", rtnl_link_get_operstate (link)));
-    APTERYX_LEAF (status, strdup ("flags"),
-                  g_strdup_printf ("%d", rtnl_link_get_flags (link)));
-    nl_addr2str (rtnl_link_get_addr (link), phys_address, sizeof (phys_address));
-    APTERYX_LEAF (status, strdup ("phys-address"),
-                  strdup (phys_address));
-    APTERYX_LEAF (status, strdup ("promisc"),
-                  g_strdup_printf ("%d", rtnl_link_get_promiscuity (link) ?
-                                   INTERFACE_INTERFACES_STATUS_PROMISC_PROMISC_ON :
-                                   INTERFACE_INTERFACES_STATUS_PROMISC_PROMISC_OFF));
-    if (rtnl_link_get_qdisc (link))
-        APTERYX_LEAF (status, strdup ("qdisc"),
-                  strdup (rtnl_link_get_qdisc (link)));
-    if (rtnl_link_get_mtu (link))
-        APTERYX_LEAF (status, strdup ("mtu"),
-                  g_strdup_printf ("%d", rtnl_link_get_mtu (link)));
-    else
-        APTERYX_LEAF (status, strdup ("mtu"),
-                   g_strdup_printf ("%d", INTERFACE_INTERFACES_STATUS_MTU_DEFAULT));
-    APTERYX_LEAF (status, strdup ("speed"),
-            g_strdup_printf ("%d", if_speed_get (rtnl_link_get_name (link))));
-    APTERYX_LEAF (status, strdup ("duplex"),
-            g_strdup_printf ("%d", if_duplex_get (rtnl_link_get_name (link))));
-    if (rtnl_link_get_arptype (link))
-        APTERYX_LEAF (status, strdup ("arptype"),
-                  g_strdup_printf ("%d", rtnl_link_get_arptype (link)));
-    else
-        APTERYX_LEAF (status, strdup ("arptype"),
-                  g_strdup_printf ("%d", INTERFACE_INTERFACES_STATUS_ARPTYPE_DEFAULT));
-    if (rtnl_link_get_num_rx_queues (link))
-        APTERYX_LEAF (status, strdup ("rxq"),
-                  g_strdup_printf ("%d", rtnl_link_get_num_rx_queues (link)));
-    else
-        APTERYX_LEAF (status, strdup ("rxq"),
-                  g_strdup_printf ("%d", INTERFACE_INTERFACES_STATUS_RXQ_DEFAULT));
-    if (rtnl_link_get_txqlen (link))
-        APTERYX_LEAF (status, strdup ("txqlen"),
-                  g_strdup_printf ("%d", rtnl_link_get_txqlen (link)));
-    else
-        APTERYX_LEAF (status, strdup ("txqlen"),
-                  g_strdup_printf ("%d", INTERFACE_INTERFACES_STATUS_TXQLEN_DEFAULT));
-    if (rtnl_link_get_num_tx_queues (link))
-        APTERYX_LEAF (status, strdup ("txq"),
-                  g_strdup_printf ("%d", rtnl_link_get_num_tx_queues (link)));
-    else
-        APTERYX_LEAF (status, strdup ("txq"),
-                  g_strdup_printf ("%d", INTERFACE_INTERFACES_STATUS_TXQ_DEFAULT));
 
+    /* Nothing to publish */
+    if (!g_node_first_child (root))
+    {
+        apteryx_free_tree (root);
+        return NULL;
+    }
     return root;
 }
 
@@ -207,17 +298,21 @@ nl_if_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj)
     /* Process action */
     if (action == NL_ACT_DEL)
     {
+        /* Forget what we published */
+        if (ifstatus_table)
+            g_hash_table_remove (ifstatus_table, GINT_TO_POINTER (rtnl_link_get_ifindex (link)));
+
         /* Remove the if-alias */
         path = g_strdup_printf (INTERFACE_IF_ALIAS "/%d",
                                 rtnl_link_get_ifindex (link));
-        apteryx_set (path, NULL);
+        apteryx_batch_set (path, NULL);
         free (path);
 
         /* Generate path to interface status information */
         path =
             g_strdup_printf (INTERFACE_INTERFACES_PATH "/%s/" INTERFACE_INTERFACES_STATUS_PATH,
                              rtnl_link_get_name (link));
-        apteryx_prune (path);
+        apteryx_batch_prune (path);
         free (path);
     }
     else
@@ -226,7 +321,7 @@ nl_if_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj)
         GNode *tree = link_to_apteryx (link);
         if (tree)
         {
-            apteryx_set_tree (tree);
+            apteryx_batch_set_tree (tree);
             apteryx_free_tree (tree);
         }
     }
@@ -252,6 +347,11 @@ ifstatus_cleanup (void)
 
     /* Throw away the if-alias table */
     apteryx_prune (INTERFACE_IF_ALIAS);
+
+    /* Nothing is published any more */
+    if (ifstatus_table)
+        g_hash_table_destroy (ifstatus_table);
+    ifstatus_table = NULL;
 }
 
 /**
@@ -263,11 +363,13 @@ ifstatus_init (void)
 {
     DEBUG ("IFSTATUS: Initialising\n");
 
-    /* Cleanup any existing status information */
-    ifstatus_cleanup ();
+    /* Only publish status that differs from a previous run */
+    apteryx_reconcile_begin (INTERFACE_INTERFACES_PATH "/*/" INTERFACE_INTERFACES_STATUS_PATH);
+    apteryx_reconcile_begin (INTERFACE_IF_ALIAS);
 
     /* Create the link cache and register for callbacks */
     netlink_register ("route/link", nl_if_cb);
+    apteryx_reconcile_end ();
 
     return true;
 }
@@ -283,8 +385,15 @@ ifstatus_exit ()
     /* Detach our callback and unref the link cache */
     netlink_unregister ("route/link", nl_if_cb);
 
-    /* Cleanup any status information we created */
-    ifstatus_cleanup ();
+    /* Cleanup any status information we created, unless the next run
+     * will reconcile it */
+    if (!kermond_graceful)
+        ifstatus_cleanup ();
+    else if (ifstatus_table)
+    {
+        g_hash_table_destroy (ifstatus_table);
+        ifstatus_table = NULL;
+    }
 }
 
 MODULE_CREATE ("ifstatus", ifstatus_init, NULL, ifstatus_exit);
@@ -170,6 +170,49 @@ void test_ifstatus_link_del ()
     NP_TEST_END ("")
 }
 
+void test_ifstatus_link_change_only_changed ()
+{
+    NP_TEST_START
+    setup_test (NULL);
+    struct nl_object *link = make_link (IFNAME);
+    nl_if_cb (NL_ACT_NEW, NULL, link);
+    NP_ASSERT_NOT_NULL (apteryx_tree);
+    apteryx_free_tree (apteryx_tree);
+    apteryx_tree = NULL;
+    rtnl_link_set_mtu ((struct rtnl_link *) link, 9000);
+    nl_if_cb (NL_ACT_CHANGE, NULL, link);
+    nl_object_put (link);
+    NP_ASSERT_NOT_NULL (apteryx_tree);
+    assert_tree_parameter (apteryx_tree, IFNAME,
+            INTERFACE_INTERFACES_STATUS_PATH, "mtu", "9000");
+    NP_ASSERT_NULL (apteryx_find_child (apteryx_find_child (apteryx_tree, "interface"),
+            "if-alias"));
+    NP_ASSERT_EQUAL (g_node_n_nodes (apteryx_tree, G_TRAVERSE_LEAVES), 1);
+    apteryx_free_tree (apteryx_tree);
+    NP_ASSERT_NULL (apteryx_path);
+    NP_ASSERT_NULL (apteryx_value);
+    NP_ASSERT_NULL (apteryx_prune_path);
+    NP_TEST_END ("")
+}
+
+void test_ifstatus_link_change_unchanged ()
+{
+    NP_TEST_START
+    setup_test (NULL);
+    struct nl_object *link = make_link (IFNAME);
+    nl_if_cb (NL_ACT_NEW, NULL, link);
+    NP_ASSERT_NOT_NULL (apteryx_tree);
+    apteryx_free_tree (apteryx_tree);
+    apteryx_tree = NULL;
+    nl_if_cb (NL_ACT_CHANGE, NULL, link);
+    nl_object_put (link);
+    NP_ASSERT_NULL (apteryx_tree);
+    NP_ASSERT_NULL (apteryx_path);
+    NP_ASSERT_NULL (apteryx_value);
+    NP_ASSERT_NULL (apteryx_prune_path);
+    NP_TEST_END ("")
+}
+
 void test_ifstatus_admin_status_default_down ()
 {
     NP_TEST_START
@@ -19,48 +19,63 @@
  */
 #include "kermond.h"
 #include <netlink/route/addr.h>
-#include <netlink/route/link.h>
 #include <arpa/inet.h>
 #include "ietf-ip.h"
-
-/* Fallback if we have no link cache */
-extern char *if_indextoname (unsigned int ifindex, char *ifname);
+#include "kermond-counters.h"
 
 /* Required caches */
 static struct nl_cache *addr_cache = NULL;
-static struct nl_cache *link_cache = NULL;
+
+/* What we have published for each address */
+static GHashTable *published = NULL;
+static uint64_t suppressed_writes = 0;
+
+/**
+ * Apteryx path for an address, shared by add and delete so they agree
+ * @param ra Netlink address object
+ * @param ip returns the address without a prefix length
+ * @param len size of ip
+ * @return the path (free with g_free), or NULL if the interface is unknown
+ */
+static char *
+address_path (struct rtnl_addr *ra, char *ip, size_t len)
+{
+    char ifname[IFNAMSIZ] = {};
+
+    inet_ntop (rtnl_addr_get_family (ra),
+            nl_addr_get_binary_addr (rtnl_addr_get_local (ra)), ip, len);
+    if (!iftable_i2name (rtnl_addr_get_ifindex (ra), ifname))
+        return NULL;
+    return g_strdup_printf (INTERFACES_STATE_PATH"/%s/%s/%s",
+            ifname,
+            rtnl_addr_get_family (ra) == AF_INET ?
+                    INTERFACES_STATE_IPV4_ADDRESS :
+                    INTERFACES_STATE_IPV6_ADDRESS,
+            ip);
+}
 
 /**
  * Convert a Netlink address object to an Apteryx tree
  * @param link Netlink address object
- * @return the constructed tree
+ * @return the constructed tree, or NULL if the interface is unknown
  */
 static GNode *
 address_to_apteryx (struct rtnl_addr *ra)
 {
     char ip[INET6_ADDRSTRLEN + 5];
-    char ifname[IFNAMSIZ] = {};
+    char *path;
     int prefixlen;
     GNode *root;
     GNode *node;
 
     /* Parse */
-    inet_ntop (rtnl_addr_get_family (ra),
-            nl_addr_get_binary_addr (rtnl_addr_get_local (ra)), ip, sizeof (ip));
-    if (link_cache)
-        rtnl_link_i2name (link_cache, rtnl_addr_get_ifindex (ra), ifname, sizeof (ifname));
-    else
-        if_indextoname (rtnl_addr_get_ifindex (ra), ifname);
     prefixlen = rtnl_addr_get_prefixlen (ra);
+    path = address_path (ra, ip, sizeof (ip));
+    if (!path)
+        return NULL;
 
     /* Build tree */
-    root = g_node_new (g_strdup_printf (
-            INTERFACES_STATE_PATH"/%s/%s/%s",
-            ifname,
-            rtnl_addr_get_family (ra) == AF_INET ?
-                    INTERFACES_STATE_IPV4_ADDRESS :
-                    INTERFACES_STATE_IPV6_ADDRESS,
-                    ip));
+    root = g_node_new (path);
     if (rtnl_addr_get_family (ra) == AF_INET)
     {
         APTERYX_LEAF (root, strdup (INTERFACES_STATE_IPV4_ADDRESS_IP), strdup (ip));
@@ -136,32 +151,34 @@ nl_address_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj)
     if (action == NL_ACT_DEL)
     {
         char ip[INET6_ADDRSTRLEN + 5];
-        char ifname[IFNAMSIZ];
-        char *path;
-
-        /* Parse addresses */
-        nl_addr2str (rtnl_addr_get_local (ra), ip, sizeof (ip));
-        if (link_cache)
-            rtnl_link_i2name (link_cache, rtnl_addr_get_ifindex (ra), ifname, sizeof (ifname));
-        else
-            if_indextoname (rtnl_addr_get_ifindex (ra), ifname);
-
-        /* Generate path */
-        path = g_strdup_printf (INTERFACES_STATE_PATH"/%s/%s/%s",
-                        ifname,
-                        rtnl_addr_get_family (ra) == AF_INET ?
-                                INTERFACES_STATE_IPV4_ADDRESS :
-                                INTERFACES_STATE_IPV6_ADDRESS,
-                        ip);
-
-        apteryx_prune (path);
-        free (path);
+        char *path = address_path (ra, ip, sizeof (ip));
+
+        if (!path)
+        {
+            ERROR ("ADDRESS-CACHE: unknown interface %d\n", rtnl_addr_get_ifindex (ra));
+            return;
+        }
+        if (published)
+            g_hash_table_remove (published, path);
+        apteryx_batch_prune (path);
+        g_free (path);
     }
     else
     {
-        /* Add/Update Apteryx */
+        /* Add/Update Apteryx. Lifetime (cacheinfo) refreshes are not
+         * published so they produce the same tree and can be skipped */
         GNode *tree = address_to_apteryx (ra);
-        apteryx_set_tree (tree);
+        if (!tree)
+        {
+            ERROR ("ADDRESS-CACHE: unknown interface %d\n", rtnl_addr_get_ifindex (ra));
+            return;
+        }
+        if (!published)
+            published = g_hash_table_new_full (g_str_hash, g_str_equal, free, g_free);
+        if (apteryx_tree_changed (published, tree))
+            apteryx_batch_set_tree (tree);
+        else
+            suppressed_writes++;
         apteryx_free_tree (tree);
     }
 }
@@ -175,13 +192,14 @@ address_cache_init (void)
 {
     DEBUG ("ADDRESS-CACHE: Initialising\n");
 
-    /* Start with an empty cache */
-    apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV4_ADDRESS);
-    apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV6_ADDRESS);
+    /* Only publish what differs from a previous run */
+    apteryx_reconcile_begin (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV4_ADDRESS);
+    apteryx_reconcile_begin (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV6_ADDRESS);
+    apteryx_counter_register (KERMOND_COUNTERS_ADDRESS_CACHE_SUPPRESSED_WRITES, &suppressed_writes);
 
     /* Configure Netlink */
     netlink_register ("route/addr", nl_address_cb);
-    link_cache = nl_cache_mngt_require_safe ("route/link");
+    apteryx_reconcile_end ();
     addr_cache = nl_cache_mngt_require_safe ("route/addr");
     if (!addr_cache)
     {
@@ -202,13 +220,18 @@ address_cache_exit ()
     /* Drop the cache references and unregister the callback */
     if (addr_cache)
         nl_cache_put (addr_cache);
-    if (link_cache)
-        nl_cache_put (link_cache);
     netlink_unregister ("route/addr", nl_address_cb);
 
-    /* Clear out the cache */
-    apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV4_ADDRESS);
-    apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV6_ADDRESS);
+    /* Clear out the cache, unless the next run will reconcile it */
+    apteryx_counter_unregister (KERMOND_COUNTERS_ADDRESS_CACHE_SUPPRESSED_WRITES);
+    if (!kermond_graceful)
+    {
+        apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV4_ADDRESS);
+        apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV6_ADDRESS);
+    }
+    if (published)
+        g_hash_table_destroy (published);
+    published = NULL;
 }
 
 MODULE_CREATE ("address-cache", address_cache_init, NULL, address_cache_exit);
@@ -22,12 +22,6 @@
 #include <netlink/route/link.h>
 #include "ietf-ip.h"
 
-/* Fallback if we have no link cache */
-extern unsigned int if_nametoindex (const char *ifname);
-
-/* Required caches */
-static struct nl_cache *link_cache = NULL;
-
 /* Socket for making configuration changes */
 static struct nl_sock *sock = NULL;
 
@@ -42,24 +36,30 @@ apteryx_to_address (const char *path, const char *lladdr)
 {
     struct rtnl_addr *ra;
     struct nl_addr *addr;
-    char ip[64];
-    char ifname[64];
-    char parameter[64];
+    apteryx_match match;
+    const char *ip;
+    const char *ifname;
+    bool matched;
     int family;
     int ifindex;
     int err;
 
     /* Parse family, ip and iface */
-    if (!path ||
-        sscanf (path, INTERFACES_PATH "/%64[^/]/ipv%d/address/%64[^/]/%64s",
-                ifname, &family, ip, parameter) != 4)
+    matched = apteryx_path_match (ietf_ip_schema, path, &match);
+    if (match.depth < 5 || match.nkeys != 2 ||
+        (match.ids[3] != INTERFACES_IPV4_ADDRESS_NODE &&
+         match.ids[3] != INTERFACES_IPV6_ADDRESS_NODE))
     {
         ERROR ("ADDRESS: Invalid static address: %s = %s\n", path, lladdr);
         return NULL;
     }
+    family = match.ids[3] == INTERFACES_IPV4_ADDRESS_NODE ? 4 : 6;
+    ifname = match.keys[0];
+    ip = match.keys[1];
 
     /* Currently only process ip parameter */
-    if (strcmp (parameter, INTERFACES_STATE_IPV6_ADDRESS_IP) != 0)
+    if (!matched || (match.id != INTERFACES_IPV4_ADDRESS_IP_NODE &&
+                     match.id != INTERFACES_IPV6_ADDRESS_IP_NODE))
     {
         return NULL;
     }
@@ -80,10 +80,7 @@ apteryx_to_address (const char *path, const char *lladdr)
     nl_addr_put (addr);
 
     /* Parse interface */
-    if (link_cache)
-        ifindex = rtnl_link_name2i (link_cache, ifname);
-    else
-        ifindex = if_nametoindex (ifname);
+    ifindex = iftable_name2i (ifname);
     if (ifindex == 0)
     {
         DEBUG ("ADDRESS: Link \"%s\" is not currently active\n", ifname);
@@ -191,7 +188,6 @@ static_address_init (void)
     DEBUG ("STATIC-ADDRESS: Initialising\n");
 
     /* Configure Netlink */
-    link_cache = nl_cache_mngt_require_safe ("route/link");
     netlink_register ("route/link", nl_if_cb);
     sock = nl_socket_alloc ();
     if ((err = nl_connect (sock, NETLINK_ROUTE)) < 0)
@@ -243,8 +239,6 @@ static_address_exit ()
     /* Remove Netlink interface */
     if (sock)
         nl_close (sock);
-    if (link_cache)
-        nl_cache_put (link_cache);
     netlink_unregister ("route/link", nl_if_cb);
 }
 
@@ -19,20 +19,20 @@
  */
 #include "kermond.h"
 #include <netlink/route/neighbour.h>
-#include <netlink/route/link.h>
 #include "ietf-ip.h"
-
-/* Fallback if we have no link cache */
-extern char *if_indextoname (unsigned int ifindex, char *ifname);
+#include "kermond-counters.h"
 
 /* Required caches */
 static struct nl_cache *neigh_cache = NULL;
-static struct nl_cache *link_cache = NULL;
+
+/* What we have published for each neighbor */
+static GHashTable *published = NULL;
+static uint64_t suppressed_writes = 0;
 
 /**
  * Convert a Netlink neighbor object to an Apteryx tree
  * @param link Netlink neighbor object
- * @return the constructed tree
+ * @return the constructed tree, or NULL if the interface is unknown
  */
 static GNode *
 neighbor_to_apteryx (struct rtnl_neigh *rn)
@@ -47,10 +47,8 @@ neighbor_to_apteryx (struct rtnl_neigh *rn)
     /* Parse */
     nl_addr2str (rtnl_neigh_get_lladdr (rn), lladdr, sizeof (lladdr));
     nl_addr2str (rtnl_neigh_get_dst (rn), dst, sizeof (dst));
-    if (link_cache)
-        rtnl_link_i2name (link_cache, rtnl_neigh_get_ifindex (rn), ifname, sizeof (ifname));
-    else
-        if_indextoname (rtnl_neigh_get_ifindex (rn), ifname);
+    if (!iftable_i2name (rtnl_neigh_get_ifindex (rn), ifname))
+        return NULL;
     state = rtnl_neigh_get_state (rn);
     flags = rtnl_neigh_get_flags (rn);
 
@@ -174,15 +172,16 @@ nl_neighbor_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj
     if (action == NL_ACT_DEL)
     {
         char dst[INET6_ADDRSTRLEN + 5];
-        char ifname[IFNAMSIZ];
+        char ifname[IFNAMSIZ] = {};
         char *path;
 
         /* Parse addresses */
         nl_addr2str (rtnl_neigh_get_dst (rn), dst, sizeof (dst));
-        if (link_cache)
-            rtnl_link_i2name (link_cache, rtnl_neigh_get_ifindex (rn), ifname, sizeof (ifname));
-        else
-            if_indextoname (rtnl_neigh_get_ifindex (rn), ifname);
+        if (!iftable_i2name (rtnl_neigh_get_ifindex (rn), ifname))
+        {
+            ERROR ("NEIGHBOR-CACHE: unknown interface %d\n", rtnl_neigh_get_ifindex (rn));
+            return;
+        }
 
         /* Generate path */
         path = g_strdup_printf (INTERFACES_STATE_PATH"/%s/%s/%s",
@@ -192,14 +191,26 @@ nl_neighbor_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj
                                 INTERFACES_STATE_IPV6_NEIGHBOR,
                         dst);
 
-        apteryx_prune (path);
+        if (published)
+            g_hash_table_remove (published, path);
+        apteryx_batch_prune (path);
         free (path);
     }
     else
     {
-        /* Add/Update Apteryx */
+        /* Add/Update Apteryx if anything we publish has changed */
         GNode *tree = neighbor_to_apteryx (rn);
-        apteryx_set_tree (tree);
+        if (!tree)
+        {
+            ERROR ("NEIGHBOR-CACHE: unknown interface %d\n", rtnl_neigh_get_ifindex (rn));
+            return;
+        }
+        if (!published)
+            published = g_hash_table_new_full (g_str_hash, g_str_equal, free, g_free);
+        if (apteryx_tree_changed (published, tree))
+            apteryx_batch_set_tree (tree);
+        else
+            suppressed_writes++;
         apteryx_free_tree (tree);
     }
 }
@@ -213,13 +224,14 @@ neighbor_cache_init (void)
 {
     DEBUG ("NEIGHBOR-CACHE: Initialising\n");
 
-    /* Start with an empty cache */
-    apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV4_NEIGHBOR);
-    apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV6_NEIGHBOR);
+    /* Only publish what differs from a previous run */
+    apteryx_reconcile_begin (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV4_NEIGHBOR);
+    apteryx_reconcile_begin (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV6_NEIGHBOR);
+    apteryx_counter_register (KERMOND_COUNTERS_NEIGHBOR_CACHE_SUPPRESSED_WRITES, &suppressed_writes);
 
     /* Configure Netlink */
     netlink_register ("route/neigh", nl_neighbor_cb);
-    link_cache = nl_cache_mngt_require_safe ("route/link");
+    apteryx_reconcile_end ();
     neigh_cache = nl_cache_mngt_require_safe ("route/neigh");
     if (!neigh_cache)
     {
@@ -240,13 +252,18 @@ neighbor_cache_exit ()
     /* Drop the cache references and unregister the callback */
     if (neigh_cache)
         nl_cache_put (neigh_cache);
-    if (link_cache)
-        nl_cache_put (link_cache);
     netlink_unregister ("route/neigh", nl_neighbor_cb);
 
-    /* Clear out the cache */
-    apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV4_NEIGHBOR);
-    apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV6_NEIGHBOR);
+    /* Clear out the cache, unless the next run will reconcile it */
+    apteryx_counter_unregister (KERMOND_COUNTERS_NEIGHBOR_CACHE_SUPPRESSED_WRITES);
+    if (!kermond_graceful)
+    {
+        apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV4_NEIGHBOR);
+        apteryx_prune (INTERFACES_STATE_PATH"/*/"INTERFACES_STATE_IPV6_NEIGHBOR);
+    }
+    if (published)
+        g_hash_table_destroy (published);
+    published = NULL;
 }
 
 MODULE_CREATE ("neighbor-cache", neighbor_cache_init, NULL, neighbor_cache_exit);
@@ -22,12 +22,6 @@
 #include <netlink/route/link.h>
 #include "ietf-ip.h"
 
-/* Fallback if we have no link cache */
-extern unsigned int if_nametoindex (const char *ifname);
-
-/* Required caches */
-static struct nl_cache *link_cache = NULL;
-
 /* Socket for making configuration changes */
 static struct nl_sock *sock = NULL;
 
@@ -42,25 +36,31 @@ apteryx_to_neighbor (const char *path, const char *lladdr)
 {
     struct rtnl_neigh *rn;
     struct nl_addr *addr;
-    char ip[64];
-    char ifname[64];
-    char parameter[64];
+    apteryx_match match;
+    const char *ip;
+    const char *ifname;
+    bool matched;
     int family;
     int ifindex;
     int err;
 
     /* Parse family, ip and iface */
-    if (!path ||
-        sscanf (path, INTERFACES_PATH "/%64[^/]/ipv%d/neighbor/%64[^/]/%64s",
-                ifname, &family, ip, parameter) != 4)
+    matched = apteryx_path_match (ietf_ip_schema, path, &match);
+    if (match.depth < 5 || match.nkeys != 2 ||
+        (match.ids[3] != INTERFACES_IPV4_NEIGHBOR_NODE &&
+         match.ids[3] != INTERFACES_IPV6_NEIGHBOR_NODE))
     {
         ERROR ("NEIGHBOR: Invalid static neighbor: %s = %s\n",
                 path, lladdr);
         return NULL;
     }
+    family = match.ids[3] == INTERFACES_IPV4_NEIGHBOR_NODE ? 4 : 6;
+    ifname = match.keys[0];
+    ip = match.keys[1];
 
     /* Currently only process phys-address parameter */
-    if (strcmp (parameter, INTERFACES_IPV4_NEIGHBOR_LINK_LAYER_ADDRESS) != 0)
+    if (!matched || (match.id != INTERFACES_IPV4_NEIGHBOR_LINK_LAYER_ADDRESS_NODE &&
+                     match.id != INTERFACES_IPV6_NEIGHBOR_LINK_LAYER_ADDRESS_NODE))
     {
         return NULL;
     }
@@ -82,10 +82,7 @@ apteryx_to_neighbor (const char *path, const char *lladdr)
     nl_addr_put (addr);
 
     /* Parse interface */
-    if (link_cache)
-        ifindex = rtnl_link_name2i (link_cache, ifname);
-    else
-        ifindex = if_nametoindex (ifname);
+    ifindex = iftable_name2i (ifname);
     if (ifindex == 0)
     {
         DEBUG ("NEIGHBOR: Link \"%s\" is not currently active\n", ifname);
@@ -206,7 +203,6 @@ static_neighbor_init (void)
     DEBUG ("STATIC-NEIGHBOR: Initialising\n");
 
     /* Configure Netlink */
-    link_cache = nl_cache_mngt_require_safe ("route/link");
     netlink_register ("route/link", nl_if_cb);
     sock = nl_socket_alloc ();
     if ((err = nl_connect (sock, NETLINK_ROUTE)) < 0)
@@ -258,8 +254,6 @@ static_neighbor_exit ()
     /* Remove Netlink interface */
     if (sock)
         nl_close (sock);
-    if (link_cache)
-        nl_cache_put (link_cache);
     netlink_unregister ("route/link", nl_if_cb);
 }
 
@@ -177,3 +177,72 @@ void test_address_ipv6 ()
     NP_ASSERT_NULL (apteryx_prune_path);
     NP_TEST_END ("")
 }
+
+void test_address_ipv6_lifetime_only ()
+{
+    NP_TEST_START
+    setup_test (NULL);
+    struct nl_object *addr = make_address (AF_INET6, ADDRV6, 64);
+    rtnl_addr_set_preferred_lifetime ((struct rtnl_addr *) addr, 3600);
+    rtnl_addr_set_valid_lifetime ((struct rtnl_addr *) addr, 7200);
+    nl_address_cb (NL_ACT_NEW, NULL, addr);
+    NP_ASSERT_NOT_NULL (apteryx_tree);
+    apteryx_free_tree (apteryx_tree);
+    apteryx_tree = NULL;
+    rtnl_addr_set_preferred_lifetime ((struct rtnl_addr *) addr, 3500);
+    rtnl_addr_set_valid_lifetime ((struct rtnl_addr *) addr, 7100);
+    nl_address_cb (NL_ACT_CHANGE, NULL, addr);
+    nl_object_put (addr);
+    NP_ASSERT_NULL (apteryx_tree);
+    NP_ASSERT_EQUAL (suppressed_writes, 1);
+    NP_ASSERT_NULL (apteryx_path);
+    NP_ASSERT_NULL (apteryx_value);
+    NP_ASSERT_NULL (apteryx_prune_path);
+    NP_TEST_END ("")
+}
+
+void test_address_del_then_add ()
+{
+    NP_TEST_START
+    setup_test (NULL);
+    struct nl_object *addr = make_address (AF_INET, ADDRV4, 24);
+    nl_address_cb (NL_ACT_NEW, NULL, addr);
+    NP_ASSERT_NOT_NULL (apteryx_tree);
+    apteryx_free_tree (apteryx_tree);
+    apteryx_tree = NULL;
+    nl_address_cb (NL_ACT_DEL, addr, NULL);
+    NP_ASSERT_STR_EQUAL (apteryx_prune_path, IPV4PATH);
+    NP_ASSERT_EQUAL (g_hash_table_size (published), 0);
+    nl_address_cb (NL_ACT_NEW, NULL, addr);
+    nl_object_put (addr);
+    NP_ASSERT_NOT_NULL (apteryx_tree);
+    NP_ASSERT (check_tree_parameter (apteryx_tree, IPV4PATH"/"
+            INTERFACES_STATE_IPV4_ADDRESS_IP, ADDRV4));
+    apteryx_free_tree (apteryx_tree);
+    NP_ASSERT_EQUAL (suppressed_writes, 0);
+    NP_TEST_END ("")
+}
+
+void test_address_exit ()
+{
+    NP_TEST_START
+    setup_test (NULL);
+    apteryx_prune_counting = true;
+    kermond_graceful = false;
+    address_cache_exit ();
+    NP_ASSERT_EQUAL (apteryx_prunes, 2);
+    NP_ASSERT_NULL (published);
+    NP_TEST_END ("ADDRESS-CACHE: Exiting\n")
+}
+
+void test_address_exit_graceful ()
+{
+    NP_TEST_START
+    setup_test (NULL);
+    apteryx_prune_counting = true;
+    kermond_graceful = true;
+    address_cache_exit ();
+    NP_ASSERT_EQUAL (apteryx_prunes, 0);
+    NP_ASSERT_NULL (published);
+    NP_TEST_END ("ADDRESS-CACHE: Exiting\n")
+}
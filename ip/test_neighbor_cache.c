@@ -78,6 +78,7 @@ setup_test (char *ignore)
     np_mock (apteryx_set_tree_full, mock_apteryx_set_tree_full);
     np_mock (apteryx_set_full, mock_apteryx_set_full);
     np_mock (apteryx_prune, mock_apteryx_prune_path);
+    link_active = true;
     apteryx_tree = NULL;
     apteryx_path = NULL;
     apteryx_value = NULL;
@@ -148,6 +149,27 @@ void test_neighbor_ipv4 ()
     NP_TEST_END ("")
 }
 
+void test_neighbor_ipv4_state_only ()
+{
+    NP_TEST_START
+    setup_test (NULL);
+    struct nl_object *neigh = make_neighbor (AF_INET, ADDRV4, LLADDR);
+    rtnl_neigh_set_state ((struct rtnl_neigh *) neigh, NUD_REACHABLE);
+    nl_neighbor_cb (NL_ACT_NEW, NULL, neigh);
+    NP_ASSERT_NOT_NULL (apteryx_tree);
+    apteryx_free_tree (apteryx_tree);
+    apteryx_tree = NULL;
+    rtnl_neigh_set_state ((struct rtnl_neigh *) neigh, NUD_STALE);
+    nl_neighbor_cb (NL_ACT_CHANGE, NULL, neigh);
+    nl_object_put (neigh);
+    NP_ASSERT_NULL (apteryx_tree);
+    NP_ASSERT_EQUAL (suppressed_writes, 1);
+    NP_ASSERT_NULL (apteryx_path);
+    NP_ASSERT_NULL (apteryx_value);
+    NP_ASSERT_NULL (apteryx_prune_path);
+    NP_TEST_END ("")
+}
+
 void test_neighbor_ipv6 ()
 {
     NP_TEST_START
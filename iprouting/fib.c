@@ -19,99 +19,525 @@
  */
 #include "kermond.h"
 #include <netlink/route/route.h>
+#include <netlink/route/rtnl.h>
+#include <netlink/msg.h>
+#include <linux/rtnetlink.h>
+#include <arpa/inet.h>
 #include "iprouting.h"
+#include "kermond-counters.h"
 
-static char *
-route_to_string (struct rtnl_route *rt_route)
+/* Compact copy of a kernel route */
+typedef struct fib_record
 {
-    struct nl_addr *dst_addr = rtnl_route_get_dst (rt_route);
-    int dst_prefix_len = 0;
-    struct rtnl_nexthop *nexthop = rtnl_route_nexthop_n (rt_route, 0);
-    struct nl_addr *nexthop_addr = nexthop ? rtnl_route_nh_get_gateway (nexthop) : NULL;
-    char dest_str_addr[64] = { };
-    char nexthop_str_addr[64] = { };
-    int family = AF_UNSPEC;
-    int ifindex = 0;
+    uint8_t dst[16];
+    uint8_t gateway[16];
+    uint32_t table;
+    uint32_t priority;
+    uint32_t ifindex;
+    uint8_t family;
+    uint8_t plen;
+    uint8_t tos;
+    uint8_t protocol;
+    uint8_t mark;
+} fib_record;
 
-    if (nexthop)
+/* Records are allocated from fixed size blocks that are never moved */
+typedef union fib_slot
+{
+    fib_record rec;
+    union fib_slot *next;
+} fib_slot;
+#define FIB_ARENA_BLOCK 4096
+static GPtrArray *arena = NULL;
+static fib_slot *arena_free = NULL;
+
+/* All routes by key (family, table, dst/plen, tos, priority) */
+static GHashTable *fib_routes = NULL;
+
+/* Main table routes indexed by prefix for lookups */
+static lpm_trie *fib_v4 = NULL;
+static lpm_trie *fib_v6 = NULL;
+static GRWLock fib_lock = { };
+
+/* Memory used to track routes */
+static uint64_t fib_count = 0;
+static uint64_t fib_bytes = 0;
+
+/* Sockets used to track routes without the libnl cache */
+static struct nl_sock *mirror_sock = NULL;
+static struct nl_sock *mirror_sync = NULL;
+static guint mirror_source = 0;
+
+static fib_record *
+arena_alloc (void)
+{
+    fib_slot *slot;
+    int i;
+
+    if (!arena_free)
     {
-        nexthop_addr = rtnl_route_nh_get_gateway (nexthop);
-        if (nexthop_addr)
+        slot = g_malloc (FIB_ARENA_BLOCK * sizeof (fib_slot));
+        for (i = 0; i < FIB_ARENA_BLOCK; i++)
         {
-            family = nl_addr_get_family (nexthop_addr);
+            slot[i].next = arena_free;
+            arena_free = &slot[i];
         }
-        ifindex = rtnl_route_nh_get_ifindex (nexthop);
+        g_ptr_array_add (arena, slot);
     }
-    if (family == AF_UNSPEC && dst_addr)
+    slot = arena_free;
+    arena_free = slot->next;
+    return &slot->rec;
+}
+
+static void
+arena_release (fib_record *rec)
+{
+    fib_slot *slot = (fib_slot *) rec;
+    slot->next = arena_free;
+    arena_free = slot;
+}
+
+static guint
+fib_record_hash (gconstpointer p)
+{
+    const fib_record *rec = p;
+    guint hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < (rec->family == AF_INET ? 4 : 16); i++)
+        hash = (hash ^ rec->dst[i]) * 16777619u;
+    hash = (hash ^ rec->plen) * 16777619u;
+    hash = (hash ^ rec->tos) * 16777619u;
+    hash = (hash ^ rec->table) * 16777619u;
+    hash = (hash ^ rec->priority) * 16777619u;
+    return hash ^ rec->family;
+}
+
+static gboolean
+fib_record_equal (gconstpointer a, gconstpointer b)
+{
+    const fib_record *ra = a;
+    const fib_record *rb = b;
+
+    return ra->family == rb->family && ra->table == rb->table &&
+        ra->plen == rb->plen && ra->tos == rb->tos &&
+        ra->priority == rb->priority && memcmp (ra->dst, rb->dst, sizeof (ra->dst)) == 0;
+}
+
+static gint
+fib_record_cmp (gconstpointer a, gconstpointer b)
+{
+    const fib_record *ra = a;
+    const fib_record *rb = b;
+    return (ra->priority > rb->priority) - (ra->priority < rb->priority);
+}
+
+static char *
+fib_record_string (const fib_record *rec)
+{
+    char dest_str_addr[INET6_ADDRSTRLEN] = { };
+    char nexthop_str_addr[INET6_ADDRSTRLEN] = { };
+
+    inet_ntop (rec->family, rec->dst, dest_str_addr, sizeof (dest_str_addr));
+    inet_ntop (rec->family, rec->gateway, nexthop_str_addr, sizeof (nexthop_str_addr));
+    return g_strdup_printf ("%s_%d_%s_%d_%d_%d",
+                            dest_str_addr, rec->plen, nexthop_str_addr,
+                            rec->ifindex, rec->protocol, rec->priority);
+}
+
+static void
+fib_update_stats (void)
+{
+    fib_count = g_hash_table_size (fib_routes);
+    fib_bytes = arena->len * FIB_ARENA_BLOCK * sizeof (fib_slot) +
+        fib_count * (sizeof (gpointer) + sizeof (guint));
+}
+
+/* Publish a change and keep the lookup trie in sync with the
+ * kernel's main table. Each prefix holds its routes ordered by priority. */
+static void
+fib_publish (bool add, fib_record *rec)
+{
+    lpm_trie *trie = rec->family == AF_INET ? fib_v4 : fib_v6;
+    char *route = fib_record_string (rec);
+    char *path;
+    GList *routes;
+
+    DEBUG ("FIB: %s(%s)\n", add ? "NEW" : "DEL", route);
+
+    if (rec->table == RT_TABLE_MAIN)
     {
-        family = nl_addr_get_family (dst_addr);
+        g_rw_lock_writer_lock (&fib_lock);
+        routes = lpm_get (trie, rec->dst, rec->plen);
+        if (add)
+            routes = g_list_insert_sorted (routes, rec, fib_record_cmp);
+        else
+            routes = g_list_remove (routes, rec);
+        if (routes)
+            lpm_insert (trie, rec->dst, rec->plen, routes);
+        else
+            lpm_remove (trie, rec->dst, rec->plen);
+        g_rw_lock_writer_unlock (&fib_lock);
     }
 
-    if (dst_addr && nl_addr_get_len (dst_addr) > 0)
+    /* Update Apteryx */
+    path = g_strdup_printf ("%s/%s", rec->family == AF_INET ?
+                            ROUTING_IPV4_FIB : ROUTING_IPV6_FIB, route);
+    apteryx_batch_set (path, add ? route : NULL);
+    free (path);
+    free (route);
+}
+
+static void
+fib_route_del (const fib_record *key)
+{
+    fib_record *rec = g_hash_table_lookup (fib_routes, key);
+
+    if (!rec)
+        return;
+    g_hash_table_remove (fib_routes, rec);
+    fib_publish (false, rec);
+    g_rw_lock_writer_lock (&fib_lock);
+    arena_release (rec);
+    g_rw_lock_writer_unlock (&fib_lock);
+}
+
+static void
+fib_route_add (const fib_record *new)
+{
+    fib_record *rec = g_hash_table_lookup (fib_routes, new);
+
+    if (rec)
     {
-        dst_prefix_len = nl_addr_get_prefixlen (dst_addr);
-        nl_addr_set_prefixlen (dst_addr, 8 * nl_addr_get_len (dst_addr));
-        nl_addr2str (dst_addr, dest_str_addr, sizeof (dest_str_addr));
-        nl_addr_set_prefixlen (dst_addr, dst_prefix_len);
+        rec->mark = 1;
+        if (rec->ifindex == new->ifindex && rec->protocol == new->protocol &&
+            memcmp (rec->gateway, new->gateway, sizeof (rec->gateway)) == 0)
+            return;
+        fib_route_del (rec);
     }
-    else if (family == AF_INET)
-        g_strlcpy (dest_str_addr, "0.0.0.0", sizeof (dest_str_addr));
-    else if (family == AF_INET6)
-        g_strlcpy (dest_str_addr, "::", sizeof (dest_str_addr));
-    if (nexthop_addr)
-        nl_addr2str (nexthop_addr, nexthop_str_addr, sizeof (nexthop_str_addr));
-    else if (family == AF_INET)
-        g_strlcpy (nexthop_str_addr, "0.0.0.0", sizeof (nexthop_str_addr));
-    else if (family == AF_INET6)
-        g_strlcpy (nexthop_str_addr, "::", sizeof (nexthop_str_addr));
+    rec = arena_alloc ();
+    *rec = *new;
+    rec->mark = 1;
+    g_hash_table_add (fib_routes, rec);
+    fib_publish (true, rec);
+}
 
-    return g_strdup_printf ("%s_%d_%s_%d_%d_%d",
-                            dest_str_addr, dst_prefix_len, nexthop_str_addr,
-                            ifindex, rtnl_route_get_protocol (rt_route),
-                            rtnl_route_get_priority (rt_route));
+/* Local, cloned and non-IP routes are not part of the FIB view */
+static bool
+fib_ignore (const fib_record *rec, unsigned int flags)
+{
+    return (rec->family != AF_INET && rec->family != AF_INET6) ||
+        rec->table == RT_TABLE_LOCAL || (flags & RTM_F_CLONED);
+}
+
+/* Build a record from a libnl route, false if it is not part of the FIB view */
+static bool
+route_to_record (struct rtnl_route *rt, fib_record *rec)
+{
+    struct nl_addr *dst = rtnl_route_get_dst (rt);
+    struct rtnl_nexthop *nexthop = rtnl_route_nexthop_n (rt, 0);
+    struct nl_addr *gateway = nexthop ? rtnl_route_nh_get_gateway (nexthop) : NULL;
+
+    memset (rec, 0, sizeof (*rec));
+    rec->family = rtnl_route_get_family (rt);
+    rec->table = rtnl_route_get_table (rt);
+    rec->tos = rtnl_route_get_tos (rt);
+    rec->protocol = rtnl_route_get_protocol (rt);
+    rec->priority = rtnl_route_get_priority (rt);
+    if (fib_ignore (rec, rtnl_route_get_flags (rt)))
+        return false;
+    if (dst && nl_addr_get_len (dst) > 0)
+    {
+        memcpy (rec->dst, nl_addr_get_binary_addr (dst),
+                MIN (nl_addr_get_len (dst), sizeof (rec->dst)));
+        rec->plen = nl_addr_get_prefixlen (dst);
+    }
+    if (nexthop)
+        rec->ifindex = rtnl_route_nh_get_ifindex (nexthop);
+    if (gateway && nl_addr_get_family (gateway) == rec->family)
+        memcpy (rec->gateway, nl_addr_get_binary_addr (gateway),
+                MIN (nl_addr_get_len (gateway), sizeof (rec->gateway)));
+    return true;
 }
 
 static void
 nl_route_cb (int action, struct nl_object *old_obj, struct nl_object *new_obj)
 {
-    struct rtnl_route *rt = (struct rtnl_route *) new_obj;
-    char *route = route_to_string (rt);
-    char *data = (action == NL_ACT_NEW) ? route : NULL;
+    fib_record old_rec;
+    fib_record new_rec;
+    bool old_valid = false;
+    bool new_valid = false;
 
-    if (!route || (action != NL_ACT_NEW && action != NL_ACT_DEL))
+    /* v2 callbacks deliver a delete as (old, NULL) */
+    if (action == NL_ACT_DEL && !new_obj)
+    {
+        new_obj = old_obj;
+        old_obj = NULL;
+    }
+    if ((action != NL_ACT_NEW && action != NL_ACT_DEL && action != NL_ACT_CHANGE) ||
+        (!old_obj && !new_obj))
     {
-        ERROR ("FIB: invalid route cb action:%d route:%s\n", action, route);
-        free (route);
+        ERROR ("FIB: invalid route cb action:%d\n", action);
         return;
     }
 
-    /* Debug */
-    DEBUG ("FIB: %s(%s)\n", action == NL_ACT_NEW ? "NEW" : "DEL", route);
-    if (kermond_verbose)
+    if (kermond_verbose && new_obj)
         nl_object_dump (new_obj, &netlink_dp);
 
-    /* Update Apteryx */
-    if (rtnl_route_get_family (rt) == AF_INET)
-        apteryx_set_string (ROUTING_IPV4_FIB, route, data);
+    if (new_obj)
+        new_valid = route_to_record ((struct rtnl_route *) new_obj, &new_rec);
+    if (action == NL_ACT_CHANGE && old_obj)
+        old_valid = route_to_record ((struct rtnl_route *) old_obj, &old_rec);
+
+    switch (action)
+    {
+    case NL_ACT_NEW:
+        if (new_valid)
+            fib_route_add (&new_rec);
+        break;
+    case NL_ACT_DEL:
+        if (new_valid)
+            fib_route_del (&new_rec);
+        break;
+    case NL_ACT_CHANGE:
+        /* Remove what the route was, then add what it has become */
+        if (old_valid && !(new_valid && fib_record_equal (&old_rec, &new_rec)))
+            fib_route_del (&old_rec);
+        if (new_valid)
+            fib_route_add (&new_rec);
+        break;
+    }
+    fib_update_stats ();
+}
+
+/* Parse a route message straight into a record */
+static int
+mirror_msg_cb (struct nl_msg *msg, void *arg)
+{
+    struct nlmsghdr *nlh = nlmsg_hdr (msg);
+    struct nlattr *tb[RTA_MAX + 1];
+    struct rtmsg *rtm;
+    fib_record rec = { };
+    int len;
+
+    if (nlh->nlmsg_type != RTM_NEWROUTE && nlh->nlmsg_type != RTM_DELROUTE)
+        return NL_OK;
+    if (nlmsg_parse (nlh, sizeof (struct rtmsg), tb, RTA_MAX, NULL) < 0)
+        return NL_SKIP;
+
+    rtm = nlmsg_data (nlh);
+    rec.family = rtm->rtm_family;
+    rec.plen = rtm->rtm_dst_len;
+    rec.tos = rtm->rtm_tos;
+    rec.protocol = rtm->rtm_protocol;
+    rec.table = tb[RTA_TABLE] ? nla_get_u32 (tb[RTA_TABLE]) : rtm->rtm_table;
+    if (fib_ignore (&rec, rtm->rtm_flags))
+        return NL_OK;
+    len = rec.family == AF_INET ? 4 : 16;
+    if (tb[RTA_DST])
+        memcpy (rec.dst, nla_data (tb[RTA_DST]), MIN (nla_len (tb[RTA_DST]), len));
+    if (tb[RTA_PRIORITY])
+        rec.priority = nla_get_u32 (tb[RTA_PRIORITY]);
+    if (tb[RTA_OIF])
+        rec.ifindex = nla_get_u32 (tb[RTA_OIF]);
+    if (tb[RTA_GATEWAY])
+        memcpy (rec.gateway, nla_data (tb[RTA_GATEWAY]), MIN (nla_len (tb[RTA_GATEWAY]), len));
+    else if (tb[RTA_MULTIPATH] && nla_len (tb[RTA_MULTIPATH]) >= sizeof (struct rtnexthop))
+    {
+        /* First nexthop only, as for the libnl cache */
+        struct rtnexthop *rtnh = nla_data (tb[RTA_MULTIPATH]);
+        struct nlattr *ntb[RTA_MAX + 1];
+
+        rec.ifindex = rtnh->rtnh_ifindex;
+        if (rtnh->rtnh_len > sizeof (*rtnh) &&
+            nla_parse (ntb, RTA_MAX, (struct nlattr *) RTNH_DATA (rtnh),
+                       rtnh->rtnh_len - sizeof (*rtnh), NULL) == 0 && ntb[RTA_GATEWAY])
+            memcpy (rec.gateway, nla_data (ntb[RTA_GATEWAY]),
+                    MIN (nla_len (ntb[RTA_GATEWAY]), len));
+    }
+
+    if (nlh->nlmsg_type == RTM_NEWROUTE)
+        fib_route_add (&rec);
     else
-        apteryx_set_string (ROUTING_IPV6_FIB, route, data);
+        fib_route_del (&rec);
+    return NL_OK;
+}
 
-    free (route);
+/* Dump all routes, dropping any we no longer see */
+static bool
+mirror_sync_routes (void)
+{
+    GHashTableIter iter;
+    fib_record *rec;
+    GList *stale = NULL;
+    int err;
+
+    g_hash_table_iter_init (&iter, fib_routes);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &rec, NULL))
+        rec->mark = 0;
+
+    apteryx_batch_bulk (true);
+    err = nl_rtgen_request (mirror_sync, RTM_GETROUTE, AF_UNSPEC, NLM_F_DUMP);
+    if (err >= 0)
+        err = nl_recvmsgs_default (mirror_sync);
+    if (err < 0)
+    {
+        ERROR ("FIB: Route dump failed: %s\n", nl_geterror (err));
+    }
+    else
+    {
+        g_hash_table_iter_init (&iter, fib_routes);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &rec, NULL))
+        {
+            if (!rec->mark)
+                stale = g_list_prepend (stale, rec);
+        }
+        g_list_foreach (stale, (GFunc) fib_route_del, NULL);
+        g_list_free (stale);
+    }
+    apteryx_batch_bulk (false);
+
+    fib_update_stats ();
+    DEBUG ("FIB: %" PRIu64 " routes in %" PRIu64 " bytes (%" PRIu64 " bytes/route)\n",
+           fib_count, fib_bytes, fib_count ? fib_bytes / fib_count : 0);
+    return err >= 0;
+}
+
+static gboolean
+mirror_monitor (gint fd, GIOCondition condition, gpointer data)
+{
+    int err = nl_recvmsgs_default (mirror_sock);
+
+    /* Changes were lost so start again from a full dump */
+    if (err == -NLE_NOMEM)
+    {
+        ERROR ("FIB: Route monitor overrun, resyncing\n");
+        mirror_sync_routes ();
+    }
+    else
+    {
+        fib_update_stats ();
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static bool
+mirror_init (void)
+{
+    int err;
+
+    mirror_sock = nl_socket_alloc ();
+    nl_socket_disable_seq_check (mirror_sock);
+    nl_socket_modify_cb (mirror_sock, NL_CB_VALID, NL_CB_CUSTOM, mirror_msg_cb, NULL);
+    err = nl_connect (mirror_sock, NETLINK_ROUTE);
+    if (err >= 0)
+        err = nl_socket_add_memberships (mirror_sock, RTNLGRP_IPV4_ROUTE, RTNLGRP_IPV6_ROUTE, 0);
+    if (err >= 0)
+        err = nl_socket_set_buffer_size (mirror_sock, NETLINK_RX_BUFFER, 0);
+    if (err >= 0)
+        err = nl_socket_set_nonblocking (mirror_sock);
+    if (err < 0)
+    {
+        ERROR ("FIB: Failed to create route monitor: %s\n", nl_geterror (err));
+        return false;
+    }
+
+    mirror_sync = nl_socket_alloc ();
+    nl_socket_modify_cb (mirror_sync, NL_CB_VALID, NL_CB_CUSTOM, mirror_msg_cb, NULL);
+    err = nl_connect (mirror_sync, NETLINK_ROUTE);
+    if (err < 0)
+    {
+        ERROR ("FIB: Failed to create route sync socket: %s\n", nl_geterror (err));
+        return false;
+    }
+
+    /* Subscribed before the dump so no change is missed */
+    mirror_sync_routes ();
+    mirror_source = g_unix_fd_add (nl_socket_get_fd (mirror_sock), G_IO_IN,
+                                   mirror_monitor, NULL);
+    return true;
+}
+
+static void
+mirror_exit (void)
+{
+    if (mirror_source)
+        g_source_remove (mirror_source);
+    mirror_source = 0;
+    if (mirror_sock)
+        nl_socket_free (mirror_sock);
+    mirror_sock = NULL;
+    if (mirror_sync)
+        nl_socket_free (mirror_sync);
+    mirror_sync = NULL;
+}
+
+/* Longest prefix match for /routing/ipv{4,6}/lookup/<address>.
+ * Returns the best FIB entry covering the address. */
+static char *
+fib_lookup (const char *path)
+{
+    uint8_t key[LPM_KEY_MAX] = { };
+    const char *addr;
+    lpm_trie *trie;
+    GList *routes;
+    char *value = NULL;
+
+    if (strncmp (path, ROUTING_IPV4_LOOKUP "/", strlen (ROUTING_IPV4_LOOKUP "/")) == 0)
+    {
+        addr = path + strlen (ROUTING_IPV4_LOOKUP "/");
+        if (inet_pton (AF_INET, addr, key) != 1)
+            return NULL;
+        trie = fib_v4;
+    }
+    else if (strncmp (path, ROUTING_IPV6_LOOKUP "/", strlen (ROUTING_IPV6_LOOKUP "/")) == 0)
+    {
+        addr = path + strlen (ROUTING_IPV6_LOOKUP "/");
+        if (inet_pton (AF_INET6, addr, key) != 1)
+            return NULL;
+        trie = fib_v6;
+    }
+    else
+        return NULL;
+
+    g_rw_lock_reader_lock (&fib_lock);
+    routes = lpm_lookup (trie, key, NULL);
+    if (routes)
+        value = fib_record_string ((fib_record *) routes->data);
+    g_rw_lock_reader_unlock (&fib_lock);
+    return value;
 }
 
 static bool
 fib_init (void)
 {
+    bool ok = true;
+
     DEBUG ("FIB: Initialising\n");
 
-    /* Setup Apteryx */
-    apteryx_prune (ROUTING_IPV4_FIB);
-    apteryx_prune (ROUTING_IPV6_FIB);
+    /* Setup Apteryx, only publishing what differs from a previous run */
+    apteryx_reconcile_begin (ROUTING_IPV4_FIB);
+    apteryx_reconcile_begin (ROUTING_IPV6_FIB);
+    arena = g_ptr_array_new_with_free_func (g_free);
+    fib_routes = g_hash_table_new (fib_record_hash, fib_record_equal);
+    fib_v4 = lpm_new (32);
+    fib_v6 = lpm_new (128);
+    apteryx_provide (ROUTING_IPV4_LOOKUP "/*", fib_lookup);
+    apteryx_provide (ROUTING_IPV6_LOOKUP "/*", fib_lookup);
+    apteryx_counter_register (KERMOND_COUNTERS_FIB_ROUTES, &fib_count);
+    apteryx_counter_register (KERMOND_COUNTERS_FIB_BYTES, &fib_bytes);
 
     /* Setup Netlink */
-    netlink_register ("route/route", nl_route_cb);
+    if (kermond_fib_mirror)
+        ok = mirror_init ();
+    else
+        netlink_register_filtered ("route/route", nl_route_cb,
+                                   NETLINK_FILTER_ROUTE_LOCAL |
+                                   NETLINK_FILTER_ROUTE_CLONED |
+                                   NETLINK_FILTER_ROUTE_NON_IP);
+    apteryx_reconcile_end ();
 
-    return true;
+    return ok;
 }
 
 static void
@@ -120,11 +546,33 @@ fib_exit ()
     DEBUG ("FIB: Exiting\n");
 
     /* Remove Netlink configuration */
-    netlink_unregister ("route/route", nl_route_cb);
+    if (kermond_fib_mirror)
+        mirror_exit ();
+    else
+        netlink_unregister ("route/route", nl_route_cb);
+    apteryx_unprovide (ROUTING_IPV4_LOOKUP "/*", fib_lookup);
+    apteryx_unprovide (ROUTING_IPV6_LOOKUP "/*", fib_lookup);
+    apteryx_counter_unregister (KERMOND_COUNTERS_FIB_ROUTES);
+    apteryx_counter_unregister (KERMOND_COUNTERS_FIB_BYTES);
+    g_rw_lock_writer_lock (&fib_lock);
+    lpm_free (fib_v4, (GDestroyNotify) g_list_free);
+    lpm_free (fib_v6, (GDestroyNotify) g_list_free);
+    fib_v4 = fib_v6 = NULL;
+    g_rw_lock_writer_unlock (&fib_lock);
+    if (fib_routes)
+        g_hash_table_destroy (fib_routes);
+    fib_routes = NULL;
+    if (arena)
+        g_ptr_array_free (arena, TRUE);
+    arena = NULL;
+    arena_free = NULL;
 
-    /* Remove FIB from Apteryx */
-    apteryx_prune (ROUTING_IPV4_FIB);
-    apteryx_prune (ROUTING_IPV6_FIB);
+    /* Remove FIB from Apteryx, unless the next run will reconcile it */
+    if (!kermond_graceful)
+    {
+        apteryx_prune (ROUTING_IPV4_FIB);
+        apteryx_prune (ROUTING_IPV6_FIB);
+    }
 }
 
 MODULE_CREATE ("fib", fib_init, NULL, fib_exit);
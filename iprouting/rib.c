@@ -19,21 +19,61 @@
  */
 #include "kermond.h"
 #include <netlink/route/route.h>
-#include <netlink/route/link.h>
+#include <netlink/msg.h>
+#include <linux/nexthop.h>
+#include <arpa/inet.h>
 #include "iprouting.h"
 
-/* Fallback if we have no link cache */
-extern unsigned int if_nametoindex (const char *ifname);
-
-/* Socket for making configuration changes */
-static struct nl_sock *sock = NULL;
-
-/* Required caches */
-static struct nl_cache *link_cache = NULL;
-
 /* Keep an Apteryx cache for static routes */
 static GHashTable *v4_static_routes = NULL;
 static GHashTable *v6_static_routes = NULL;
+static GMutex rib_lock = { };
+
+/* Configured parameters for each index */
+static GHashTable *v4_config = NULL;
+static GHashTable *v6_config = NULL;
+
+/* Indexes changed since the last flush */
+#define RIB_DEBOUNCE_MS 20
+static GHashTable *v4_dirty = NULL;
+static GHashTable *v6_dirty = NULL;
+static guint flush_source = 0;
+
+/* Kernel nexthop objects shared by routes with the same gateway and interface */
+#define RIB_NEXTHOP_ID_BASE 0x6b6d0000
+#define RIB_NEXTHOP_ID_MAX (RIB_NEXTHOP_ID_BASE + 0xffff)
+#define RIB_NEXTHOP_ID_OURS(id) ((id) >= RIB_NEXTHOP_ID_BASE && (id) <= RIB_NEXTHOP_ID_MAX)
+typedef struct rib_nexthop
+{
+    uint32_t id;
+    int refcount;
+} rib_nexthop;
+static GHashTable *nexthops = NULL;
+static uint32_t nexthop_next_id = RIB_NEXTHOP_ID_BASE;
+static GQueue nexthop_free_ids = G_QUEUE_INIT;
+static bool nexthop_objects = false;
+
+/* Routes and nexthops left in the kernel by a previous run,
+ * held until the first flush has matched them to the configuration */
+typedef struct kernel_route
+{
+    struct rtnl_route *route;
+    uint32_t nhid;
+} kernel_route;
+static GHashTable *kernel_routes = NULL;
+static GHashTable *stale_nexthops = NULL;
+
+/* Request in flight to the kernel */
+typedef struct route_request
+{
+    int family;
+    int index;
+    bool add;
+    struct rtnl_route *rr;
+    /* Route this add takes over from, dealt with once the kernel answers */
+    struct rtnl_route *old;
+    bool del_old;
+} route_request;
 
 static bool
 route_valid (struct rtnl_route *rr)
@@ -45,28 +85,74 @@ route_valid (struct rtnl_route *rr)
     return true;
 }
 
+/* Routes with the same key are the same kernel route */
 static bool
-parse_parameter (struct rtnl_route *rr, int index,
-                 const char *parameter, const char *value, bool * changed)
+route_same_key (struct rtnl_route *a, struct rtnl_route *b)
 {
-    int err;
+    return rtnl_route_get_family (a) == rtnl_route_get_family (b) &&
+        rtnl_route_get_table (a) == rtnl_route_get_table (b) &&
+        rtnl_route_get_tos (a) == rtnl_route_get_tos (b) &&
+        rtnl_route_get_priority (a) == rtnl_route_get_priority (b) &&
+        nl_addr_cmp (rtnl_route_get_dst (a), rtnl_route_get_dst (b)) == 0;
+}
+
+/* Identity of a kernel route (the fields route_same_key compares) */
+static char *
+route_key (struct rtnl_route *rr)
+{
+    struct nl_addr *dst = rtnl_route_get_dst (rr);
+    uint8_t addr[16] = { };
+    char str[INET6_ADDRSTRLEN] = "";
+    int family = rtnl_route_get_family (rr);
+    uint32_t priority = rtnl_route_get_priority (rr);
+
+    /* The kernel gives IPv6 routes without a metric the user default */
+    if (family == AF_INET6 && priority == 0)
+        priority = 1024;
+    /* The kernel reports default routes without an address */
+    if (dst && nl_addr_get_len (dst) > 0)
+        memcpy (addr, nl_addr_get_binary_addr (dst), MIN (nl_addr_get_len (dst), sizeof (addr)));
+    inet_ntop (family, addr, str, sizeof (str));
+    return g_strdup_printf ("%d/%s/%d/%u/%u/%u", family, str,
+                            dst ? nl_addr_get_prefixlen (dst) : 0, rtnl_route_get_tos (rr),
+                            priority, rtnl_route_get_table (rr));
+}
 
-    /* Default to no change */
-    if (changed)
-        *changed = false;
+/* The single nexthop of a static route, created on first use */
+static struct rtnl_nexthop *
+route_nexthop (struct rtnl_route *rr)
+{
+    struct rtnl_nexthop *nh = rtnl_route_nexthop_n (rr, 0);
+
+    if (!nh)
+    {
+        nh = rtnl_route_nh_alloc ();
+        rtnl_route_add_nexthop (rr, nh);
+    }
+    return nh;
+}
+
+static bool
+parse_parameter (struct rtnl_route *rr, int index, int parameter, const char *value)
+{
+    int err;
 
     /* Parse parameter */
-    if (strcmp (parameter, ROUTING_IPV4_RIB_ID) == 0)
+    switch (parameter)
+    {
+    case ROUTING_IPV4_RIB_ID_NODE:
+    case ROUTING_IPV6_RIB_ID_NODE:
     {
         if (value && strtoull (value, NULL, 10) != index)
         {
             ERROR ("RIB: ID does not match index!\n");
             return false;
         }
+        break;
     }
-    else if (strcmp (parameter, ROUTING_IPV4_RIB_PREFIX) == 0)
+    case ROUTING_IPV4_RIB_PREFIX_NODE:
+    case ROUTING_IPV6_RIB_PREFIX_NODE:
     {
-        struct nl_addr *old = rtnl_route_get_dst (rr);
         struct nl_addr *addr = NULL;
 
         if (!value)
@@ -80,73 +166,45 @@ parse_parameter (struct rtnl_route *rr, int index,
             ERROR ("RIB: Unable to parse prefix \"%s\": %s\n", value, nl_geterror (err));
             return false;
         }
-        if (changed && (!old || nl_addr_cmp (old, addr) != 0))
-        {
-            *changed = true;
-        }
         rtnl_route_set_dst (rr, addr);
+        nl_addr_put (addr);
+        break;
     }
-    else if (strcmp (parameter, ROUTING_IPV4_RIB_NEXTHOP) == 0)
+    case ROUTING_IPV4_RIB_NEXTHOP_NODE:
+    case ROUTING_IPV6_RIB_NEXTHOP_NODE:
     {
-        struct rtnl_nexthop *old = rtnl_route_nexthop_n (rr, 0);
-        struct rtnl_nexthop *nh = NULL;
+        struct nl_addr *addr;
 
-        if (value)
-        {
-            struct nl_addr *addr;
-            err = nl_addr_parse (value, rtnl_route_get_family (rr), &addr);
-            if (err < 0)
-            {
-                ERROR ("RIB: Unable to parse nexthop: %s\n", nl_geterror (err));
-                return false;
-            }
-            nh = rtnl_route_nh_alloc ();
-            rtnl_route_nh_set_gateway (nh, addr);
-            nl_addr_put (addr);
-        }
-        if (changed)
+        if (!value)
+            return true;
+        err = nl_addr_parse (value, rtnl_route_get_family (rr), &addr);
+        if (err < 0)
         {
-            if ((!old && nh) || (old && !nh) ||
-                (rtnl_route_nh_compare (old, nh, ~0, 1) != 0))
-                *changed = true;
+            ERROR ("RIB: Unable to parse nexthop: %s\n", nl_geterror (err));
+            return false;
         }
-        if (old)
-            rtnl_route_remove_nexthop (rr, old);
-        if (nh)
-            rtnl_route_add_nexthop (rr, nh);
+        rtnl_route_nh_set_gateway (route_nexthop (rr), addr);
+        nl_addr_put (addr);
+        break;
     }
-    else if (strcmp (parameter, ROUTING_IPV4_RIB_IFNAME) == 0)
+    case ROUTING_IPV4_RIB_IFNAME_NODE:
+    case ROUTING_IPV6_RIB_IFNAME_NODE:
     {
-        struct rtnl_nexthop *old = rtnl_route_nexthop_n (rr, 0);
-        struct rtnl_nexthop *nh = NULL;
-        int ifindex = 0;
+        int ifindex;
 
-        if (value)
-        {
-            if (link_cache)
-                ifindex = rtnl_link_name2i (link_cache, value);
-            else
-                ifindex = if_nametoindex (value);
-            if (ifindex == 0)
-            {
-                ERROR ("RIB: Unable to parse ifname: %s\n", value);
-                return FALSE;
-            }
-            nh = rtnl_route_nh_alloc ();
-            rtnl_route_nh_set_ifindex (nh, ifindex);
-        }
-        if (changed)
+        if (!value)
+            return true;
+        ifindex = iftable_name2i (value);
+        if (ifindex == 0)
         {
-            if ((!old && nh) || (old && !nh) ||
-                (rtnl_route_nh_compare (old, nh, ~0, 1) != 0))
-                *changed = true;
+            ERROR ("RIB: Unable to parse ifname: %s\n", value);
+            return FALSE;
         }
-        if (old)
-            rtnl_route_remove_nexthop (rr, old);
-        if (nh)
-            rtnl_route_add_nexthop (rr, nh);
+        rtnl_route_nh_set_ifindex (route_nexthop (rr), ifindex);
+        break;
     }
-    else if (strcmp (parameter, ROUTING_IPV4_RIB_DISTANCE) == 0)
+    case ROUTING_IPV4_RIB_DISTANCE_NODE:
+    case ROUTING_IPV6_RIB_DISTANCE_NODE:
     {
         uint32_t distance = 0;
         uint32_t prio;
@@ -164,13 +222,11 @@ parse_parameter (struct rtnl_route *rr, int index,
         prio = rtnl_route_get_priority (rr);
         prio &= ~(0xFFFF0000);
         prio |= (distance << 16);
-        if (changed && prio != rtnl_route_get_priority (rr))
-        {
-            *changed = true;
-        }
         rtnl_route_set_priority (rr, prio);
+        break;
     }
-    else if (strcmp (parameter, ROUTING_IPV4_RIB_METRIC) == 0)
+    case ROUTING_IPV4_RIB_METRIC_NODE:
+    case ROUTING_IPV6_RIB_METRIC_NODE:
     {
         uint32_t metric = 0;
         uint32_t prio;
@@ -188,47 +244,36 @@ parse_parameter (struct rtnl_route *rr, int index,
         prio = rtnl_route_get_priority (rr);
         prio &= ~(0x0000FFFF);
         prio |= metric;
-        if (changed && rtnl_route_get_priority (rr) != prio)
-        {
-            *changed = true;
-        }
         rtnl_route_set_priority (rr, prio);
+        break;
     }
-    else if (strcmp (parameter, ROUTING_IPV4_RIB_PROTOCOL) == 0)
+    case ROUTING_IPV4_RIB_PROTOCOL_NODE:
+    case ROUTING_IPV6_RIB_PROTOCOL_NODE:
     {
         if (value && strcmp (value, "static") != 0)
         {
             ERROR ("RIB: Only static routes supported\n");
             return false;
         }
+        break;
     }
-    else
-    {
-        DEBUG ("RIB: Ignoring unsupported parameter \"%s\"\n", parameter);
+    default:
+        DEBUG ("RIB: Ignoring unsupported parameter \"%s\"\n", iprouting_schema[parameter].name);
         // ROUTING_IPV4_RIB_VRF_ID
         // ROUTING_IPV4_RIB_SNMP_ROUTE_TYPE
         // ROUTING_IPV4_RIB_DHCP_INTERFACE
+        break;
     }
     return true;
 }
 
+/* Build a route from the configured parameters for an index */
 static struct rtnl_route *
-apteryx_to_route (int family, int index)
+config_to_route (int family, int index, GHashTable *params)
 {
     struct rtnl_route *rr;
-    char *path;
-    GNode *root;
-    GNode *node;
-
-    /* Create Apteryx path */
-    if (family == 4)
-        path = g_strdup_printf (ROUTING_IPV4_RIB_PATH "/%d", index);
-    else
-        path = g_strdup_printf (ROUTING_IPV4_RIB_PATH "/%d", index);
-
-    /* Get all configuration for this route */
-    root = apteryx_get_tree (path);
-    free (path);
+    GHashTableIter iter;
+    gpointer parameter, value;
 
     /* Create route with defaults */
     rr = rtnl_route_alloc ();
@@ -240,37 +285,375 @@ apteryx_to_route (int family, int index)
     rtnl_route_set_protocol (rr, RTPROT_STATIC);
 
     /* Parse parameters */
-    node = root ? g_node_first_child (root) : NULL;
-    while (node)
+    g_hash_table_iter_init (&iter, params);
+    while (g_hash_table_iter_next (&iter, &parameter, &value))
     {
-        /* Parse the Apteryx parameter */
-        if (!parse_parameter (rr, index, APTERYX_NAME (node), APTERYX_VALUE (node), NULL))
+        if (!parse_parameter (rr, index, GPOINTER_TO_INT (parameter), value))
         {
             rtnl_route_put (rr);
             return NULL;
         }
-        node = node->next;
     }
-    apteryx_free_tree (root);
     return rr;
 }
 
+/* Gateway and interface of a route's first nexthop */
+static char *
+route_gateway_key (struct rtnl_route *rr)
+{
+    struct rtnl_nexthop *nh = rtnl_route_nexthop_n (rr, 0);
+    struct nl_addr *gw;
+    char gateway[INET6_ADDRSTRLEN + 4] = "";
+
+    if (!nh)
+        return NULL;
+    gw = rtnl_route_nh_get_gateway (nh);
+    if (gw)
+        nl_addr2str (gw, gateway, sizeof (gateway));
+    return g_strdup_printf ("%d/%s/%d", rtnl_route_get_family (rr), gateway,
+                            rtnl_route_nh_get_ifindex (nh));
+}
+
+/* Key of the shared nexthop for a route, NULL if the route needs an
+ * inline nexthop (the kernel requires an interface for nexthop objects) */
+static char *
+nexthop_key (struct rtnl_route *rr)
+{
+    struct rtnl_nexthop *nh = rtnl_route_nexthop_n (rr, 0);
+
+    if (!nexthop_objects || !nh || rtnl_route_nh_get_ifindex (nh) == 0)
+        return NULL;
+    return route_gateway_key (rr);
+}
+
+static void
+nexthop_result (int err, void *data)
+{
+    if (err < 0)
+    {
+        ERROR ("RIB: Nexthop %u request failed: %s\n", GPOINTER_TO_UINT (data), strerror (-err));
+    }
+}
+
+/* Create, replace or delete kernel nexthop id using the nexthop of rr
+ * (rr is only needed to create or replace) */
+static void
+nexthop_send (int type, int flags, uint32_t id, struct rtnl_route *rr)
+{
+    struct rtnl_nexthop *nh = rr ? rtnl_route_nexthop_n (rr, 0) : NULL;
+    struct nhmsg hdr = { };
+    struct nl_msg *msg;
+
+    hdr.nh_family = rr ? rtnl_route_get_family (rr) : AF_UNSPEC;
+    msg = nlmsg_alloc_simple (type, NLM_F_REQUEST | flags);
+    if (!msg || nlmsg_append (msg, &hdr, sizeof (hdr), NLMSG_ALIGNTO) < 0)
+    {
+        nlmsg_free (msg);
+        return;
+    }
+    nla_put_u32 (msg, NHA_ID, id);
+    if (type == RTM_NEWNEXTHOP && nh)
+    {
+        nla_put_u32 (msg, NHA_OIF, rtnl_route_nh_get_ifindex (nh));
+        if (rtnl_route_nh_get_gateway (nh))
+            nla_put_addr (msg, NHA_GATEWAY, rtnl_route_nh_get_gateway (nh));
+    }
+    VERBOSE ("RIB: %s nexthop %u\n", type == RTM_NEWNEXTHOP ? "SET" : "DEL", id);
+    netlink_request (msg, nexthop_result, GUINT_TO_POINTER (id));
+}
+
+/* Pick an unused ID from our range, reusing those of deleted nexthops.
+ * Returns 0 if the range is exhausted */
+static uint32_t
+nexthop_alloc_id (void)
+{
+    if (!g_queue_is_empty (&nexthop_free_ids))
+        return GPOINTER_TO_UINT (g_queue_pop_head (&nexthop_free_ids));
+    if (nexthop_next_id <= RIB_NEXTHOP_ID_MAX)
+        return nexthop_next_id++;
+    return 0;
+}
+
+/* Make an ID available again, once its delete is queued to the kernel */
+static void
+nexthop_free_id (uint32_t id)
+{
+    if (RIB_NEXTHOP_ID_OURS (id))
+        g_queue_push_tail (&nexthop_free_ids, GUINT_TO_POINTER (id));
+}
+
+/* Take a reference to the shared nexthop for a route, creating it if needed.
+ * Returns 0 if the route has to carry its own nexthop */
+static uint32_t
+nexthop_ref (struct rtnl_route *rr)
+{
+    char *key = nexthop_key (rr);
+    rib_nexthop *nh;
+
+    if (!key)
+        return 0;
+    nh = g_hash_table_lookup (nexthops, key);
+    if (!nh)
+    {
+        uint32_t id = nexthop_alloc_id ();
+        if (!id)
+        {
+            ERROR ("RIB: No nexthop IDs left, using an inline nexthop\n");
+            free (key);
+            return 0;
+        }
+        nh = calloc (1, sizeof (rib_nexthop));
+        nh->id = id;
+        g_hash_table_insert (nexthops, key, nh);
+        /* IDs from RIB_NEXTHOP_ID_BASE are ours, so take over any left behind */
+        nexthop_send (RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_REPLACE, nh->id, rr);
+    }
+    else
+        free (key);
+    nh->refcount++;
+    return nh->id;
+}
+
+static uint32_t
+nexthop_id (struct rtnl_route *rr)
+{
+    char *key = nexthop_key (rr);
+    rib_nexthop *nh = key ? g_hash_table_lookup (nexthops, key) : NULL;
+
+    free (key);
+    return nh ? nh->id : 0;
+}
+
+/* Drop a route's reference, deleting the nexthop when it is unused */
+static void
+nexthop_unref (struct rtnl_route *rr)
+{
+    char *key = nexthop_key (rr);
+    rib_nexthop *nh = key ? g_hash_table_lookup (nexthops, key) : NULL;
+
+    if (nh && --nh->refcount == 0)
+    {
+        nexthop_send (RTM_DELNEXTHOP, 0, nh->id, rr);
+        nexthop_free_id (nh->id);
+        g_hash_table_remove (nexthops, key);
+    }
+    free (key);
+}
+
+/* Dump kernel objects of one type, passing each message to cb */
 static bool
-route_add (int family, int index, struct rtnl_route *rr)
+kernel_dump (int type, void *hdr, size_t len, nl_recvmsg_msg_cb_t cb)
 {
+    struct nl_sock *sk = nl_socket_alloc ();
     int err;
 
+    nl_socket_modify_cb (sk, NL_CB_VALID, NL_CB_CUSTOM, cb, NULL);
+    err = nl_connect (sk, NETLINK_ROUTE);
+    if (err >= 0)
+        err = nl_send_simple (sk, type, NLM_F_DUMP, hdr, len);
+    if (err >= 0)
+        err = nl_recvmsgs_default (sk);
+    nl_socket_free (sk);
+    return err >= 0;
+}
+
+/* Remember nexthop objects from our ID range left by a previous run */
+static int
+kernel_nexthop_cb (struct nl_msg *msg, void *arg)
+{
+    struct nlmsghdr *nlh = nlmsg_hdr (msg);
+    struct nlattr *tb[NHA_MAX + 1];
+    uint32_t id;
+
+    if (!stale_nexthops || nlh->nlmsg_type != RTM_NEWNEXTHOP ||
+        nlmsg_parse (nlh, sizeof (struct nhmsg), tb, NHA_MAX, NULL) < 0 || !tb[NHA_ID])
+        return NL_OK;
+    id = nla_get_u32 (tb[NHA_ID]);
+    if (RIB_NEXTHOP_ID_OURS (id))
+    {
+        g_hash_table_add (stale_nexthops, GUINT_TO_POINTER (id));
+        nexthop_next_id = MAX (nexthop_next_id, id + 1);
+    }
+    return NL_OK;
+}
+
+/* Remember static routes left by a previous run */
+static int
+kernel_route_cb (struct nl_msg *msg, void *arg)
+{
+    struct nlmsghdr *nlh = nlmsg_hdr (msg);
+    struct rtmsg *rtm = nlmsg_data (nlh);
+    struct nlattr *tb[RTA_MAX + 1];
+    struct rtnl_route *route = NULL;
+    kernel_route *kr;
+
+    if (nlh->nlmsg_type != RTM_NEWROUTE || rtm->rtm_protocol != RTPROT_STATIC ||
+        rtm->rtm_table != RT_TABLE_MAIN ||
+        (rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6))
+        return NL_OK;
+    if (nlmsg_parse (nlh, sizeof (struct rtmsg), tb, RTA_MAX, NULL) < 0 ||
+        rtnl_route_parse (nlh, &route) < 0)
+        return NL_OK;
+    kr = calloc (1, sizeof (kernel_route));
+    kr->route = route;
+    kr->nhid = tb[RTA_NH_ID] ? nla_get_u32 (tb[RTA_NH_ID]) : 0;
+    g_hash_table_replace (kernel_routes, route_key (route), kr);
+    return NL_OK;
+}
+
+static void
+kernel_route_free (kernel_route *kr)
+{
+    rtnl_route_put (kr->route);
+    free (kr);
+}
+
+/* Check the kernel supports nexthop objects (Linux 5.3+) */
+static bool
+nexthop_supported (void)
+{
+    struct nhmsg hdr = { };
+
+    return kernel_dump (RTM_GETNEXTHOP, &hdr, sizeof (hdr), kernel_nexthop_cb);
+}
+
+/* Copy of a route with its nexthop replaced by a reference to a nexthop object */
+static struct rtnl_route *
+route_without_nexthops (struct rtnl_route *rr)
+{
+    struct rtnl_route *copy = (struct rtnl_route *) nl_object_clone ((struct nl_object *) rr);
+    struct rtnl_nexthop *nh;
+
+    while ((nh = rtnl_route_nexthop_n (copy, 0)) != NULL)
+    {
+        rtnl_route_remove_nexthop (copy, nh);
+        rtnl_route_nh_free (nh);
+    }
+    return copy;
+}
+
+static void route_del (int family, int index, struct rtnl_route *rr);
+
+/* Kernel result for a route we added or deleted */
+static void
+route_result (int err, void *data)
+{
+    route_request *req = (route_request *) data;
+    GHashTable *routes;
+
+    if (err < 0)
+    {
+        ERROR ("RIB: Unable to %s route %d: %s\n", req->add ? "add" : "delete",
+               req->index, strerror (-err));
+    }
+    if (err >= 0 && !req->old)
+    {
+        rtnl_route_put (req->rr);
+        free (req);
+        return;
+    }
+
+    g_mutex_lock (&rib_lock);
+    routes = req->family == 4 ? v4_static_routes : v6_static_routes;
+    if (err < 0 && req->add && req->index && routes &&
+        g_hash_table_lookup (routes, GINT_TO_POINTER (req->index)) == req->rr)
+    {
+        /* The kernel kept what it had, so track that and try again on the next change */
+        if (req->old)
+            g_hash_table_replace (routes, GINT_TO_POINTER (req->index), req->old);
+        else
+            g_hash_table_remove (routes, GINT_TO_POINTER (req->index));
+        req->old = NULL;
+        nexthop_unref (req->rr);
+        rtnl_route_put (req->rr);
+    }
+    else if (req->old)
+    {
+        /* Done with the old route, or a later change has taken its place */
+        if (req->del_old)
+            route_del (req->family, 0, req->old);
+        else
+            nexthop_unref (req->old);
+        rtnl_route_put (req->old);
+    }
+    g_mutex_unlock (&rib_lock);
+    rtnl_route_put (req->rr);
+    free (req);
+}
+
+/* Queue a route request, pointing at nexthop object nhid if set.
+ * An add taking over from old is given the caller's reference to it */
+static bool
+route_request_queue (int family, int index, struct rtnl_route *rr, bool add, int flags,
+                     uint32_t nhid, struct rtnl_route *old)
+{
+    route_request *req;
+    struct rtnl_route *tmpl = rr;
+    struct nl_msg *msg = NULL;
+    int err;
+
+    if (nhid)
+        tmpl = route_without_nexthops (rr);
+    if (add)
+        err = rtnl_route_build_add_request (tmpl, NLM_F_CREATE | flags, &msg);
+    else
+        err = rtnl_route_build_del_request (tmpl, flags, &msg);
+    if (tmpl != rr)
+        rtnl_route_put (tmpl);
+    if (err >= 0 && nhid)
+        err = nla_put_u32 (msg, RTA_NH_ID, nhid);
+    if (err < 0)
+    {
+        ERROR ("RIB: Unable to build route request: %s\n", nl_geterror (err));
+        nlmsg_free (msg);
+        return false;
+    }
+    req = calloc (1, sizeof (route_request));
+    req->family = family;
+    req->index = index;
+    req->add = add;
+    req->rr = rr;
+    req->old = old;
+    /* A route not replaced in place is removed once the new one is in */
+    req->del_old = !(flags & NLM_F_REPLACE);
+    nl_object_get ((struct nl_object *) rr);
+    if (!netlink_request (msg, route_result, req))
+    {
+        rtnl_route_put (rr);
+        free (req);
+        return false;
+    }
+    return true;
+}
+
+static bool
+route_request_send (int family, int index, struct rtnl_route *rr, bool add, int flags,
+                    struct rtnl_route *old)
+{
+    /* Point at the shared nexthop rather than carrying our own */
+    uint32_t nhid = add ? nexthop_ref (rr) : nexthop_id (rr);
+
+    if (!route_request_queue (family, index, rr, add, flags, nhid, old))
+    {
+        if (add)
+            nexthop_unref (rr);
+        return false;
+    }
+    return true;
+}
+
+/* Add or replace a route, taking over from old once the kernel has it */
+static bool
+route_add (int family, int index, struct rtnl_route *rr, int flags, struct rtnl_route *old)
+{
     /* Debug */
-    VERBOSE ("RIB: ADD static route\n");
+    VERBOSE ("RIB: %s static route\n", (flags & NLM_F_REPLACE) ? "REPLACE" : "ADD");
     if (kermond_verbose)
         nl_object_dump ((struct nl_object *) rr, &netlink_dp);
 
-    /* Add the route */
-    if ((err = rtnl_route_add (sock, rr, NLM_F_EXCL)) < 0)
-    {
-        ERROR ("RIB: Unable to add route: %s\n", nl_geterror (err));
+    /* Add the route, errors are reported asynchronously */
+    if (!route_request_send (family, index, rr, true, flags, old))
         return false;
-    }
 
     /* Store the route by index */
     if (family == 4)
@@ -284,18 +667,14 @@ route_add (int family, int index, struct rtnl_route *rr)
 static void
 route_del (int family, int index, struct rtnl_route *rr)
 {
-    int err;
-
     /* Debug */
     VERBOSE ("RIB: DEL static route\n");
     if (kermond_verbose)
         nl_object_dump ((struct nl_object *) rr, &netlink_dp);
 
-    /* Delete the route */
-    if ((err = rtnl_route_delete (sock, rr, 0)) < 0)
-    {
-        ERROR ("RIB: Unable to delete route: %s\n", nl_geterror (err));
-    }
+    /* Delete the route, then its nexthop if nothing else uses it */
+    if (route_request_send (family, index, rr, false, 0, NULL))
+        nexthop_unref (rr);
 
     /* Remove from the lookup by index */
     if (index != 0)
@@ -308,96 +687,349 @@ route_del (int family, int index, struct rtnl_route *rr)
     return;
 }
 
+/* Take over the route a previous run left in the kernel for this key
+ * if it already forwards the same way, otherwise add or replace it */
 static bool
-watch_static_routes (const char *path, const char *value)
+route_adopt (int family, int index, struct rtnl_route *rr)
 {
-    struct rtnl_route *rr = NULL;
-    bool changed = false;
-    char parameter[64];
-    int family;
-    int index;
+    GHashTable *routes = family == 4 ? v4_static_routes : v6_static_routes;
+    char *key = kernel_routes ? route_key (rr) : NULL;
+    kernel_route *kr = key ? g_hash_table_lookup (kernel_routes, key) : NULL;
+    char *want = NULL, *have = NULL, *shared = NULL;
+    rib_nexthop *nh = NULL;
+    bool same;
+    bool ok = true;
 
-    DEBUG ("RIB: %s = %s\n", path, value);
+    if (!kr)
+    {
+        free (key);
+        return route_add (family, index, rr, NLM_F_EXCL, NULL);
+    }
 
-    /* Parse family, index and the parameter that has changed */
-    if (sscanf (path, ROUTING_PATH "/ipv%d/rib/%d/%64s", &family, &index, parameter) != 3)
+    /* The kernel expands nexthop objects in dumps so compare the gateway
+     * either way, but only keep a route on the nexthop object we would use */
+    want = route_gateway_key (rr);
+    have = route_gateway_key (kr->route);
+    shared = nexthop_key (rr);
+    if (shared)
+        nh = g_hash_table_lookup (nexthops, shared);
+    same = want && have && strcmp (want, have) == 0 &&
+        rtnl_route_get_nnexthops (kr->route) == 1 &&
+        (shared ? (kr->nhid != 0 && (!nh || nh->id == kr->nhid)) : kr->nhid == 0);
+    if (same)
     {
-        ERROR ("RIB: Invalid static route path (%s)\n", path);
-        return false;
+        VERBOSE ("RIB: KEEP static route %d\n", index);
+        if (shared && !nh)
+        {
+            nh = calloc (1, sizeof (rib_nexthop));
+            nh->id = kr->nhid;
+            g_hash_table_insert (nexthops, shared, nh);
+            shared = NULL;
+        }
+        if (nh)
+            nh->refcount++;
+        g_hash_table_replace (routes, GINT_TO_POINTER (index), rr);
     }
+    else
+        ok = route_add (family, index, rr, NLM_F_REPLACE, NULL);
+    g_hash_table_remove (kernel_routes, key);
+    free (key);
+    free (want);
+    free (have);
+    free (shared);
+    return ok;
+}
 
-    DEBUG ("RIB: family:%d index:%d parameter:%s\n", family, index, parameter);
+/* Remove whatever the first flush after a graceful restart did not claim.
+ * Only routes on one of our nexthop objects are known to be ours, other
+ * static routes may have been added by hand and are left alone */
+static void
+kernel_routes_sweep (void)
+{
+    GHashTableIter iter;
+    kernel_route *kr;
+    gpointer id;
+    GHashTable *used;
+    rib_nexthop *nh;
 
-    /* Find an existing route based on this ID */
-    if (family == 4)
-        rr = (struct rtnl_route *) g_hash_table_lookup (v4_static_routes,
-                                                        GINT_TO_POINTER (index));
-    else
-        rr = (struct rtnl_route *) g_hash_table_lookup (v6_static_routes,
-                                                        GINT_TO_POINTER (index));
+    g_hash_table_iter_init (&iter, kernel_routes);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &kr))
+    {
+        if (!RIB_NEXTHOP_ID_OURS (kr->nhid))
+            continue;
+        VERBOSE ("RIB: DEL stale static route\n");
+        if (kermond_verbose)
+            nl_object_dump ((struct nl_object *) kr->route, &netlink_dp);
+        route_request_queue (rtnl_route_get_family (kr->route) == AF_INET ? 4 : 6, 0,
+                             kr->route, false, 0, kr->nhid, NULL);
+    }
+    g_hash_table_destroy (kernel_routes);
+    kernel_routes = NULL;
 
-    /* Add */
-    if (!rr)
+    used = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_hash_table_iter_init (&iter, nexthops);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &nh))
+        g_hash_table_add (used, GUINT_TO_POINTER (nh->id));
+    g_hash_table_iter_init (&iter, stale_nexthops);
+    while (g_hash_table_iter_next (&iter, &id, NULL))
     {
-        /* Create route from Apteryx */
-        rr = apteryx_to_route (family, index);
-        if (!rr || !route_valid (rr))
+        if (!g_hash_table_contains (used, id))
+        {
+            nexthop_send (RTM_DELNEXTHOP, 0, GPOINTER_TO_UINT (id), NULL);
+            nexthop_free_id (GPOINTER_TO_UINT (id));
+        }
+    }
+    g_hash_table_destroy (used);
+    g_hash_table_destroy (stale_nexthops);
+    stale_nexthops = NULL;
+}
+
+/* Bring the kernel in line with the configuration for one index */
+static void
+route_update (int family, int index)
+{
+    GHashTable *routes = family == 4 ? v4_static_routes : v6_static_routes;
+    GHashTable *config = family == 4 ? v4_config : v6_config;
+    GHashTable *params = g_hash_table_lookup (config, GINT_TO_POINTER (index));
+    struct rtnl_route *old = g_hash_table_lookup (routes, GINT_TO_POINTER (index));
+    struct rtnl_route *rr = NULL;
+
+    if (params)
+    {
+        rr = config_to_route (family, index, params);
+        if (!rr)
+        {
+            /* Leave the kernel alone until the configuration is fixed */
+            ERROR ("RIB: Invalid route configuration for %d\n", index);
+            return;
+        }
+        if (!route_valid (rr))
         {
             /* Probably not enough info yet */
-            if (rr)
-                rtnl_route_put (rr);
             VERBOSE ("RIB: Route configuration currently not valid\n");
-            goto done;
+            rtnl_route_put (rr);
+            rr = NULL;
         }
+    }
 
-        /* Add the route */
-        if (!route_add (family, index, rr))
+    /* Delete */
+    if (!rr)
+    {
+        if (old)
+        {
+            route_del (family, index, old);
+            rtnl_route_put (old);
+        }
+    }
+    /* Add */
+    else if (!old)
+    {
+        if (!route_adopt (family, index, rr))
         {
             rtnl_route_put (rr);
             ERROR ("RIB: Failed to add new route\n");
         }
     }
-    /* Delete */
-    else if (!value &&
-             (strcmp (parameter, ROUTING_IPV4_RIB_ID) == 0 ||
-              strcmp (parameter, ROUTING_IPV4_RIB_PREFIX) == 0))
+    /* Unchanged */
+    else if (nl_object_diff ((struct nl_object *) old, (struct nl_object *) rr) == 0)
     {
-        route_del (family, index, rr);
+        VERBOSE ("RIB: No change to route configuration\n");
         rtnl_route_put (rr);
     }
-    /* Update */
+    /* Same kernel route so update it in place */
+    else if (route_same_key (old, rr))
+    {
+        if (!route_add (family, index, rr, NLM_F_REPLACE, old))
+            rtnl_route_put (rr);
+    }
+    /* Make before break so traffic is never left without a route,
+     * the old route is only deleted once the new one is in */
     else
     {
-        struct rtnl_route *old;
+        if (!route_add (family, index, rr, NLM_F_EXCL, old))
+            rtnl_route_put (rr);
+    }
+}
+
+/* Routes moving from one shared nexthop to another */
+typedef struct nexthop_move
+{
+    char *to;
+    bool mixed;
+    GList *indexes;
+    GList *routes;
+} nexthop_move;
+
+static void
+nexthop_move_free (nexthop_move *move)
+{
+    free (move->to);
+    g_list_free (move->indexes);
+    g_list_free_full (move->routes, (GDestroyNotify) rtnl_route_put);
+    free (move);
+}
+
+/* When every route using a nexthop moves to the same new gateway,
+ * rewrite the nexthop object instead of each route */
+static void
+nexthop_moves (int family, GHashTable *dirty)
+{
+    GHashTable *routes = family == 4 ? v4_static_routes : v6_static_routes;
+    GHashTable *config = family == 4 ? v4_config : v6_config;
+    GHashTable *moves;
+    GHashTableIter iter;
+    gpointer index, key;
+    nexthop_move *move;
 
-        /* Copy the old route */
-        old = (struct rtnl_route *) nl_object_clone ((struct nl_object *) rr);
+    moves = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+                                   (GDestroyNotify) nexthop_move_free);
+    g_hash_table_iter_init (&iter, dirty);
+    while (g_hash_table_iter_next (&iter, &index, NULL))
+    {
+        struct rtnl_route *old = g_hash_table_lookup (routes, index);
+        GHashTable *params = g_hash_table_lookup (config, index);
+        struct rtnl_route *rr = params ? config_to_route (family, GPOINTER_TO_INT (index), params) : NULL;
+        char *from = old ? nexthop_key (old) : NULL;
+        char *to = rr ? nexthop_key (rr) : NULL;
 
-        /* Parse the Apteryx parameter */
-        if (!parse_parameter (rr, index, parameter, value, &changed))
+        if (!from || !to || strcmp (from, to) == 0 || !route_same_key (old, rr))
         {
-            ERROR ("RIB: Invalid route configuration change\n");
-            rtnl_route_put (old);
-            goto done;
+            if (rr)
+                rtnl_route_put (rr);
+            free (from);
+            free (to);
+            continue;
         }
-
-        /* Check if we need to update the route */
-        if (!changed)
+        move = g_hash_table_lookup (moves, from);
+        if (!move)
         {
-            VERBOSE ("RIB: No change to route configuration\n");
-            rtnl_route_put (old);
-            goto done;
+            move = calloc (1, sizeof (nexthop_move));
+            move->to = to;
+            g_hash_table_insert (moves, from, move);
+        }
+        else
+        {
+            if (strcmp (move->to, to) != 0)
+                move->mixed = true;
+            free (from);
+            free (to);
         }
+        move->indexes = g_list_prepend (move->indexes, index);
+        move->routes = g_list_prepend (move->routes, rr);
+    }
+
+    g_hash_table_iter_init (&iter, moves);
+    while (g_hash_table_iter_next (&iter, &key, (gpointer *) &move))
+    {
+        rib_nexthop *nh = g_hash_table_lookup (nexthops, key);
+        gpointer orig_key;
+        GList *i, *r;
+
+        if (move->mixed || !nh || nh->refcount != g_list_length (move->indexes) ||
+            g_hash_table_contains (nexthops, move->to))
+            continue;
+
+        /* One message moves every route */
+        nexthop_send (RTM_NEWNEXTHOP, NLM_F_REPLACE, nh->id, move->routes->data);
+        g_hash_table_lookup_extended (nexthops, key, &orig_key, NULL);
+        g_hash_table_steal (nexthops, key);
+        free (orig_key);
+        g_hash_table_insert (nexthops, strdup (move->to), nh);
+        VERBOSE ("RIB: Moved nexthop %u for %d routes\n", nh->id, nh->refcount);
 
-        // TODO replace rather than delete/add
-        route_del (family, index, old);
-        if (route_valid (rr))
+        for (i = move->indexes, r = move->routes; i && r; i = i->next, r = r->next)
         {
-            route_add (family, index, rr);
+            rtnl_route_put (g_hash_table_lookup (routes, i->data));
+            g_hash_table_replace (routes, i->data, r->data);
+            r->data = NULL;
+            g_hash_table_remove (dirty, i->data);
         }
+        g_list_free (move->routes);
+        move->routes = NULL;
     }
+    g_hash_table_destroy (moves);
+}
+
+static void
+flush_family (int family, GHashTable *dirty)
+{
+    GHashTableIter iter;
+    gpointer index;
+
+    if (nexthop_objects)
+        nexthop_moves (family, dirty);
+    g_hash_table_iter_init (&iter, dirty);
+    while (g_hash_table_iter_next (&iter, &index, NULL))
+        route_update (family, GPOINTER_TO_INT (index));
+    g_hash_table_remove_all (dirty);
+}
 
-  done:
+/* Program every route changed since the last flush */
+static gboolean
+rib_flush (gpointer data)
+{
+    g_mutex_lock (&rib_lock);
+    flush_source = 0;
+    flush_family (4, v4_dirty);
+    flush_family (6, v6_dirty);
+    if (kernel_routes)
+        kernel_routes_sweep ();
+    g_mutex_unlock (&rib_lock);
+    return G_SOURCE_REMOVE;
+}
+
+static bool
+watch_static_routes (const char *path, const char *value)
+{
+    GHashTable *params;
+    apteryx_match match;
+    int parameter;
+    int family;
+    int index;
+    char *end;
+
+    DEBUG ("RIB: %s = %s\n", path, value);
+
+    /* Parse family, index and the parameter that has changed */
+    if (!apteryx_path_match (iprouting_schema, path, &match) || match.depth != 5 ||
+        (match.ids[2] != ROUTING_IPV4_RIB_NODE && match.ids[2] != ROUTING_IPV6_RIB_NODE))
+    {
+        ERROR ("RIB: Invalid static route path (%s)\n", path);
+        return false;
+    }
+    family = match.ids[2] == ROUTING_IPV4_RIB_NODE ? 4 : 6;
+    index = strtol (match.keys[0], &end, 10);
+    if (*end != '\0')
+    {
+        ERROR ("RIB: Invalid static route path (%s)\n", path);
+        return false;
+    }
+    parameter = match.id;
+
+    DEBUG ("RIB: family:%d index:%d parameter:%s\n", family, index,
+           iprouting_schema[parameter].name);
+
+    /* Record the parameter, the route is programmed once all
+     * the parameters in this change have arrived */
+    g_mutex_lock (&rib_lock);
+    params = g_hash_table_lookup (family == 4 ? v4_config : v6_config, GINT_TO_POINTER (index));
+    if (!params && value)
+    {
+        params = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
+        g_hash_table_insert (family == 4 ? v4_config : v6_config, GINT_TO_POINTER (index), params);
+    }
+    if (value)
+        g_hash_table_replace (params, GINT_TO_POINTER (parameter), strdup (value));
+    else if (params)
+    {
+        g_hash_table_remove (params, GINT_TO_POINTER (parameter));
+        if (g_hash_table_size (params) == 0)
+            g_hash_table_remove (family == 4 ? v4_config : v6_config, GINT_TO_POINTER (index));
+    }
+    g_hash_table_add (family == 4 ? v4_dirty : v6_dirty, GINT_TO_POINTER (index));
+    if (!flush_source)
+        flush_source = g_timeout_add (RIB_DEBOUNCE_MS, rib_flush, NULL);
+    g_mutex_unlock (&rib_lock);
     return true;
 }
 
@@ -407,27 +1039,45 @@ exit_cb (gpointer key, gpointer value, gpointer user_data)
     route_del (GPOINTER_TO_INT (user_data), 0, (struct rtnl_route *) value);
 }
 
+static void
+free_cb (gpointer key, gpointer value, gpointer user_data)
+{
+    rtnl_route_put ((struct rtnl_route *) value);
+}
+
 static bool
 rib_init (void)
 {
-    int err;
-
     DEBUG ("RIB: Initialising\n");
 
     /* Local lookup cache */
     v4_static_routes = g_hash_table_new (g_direct_hash, g_direct_equal);
     v6_static_routes = g_hash_table_new (g_direct_hash, g_direct_equal);
+    v4_config = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                       (GDestroyNotify) g_hash_table_destroy);
+    v6_config = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                       (GDestroyNotify) g_hash_table_destroy);
+    v4_dirty = g_hash_table_new (g_direct_hash, g_direct_equal);
+    v6_dirty = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-    /* Setup Netlink socket for changing the kernel route database */
-    sock = nl_socket_alloc ();
-    if ((err = nl_connect (sock, NETLINK_ROUTE)) < 0)
+    /* Share nexthops between routes where the kernel supports it */
+    nexthops = g_hash_table_new_full (g_str_hash, g_str_equal, free, free);
+    if (kermond_graceful)
+        stale_nexthops = g_hash_table_new (g_direct_hash, g_direct_equal);
+    nexthop_objects = nexthop_supported ();
+    DEBUG ("RIB: Nexthop objects %ssupported\n", nexthop_objects ? "" : "not ");
+
+    /* Pick up where a previous run left the kernel */
+    if (kermond_graceful)
     {
-        FATAL ("RIB: Unable to connect socket: %s\n", nl_geterror (err));
-        return false;
-    }
+        struct rtmsg hdr = { };
 
-    /* Get a handle to the link cache for interface to ifindex conversion */
-    link_cache = nl_cache_mngt_require_safe ("route/link");
+        kernel_routes = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+                                               (GDestroyNotify) kernel_route_free);
+        if (!kernel_dump (RTM_GETROUTE, &hdr, sizeof (hdr), kernel_route_cb))
+            ERROR ("RIB: Unable to dump kernel routes\n");
+        DEBUG ("RIB: Found %d static routes in the kernel\n", g_hash_table_size (kernel_routes));
+    }
 
     return true;
 }
@@ -441,7 +1091,13 @@ rib_start ()
 
     /* Load existing configuration */
     apteryx_rewatch_tree (ROUTING_IPV4_RIB_PATH, watch_static_routes);
-    apteryx_rewatch_tree (ROUTING_IPV4_RIB_PATH, watch_static_routes);
+    apteryx_rewatch_tree (ROUTING_IPV6_RIB_PATH, watch_static_routes);
+
+    /* Even with no configuration, clear out routes from the previous run */
+    g_mutex_lock (&rib_lock);
+    if (kernel_routes && !flush_source)
+        flush_source = g_timeout_add (RIB_DEBOUNCE_MS, rib_flush, NULL);
+    g_mutex_unlock (&rib_lock);
 
     return true;
 }
@@ -455,19 +1111,42 @@ rib_exit ()
     apteryx_unwatch (ROUTING_IPV4_RIB_PATH "/*", watch_static_routes);
     apteryx_unwatch (ROUTING_IPV6_RIB_PATH "/*", watch_static_routes);
 
-    /* Delete any routes we added */
-    g_hash_table_foreach (v4_static_routes, exit_cb, GINT_TO_POINTER (4));
+    /* Delete any routes we added, unless the next run will take them over */
+    g_mutex_lock (&rib_lock);
+    if (flush_source)
+        g_source_remove (flush_source);
+    flush_source = 0;
+    if (!kermond_graceful)
+    {
+        g_hash_table_foreach (v4_static_routes, exit_cb, GINT_TO_POINTER (4));
+        g_hash_table_foreach (v6_static_routes, exit_cb, GINT_TO_POINTER (6));
+    }
+    g_mutex_unlock (&rib_lock);
+
+    /* Wait for the kernel before dropping our references */
+    netlink_request_wait ();
+    g_mutex_lock (&rib_lock);
+    g_hash_table_foreach (v4_static_routes, free_cb, NULL);
     g_hash_table_destroy (v4_static_routes);
-    g_hash_table_foreach (v6_static_routes, exit_cb, GINT_TO_POINTER (6));
+    v4_static_routes = NULL;
+    g_hash_table_foreach (v6_static_routes, free_cb, NULL);
     g_hash_table_destroy (v6_static_routes);
-
-    /* Remove Netlink socket */
-    if (sock)
-        nl_close (sock);
-
-    /* Detach from the link cache */
-    if (link_cache)
-        nl_cache_put (link_cache);
+    v6_static_routes = NULL;
+    g_hash_table_destroy (v4_config);
+    g_hash_table_destroy (v6_config);
+    g_hash_table_destroy (v4_dirty);
+    g_hash_table_destroy (v6_dirty);
+    v4_config = v6_config = v4_dirty = v6_dirty = NULL;
+    g_hash_table_destroy (nexthops);
+    nexthops = NULL;
+    g_queue_clear (&nexthop_free_ids);
+    nexthop_next_id = RIB_NEXTHOP_ID_BASE;
+    if (kernel_routes)
+        g_hash_table_destroy (kernel_routes);
+    if (stale_nexthops)
+        g_hash_table_destroy (stale_nexthops);
+    kernel_routes = stale_nexthops = NULL;
+    g_mutex_unlock (&rib_lock);
 }
 
 MODULE_CREATE ("rib", rib_init, rib_start, rib_exit);
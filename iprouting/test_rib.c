@@ -0,0 +1,430 @@
+/**
+ * @file test_rib.c
+ * Unit tests for static routes
+ *
+ * Copyright 2017, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "rib.c"
+#include "test.h"
+#include <errno.h>
+
+#define PREFIX1 "10.1.0.0/16"
+#define GATEWAY1 "192.168.1.254"
+#define GATEWAY2 "192.168.1.253"
+
+/* rib_init without probing the kernel */
+static void
+setup_test (bool objects)
+{
+    v4_static_routes = g_hash_table_new (g_direct_hash, g_direct_equal);
+    v6_static_routes = g_hash_table_new (g_direct_hash, g_direct_equal);
+    v4_config = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                       (GDestroyNotify) g_hash_table_destroy);
+    v6_config = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                       (GDestroyNotify) g_hash_table_destroy);
+    v4_dirty = g_hash_table_new (g_direct_hash, g_direct_equal);
+    v6_dirty = g_hash_table_new (g_direct_hash, g_direct_equal);
+    nexthops = g_hash_table_new_full (g_str_hash, g_str_equal, free, free);
+    nexthop_objects = objects;
+    link_active = true;
+    netlink_requests = g_string_new (NULL);
+}
+
+/* Configure an IPv4 route as the watch would, ready for the next flush */
+static void
+route_config (int index, const char *prefix, const char *gateway, const char *ifname,
+              const char *metric)
+{
+    GHashTable *params = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
+
+    if (prefix)
+        g_hash_table_insert (params, GINT_TO_POINTER (ROUTING_IPV4_RIB_PREFIX_NODE), strdup (prefix));
+    if (gateway)
+        g_hash_table_insert (params, GINT_TO_POINTER (ROUTING_IPV4_RIB_NEXTHOP_NODE), strdup (gateway));
+    if (ifname)
+        g_hash_table_insert (params, GINT_TO_POINTER (ROUTING_IPV4_RIB_IFNAME_NODE), strdup (ifname));
+    if (metric)
+        g_hash_table_insert (params, GINT_TO_POINTER (ROUTING_IPV4_RIB_METRIC_NODE), strdup (metric));
+    g_hash_table_replace (v4_config, GINT_TO_POINTER (index), params);
+    g_hash_table_add (v4_dirty, GINT_TO_POINTER (index));
+}
+
+static void
+route_unconfig (int index)
+{
+    g_hash_table_remove (v4_config, GINT_TO_POINTER (index));
+    g_hash_table_add (v4_dirty, GINT_TO_POINTER (index));
+}
+
+/* Flush, answer every request with err and return the requests sent to the kernel */
+static const char *
+flush_result (int err)
+{
+    g_string_truncate (netlink_requests, 0);
+    rib_flush (NULL);
+    netlink_request_complete (err);
+    return netlink_requests->str;
+}
+
+static const char *
+flush (void)
+{
+    return flush_result (0);
+}
+
+static struct rtnl_route *
+route_get (int index)
+{
+    return g_hash_table_lookup (v4_static_routes, GINT_TO_POINTER (index));
+}
+
+void test_rib_route_add ()
+{
+    NP_TEST_START
+    setup_test (false);
+    route_config (1, PREFIX1, GATEWAY1, NULL, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "NEWROUTE excl;");
+    NP_ASSERT_NOT_NULL (route_get (1));
+    NP_ASSERT_EQUAL (g_hash_table_size (v4_dirty), 0);
+    NP_TEST_END ("");
+}
+
+void test_rib_route_incomplete ()
+{
+    NP_TEST_START
+    setup_test (false);
+    route_config (1, NULL, GATEWAY1, NULL, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "");
+    NP_ASSERT_NULL (route_get (1));
+    NP_TEST_END ("");
+}
+
+void test_rib_route_unchanged ()
+{
+    NP_TEST_START
+    setup_test (false);
+    route_config (1, PREFIX1, GATEWAY1, NULL, NULL);
+    flush ();
+    struct rtnl_route *old = route_get (1);
+    route_config (1, PREFIX1, GATEWAY1, NULL, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "");
+    NP_ASSERT_TRUE (route_get (1) == old);
+    NP_TEST_END ("");
+}
+
+void test_rib_route_replace ()
+{
+    NP_TEST_START
+    setup_test (false);
+    route_config (1, PREFIX1, GATEWAY1, NULL, NULL);
+    flush ();
+    struct rtnl_route *old = route_get (1);
+    /* Same prefix and priority so the kernel route is rewritten in place */
+    route_config (1, PREFIX1, GATEWAY2, NULL, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "NEWROUTE replace;");
+    NP_ASSERT_NOT_NULL (route_get (1));
+    NP_ASSERT_FALSE (route_get (1) == old);
+    NP_TEST_END ("");
+}
+
+void test_rib_route_replace_failed ()
+{
+    NP_TEST_START
+    setup_test (false);
+    route_config (1, PREFIX1, GATEWAY1, NULL, NULL);
+    flush ();
+    struct rtnl_route *old = route_get (1);
+    route_config (1, PREFIX1, GATEWAY2, NULL, NULL);
+    NP_ASSERT_STR_EQUAL (flush_result (-ENETUNREACH), "NEWROUTE replace;");
+    /* The kernel still has the old route, so it is still ours to delete */
+    NP_ASSERT_TRUE (route_get (1) == old);
+    route_unconfig (1);
+    NP_ASSERT_STR_EQUAL (flush (), "DELROUTE;");
+    NP_ASSERT_NULL (route_get (1));
+    NP_TEST_END ("RIB: Unable to add route 1: Network is unreachable\n");
+}
+
+void test_rib_route_make_before_break ()
+{
+    NP_TEST_START
+    setup_test (false);
+    route_config (1, PREFIX1, GATEWAY1, NULL, NULL);
+    flush ();
+    /* A new metric is a different kernel route, add it before deleting the old one */
+    route_config (1, PREFIX1, GATEWAY1, NULL, "10");
+    NP_ASSERT_STR_EQUAL (flush (), "NEWROUTE excl;DELROUTE;");
+    NP_ASSERT_NOT_NULL (route_get (1));
+    NP_ASSERT_EQUAL (rtnl_route_get_priority (route_get (1)), 10);
+    NP_TEST_END ("");
+}
+
+void test_rib_route_make_before_break_failed ()
+{
+    NP_TEST_START
+    setup_test (false);
+    route_config (1, PREFIX1, GATEWAY1, NULL, NULL);
+    flush ();
+    struct rtnl_route *old = route_get (1);
+    /* The old route is only deleted once the new one is in */
+    route_config (1, PREFIX1, GATEWAY1, NULL, "10");
+    NP_ASSERT_STR_EQUAL (flush_result (-EEXIST), "NEWROUTE excl;");
+    NP_ASSERT_TRUE (route_get (1) == old);
+    NP_ASSERT_STR_EQUAL (flush (), "");
+    NP_TEST_END ("RIB: Unable to add route 1: File exists\n");
+}
+
+void test_rib_route_delete ()
+{
+    NP_TEST_START
+    setup_test (false);
+    route_config (1, PREFIX1, GATEWAY1, NULL, NULL);
+    flush ();
+    route_unconfig (1);
+    NP_ASSERT_STR_EQUAL (flush (), "DELROUTE;");
+    NP_ASSERT_NULL (route_get (1));
+    NP_ASSERT_STR_EQUAL (flush (), "");
+    NP_TEST_END ("");
+}
+
+/* A static route left in the kernel by a previous run */
+static void
+kernel_route_add (int index, const char *prefix, uint32_t nhid)
+{
+    kernel_route *kr = calloc (1, sizeof (kernel_route));
+
+    route_config (index, prefix, GATEWAY1, IFNAME, NULL);
+    kr->route = config_to_route (4, index, g_hash_table_lookup (v4_config, GINT_TO_POINTER (index)));
+    kr->nhid = nhid;
+    g_hash_table_replace (kernel_routes, route_key (kr->route), kr);
+    route_unconfig (index);
+}
+
+void test_rib_sweep_ours_only ()
+{
+    NP_TEST_START
+    setup_test (true);
+    kernel_routes = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+                                           (GDestroyNotify) kernel_route_free);
+    stale_nexthops = g_hash_table_new (g_direct_hash, g_direct_equal);
+    kernel_route_add (1, "10.1.0.0/16", RIB_NEXTHOP_ID_BASE);
+    /* An inline nexthop may have been added by hand, so it is left alone */
+    kernel_route_add (2, "10.2.0.0/16", 0);
+    kernel_route_add (3, "10.3.0.0/16", RIB_NEXTHOP_ID_BASE - 1);
+    NP_ASSERT_STR_EQUAL (flush (), "DELROUTE;");
+    NP_ASSERT_NULL (kernel_routes);
+    NP_TEST_END ("");
+}
+
+static rib_nexthop *
+nexthop_get (int index)
+{
+    char *key = nexthop_key (route_get (index));
+    rib_nexthop *nh = key ? g_hash_table_lookup (nexthops, key) : NULL;
+
+    free (key);
+    return nh;
+}
+
+void test_rib_nexthop_shared ()
+{
+    NP_TEST_START
+    setup_test (true);
+    route_config (1, "10.1.0.0/16", GATEWAY1, IFNAME, NULL);
+    route_config (2, "10.2.0.0/16", GATEWAY1, IFNAME, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "NEWNEXTHOP replace;NEWROUTE excl;NEWROUTE excl;");
+    NP_ASSERT_EQUAL (g_hash_table_size (nexthops), 1);
+    NP_ASSERT_NOT_NULL (nexthop_get (1));
+    NP_ASSERT_TRUE (nexthop_get (1) == nexthop_get (2));
+    NP_ASSERT_EQUAL (nexthop_get (1)->refcount, 2);
+    NP_TEST_END ("");
+}
+
+void test_rib_nexthop_inline ()
+{
+    NP_TEST_START
+    setup_test (true);
+    /* The kernel needs an interface for a nexthop object */
+    route_config (1, PREFIX1, GATEWAY1, NULL, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "NEWROUTE excl;");
+    NP_ASSERT_EQUAL (g_hash_table_size (nexthops), 0);
+    NP_TEST_END ("");
+}
+
+void test_rib_nexthop_unref ()
+{
+    NP_TEST_START
+    setup_test (true);
+    route_config (1, "10.1.0.0/16", GATEWAY1, IFNAME, NULL);
+    route_config (2, "10.2.0.0/16", GATEWAY1, IFNAME, NULL);
+    flush ();
+    route_unconfig (1);
+    NP_ASSERT_STR_EQUAL (flush (), "DELROUTE;");
+    NP_ASSERT_EQUAL (nexthop_get (2)->refcount, 1);
+    route_unconfig (2);
+    NP_ASSERT_STR_EQUAL (flush (), "DELROUTE;DELNEXTHOP;");
+    NP_ASSERT_EQUAL (g_hash_table_size (nexthops), 0);
+    NP_TEST_END ("");
+}
+
+void test_rib_nexthop_id_reuse ()
+{
+    NP_TEST_START
+    setup_test (true);
+    route_config (1, "10.1.0.0/16", GATEWAY1, IFNAME, NULL);
+    flush ();
+    uint32_t id = nexthop_get (1)->id;
+    route_unconfig (1);
+    flush ();
+    /* The deleted nexthop's ID is used before a new one */
+    route_config (2, "10.2.0.0/16", GATEWAY2, IFNAME, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "NEWNEXTHOP replace;NEWROUTE excl;");
+    NP_ASSERT_EQUAL (nexthop_get (2)->id, id);
+    NP_TEST_END ("");
+}
+
+void test_rib_nexthop_id_exhausted ()
+{
+    NP_TEST_START
+    setup_test (true);
+    nexthop_next_id = RIB_NEXTHOP_ID_MAX;
+    route_config (1, "10.1.0.0/16", GATEWAY1, IFNAME, NULL);
+    flush ();
+    NP_ASSERT_EQUAL (nexthop_get (1)->id, RIB_NEXTHOP_ID_MAX);
+    /* Never an ID outside our range, the route carries its own nexthop */
+    route_config (2, "10.2.0.0/16", GATEWAY2, IFNAME, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "NEWROUTE excl;");
+    NP_ASSERT_NULL (nexthop_get (2));
+    NP_TEST_END ("RIB: No nexthop IDs left, using an inline nexthop\n");
+}
+
+void test_rib_nexthop_move ()
+{
+    NP_TEST_START
+    setup_test (true);
+    route_config (1, "10.1.0.0/16", GATEWAY1, IFNAME, NULL);
+    route_config (2, "10.2.0.0/16", GATEWAY1, IFNAME, NULL);
+    flush ();
+    uint32_t id = nexthop_get (1)->id;
+    /* Every user moves to the same gateway so only the nexthop changes */
+    route_config (1, "10.1.0.0/16", GATEWAY2, IFNAME, NULL);
+    route_config (2, "10.2.0.0/16", GATEWAY2, IFNAME, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "NEWNEXTHOP replace;");
+    NP_ASSERT_EQUAL (g_hash_table_size (nexthops), 1);
+    NP_ASSERT_NOT_NULL (nexthop_get (1));
+    NP_ASSERT_TRUE (nexthop_get (1) == nexthop_get (2));
+    NP_ASSERT_EQUAL (nexthop_get (1)->id, id);
+    NP_ASSERT_EQUAL (nexthop_get (1)->refcount, 2);
+    NP_ASSERT_EQUAL (g_hash_table_size (v4_dirty), 0);
+    NP_TEST_END ("");
+}
+
+void test_rib_nexthop_move_partial ()
+{
+    NP_TEST_START
+    setup_test (true);
+    route_config (1, "10.1.0.0/16", GATEWAY1, IFNAME, NULL);
+    route_config (2, "10.2.0.0/16", GATEWAY1, IFNAME, NULL);
+    flush ();
+    uint32_t id = nexthop_get (2)->id;
+    /* Route 2 still uses the old nexthop so route 1 gets a new one */
+    route_config (1, "10.1.0.0/16", GATEWAY2, IFNAME, NULL);
+    NP_ASSERT_STR_EQUAL (flush (), "NEWNEXTHOP replace;NEWROUTE replace;");
+    NP_ASSERT_EQUAL (g_hash_table_size (nexthops), 2);
+    NP_ASSERT_EQUAL (nexthop_get (1)->refcount, 1);
+    NP_ASSERT_EQUAL (nexthop_get (2)->refcount, 1);
+    NP_ASSERT_EQUAL (nexthop_get (2)->id, id);
+    NP_ASSERT_FALSE (nexthop_get (1)->id == id);
+    NP_TEST_END ("");
+}
+
+void test_path_match_leaf ()
+{
+    NP_TEST_START
+    apteryx_match match;
+    NP_ASSERT_TRUE (apteryx_path_match (iprouting_schema,
+                                        ROUTING_IPV6_RIB_PATH "/7/" ROUTING_IPV6_RIB_PREFIX, &match));
+    NP_ASSERT_EQUAL (match.depth, 5);
+    NP_ASSERT_EQUAL (match.id, ROUTING_IPV6_RIB_PREFIX_NODE);
+    NP_ASSERT_EQUAL (match.ids[0], ROUTING_NODE);
+    NP_ASSERT_EQUAL (match.ids[1], ROUTING_IPV6_NODE);
+    NP_ASSERT_EQUAL (match.ids[2], ROUTING_IPV6_RIB_NODE);
+    NP_ASSERT_EQUAL (match.ids[4], ROUTING_IPV6_RIB_PREFIX_NODE);
+    NP_ASSERT_EQUAL (match.nkeys, 1);
+    NP_ASSERT_STR_EQUAL (match.keys[0], "7");
+    NP_TEST_END ("");
+}
+
+void test_path_match_container ()
+{
+    NP_TEST_START
+    apteryx_match match;
+    NP_ASSERT_TRUE (apteryx_path_match (iprouting_schema, ROUTING_IPV4_PATH, &match));
+    NP_ASSERT_EQUAL (match.depth, 2);
+    NP_ASSERT_EQUAL (match.id, ROUTING_IPV4_NODE);
+    NP_ASSERT_EQUAL (match.nkeys, 0);
+    /* A list entry matches up to its key */
+    NP_ASSERT_TRUE (apteryx_path_match (iprouting_schema, ROUTING_IPV4_RIB_PATH "/3", &match));
+    NP_ASSERT_EQUAL (match.depth, 4);
+    NP_ASSERT_EQUAL (match.id, ROUTING_IPV4_RIB_NODE);
+    NP_ASSERT_EQUAL (match.nkeys, 1);
+    NP_ASSERT_STR_EQUAL (match.keys[0], "3");
+    NP_TEST_END ("");
+}
+
+void test_path_match_leaf_list ()
+{
+    NP_TEST_START
+    apteryx_match match;
+    NP_ASSERT_TRUE (apteryx_path_match (iprouting_schema, ROUTING_IPV4_FIB "/10.0.0.0_8", &match));
+    NP_ASSERT_EQUAL (match.depth, 4);
+    NP_ASSERT_EQUAL (match.id, ROUTING_IPV4_FIB_NODE);
+    NP_ASSERT_EQUAL (match.nkeys, 1);
+    NP_ASSERT_STR_EQUAL (match.keys[0], "10.0.0.0_8");
+    NP_TEST_END ("");
+}
+
+void test_path_match_unknown ()
+{
+    NP_TEST_START
+    apteryx_match match;
+    /* depth is how far the path did match */
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, ROUTING_IPV4_RIB_PATH "/7/bogus", &match));
+    NP_ASSERT_EQUAL (match.depth, 4);
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, ROUTING_PATH "/ipv5", &match));
+    NP_ASSERT_EQUAL (match.depth, 1);
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, "/interfaces", &match));
+    NP_ASSERT_EQUAL (match.depth, 0);
+    /* Names only match whole components */
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, ROUTING_IPV4_RIB_PATH "/7/prefi", &match));
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, ROUTING_IPV4_RIB_PATH "/7/prefixes", &match));
+    NP_TEST_END ("");
+}
+
+void test_path_match_invalid ()
+{
+    NP_TEST_START
+    apteryx_match match;
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, NULL, &match));
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, "", &match));
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, "/", &match));
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, "routing/ipv4", &match));
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, ROUTING_PATH "//ipv4", &match));
+    /* Keys must fit in the match */
+    char *path = g_strdup_printf (ROUTING_IPV4_RIB_PATH "/%0100d/" ROUTING_IPV4_RIB_PREFIX, 1);
+    NP_ASSERT_FALSE (apteryx_path_match (iprouting_schema, path, &match));
+    free (path);
+    NP_TEST_END ("");
+}
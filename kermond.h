@@ -38,6 +38,10 @@ extern GMainLoop *g_loop;
 /* Debug */
 extern bool kermond_debug;
 extern bool kermond_verbose;
+
+/* Options */
+extern bool kermond_fib_mirror;
+extern bool kermond_graceful;
 #define VERBOSE(fmt, args...) if (kermond_verbose) printf (fmt, ## args)
 #define DEBUG(fmt, args...) if (kermond_debug) printf (fmt, ## args)
 #define INFO(fmt, args...) { if (kermond_debug) printf (fmt, ## args); else syslog (LOG_INFO, fmt, ## args); }
@@ -80,6 +84,52 @@ void modules_exit (void);
 /* Apteryx helpers */
 void apteryx_rewatch_tree (char *path, apteryx_watch_callback cb);
 bool apteryx_parse_boolean (const char *path, const char *value, bool defvalue);
+typedef struct apteryx_schema
+{
+    const char *name;   /* path component, "*" for list keys and leaf-list values */
+    int child;          /* first child, 0 if none */
+    int sibling;        /* next sibling, 0 if none */
+} apteryx_schema;
+#define APTERYX_MATCH_DEPTH 16
+#define APTERYX_MATCH_KEYS 4
+typedef struct apteryx_match
+{
+    int id;                             /* last node in the path that is not a key */
+    int depth;                          /* number of path components */
+    int ids[APTERYX_MATCH_DEPTH];       /* node for each path component */
+    int nkeys;                          /* number of keys */
+    char keys[APTERYX_MATCH_KEYS][64];  /* list keys and leaf-list values in order */
+} apteryx_match;
+bool apteryx_path_match (const apteryx_schema *schema, const char *path, apteryx_match *match);
+typedef struct apteryx_enum
+{
+    const char *name;
+    int value;
+} apteryx_enum;
+typedef struct apteryx_enum_table
+{
+    int size;                       /* hash slots */
+    uint32_t seed;                  /* FNV-1a seed that gives no collisions */
+    bool nocase;                    /* names match regardless of case */
+    const apteryx_enum *slots;      /* names by hash, NULL name if empty */
+    int count;                      /* number of values */
+    const apteryx_enum *values;     /* sorted by value */
+} apteryx_enum_table;
+bool apteryx_enum_lookup (const apteryx_enum_table *table, const char *name, int *value);
+const char *apteryx_enum_name (const apteryx_enum_table *table, int value);
+int apteryx_parse_enum (const char *path, const char *value,
+                        const apteryx_enum_table *table, int defvalue);
+void apteryx_batch_enable (bool enable);
+void apteryx_batch_bulk (bool bulk);
+void apteryx_batch_flush (void);
+bool apteryx_batch_set_tree (GNode *tree);
+bool apteryx_batch_set (const char *path, const char *value);
+bool apteryx_batch_prune (const char *path);
+void apteryx_reconcile_begin (const char *path);
+void apteryx_reconcile_end (void);
+bool apteryx_tree_changed (GHashTable *published, GNode *tree);
+bool apteryx_counter_register (const char *path, uint64_t *counter);
+void apteryx_counter_unregister (const char *path);
 
 /* Netlink functions */
 #if LIBNL_VER_NUM < LIBNL_VER(3,2) || (LIBNL_VER_NUM == LIBNL_VER(3,2) && LIBNL_VER_MIC < 27)
@@ -97,14 +147,67 @@ enum
 extern struct nl_dump_params netlink_dp;
 typedef void (*netlink_callback) (int action, struct nl_object * old_obj,
                                   struct nl_object * new_obj);
-bool netlink_init ();
+#define NETLINK_RX_BUFFER (4 * 1024 * 1024)
+bool netlink_init (int rx_buffer);
 void netlink_exit ();
+#define NETLINK_FILTER_ROUTE_LOCAL  (1 << 0)  /* Routes in the local table */
+#define NETLINK_FILTER_ROUTE_CLONED (1 << 1)  /* Cloned (cache) routes */
+#define NETLINK_FILTER_ROUTE_NON_IP (1 << 2)  /* Routes that are not IPv4 or IPv6 */
 bool netlink_register (char *kind, netlink_callback cb);
+bool netlink_register_filtered (char *kind, netlink_callback cb, unsigned int filter);
 void netlink_unregister (char *kind, netlink_callback cb);
+typedef void (*netlink_result_cb) (int err, void *data);
+bool netlink_request (struct nl_msg *msg, netlink_result_cb cb, void *data);
+void netlink_request_wait (void);
+
+/* nftables functions */
+typedef struct nft_batch nft_batch;
+nft_batch *nft_batch_new (void);
+void nft_batch_free (nft_batch *b);
+bool nft_batch_commit (nft_batch *b);
+void nft_batch_add_table (nft_batch *b, int family, const char *table);
+void nft_batch_del_table (nft_batch *b, int family, const char *table);
+void nft_batch_add_chain (nft_batch *b, int family, const char *table,
+                          const char *chain, int hook, int priority);
+void nft_batch_flush_chain (nft_batch *b, int family, const char *table, const char *chain);
+void nft_batch_add_set (nft_batch *b, int family, const char *table, const char *set,
+                        uint32_t key_type, int key_len, bool interval);
+void nft_batch_del_set (nft_batch *b, int family, const char *table, const char *set);
+void nft_batch_flush_set (nft_batch *b, int family, const char *table, const char *set);
+void nft_batch_set_prefix (nft_batch *b, int family, const char *table, const char *set,
+                           const uint8_t *addr, int len, int plen, bool add);
+void nft_batch_rule_begin (nft_batch *b, int family, const char *table, const char *chain);
+void nft_batch_rule_end (nft_batch *b);
+void nft_rule_meta (nft_batch *b, int key);
+void nft_rule_payload (nft_batch *b, int base, int offset, int len);
+void nft_rule_cmp (nft_batch *b, const void *value, int len);
+void nft_rule_verdict (nft_batch *b, int verdict);
+void nft_exit (void);
+
+/* Longest prefix match */
+#define LPM_KEY_MAX 16
+typedef struct lpm_trie lpm_trie;
+lpm_trie *lpm_new (int bits);
+void lpm_free (lpm_trie *trie, GDestroyNotify destroy);
+int lpm_count (lpm_trie *trie);
+void *lpm_insert (lpm_trie *trie, const uint8_t *key, int plen, void *value);
+void *lpm_get (lpm_trie *trie, const uint8_t *key, int plen);
+void *lpm_remove (lpm_trie *trie, const uint8_t *key, int plen);
+void *lpm_lookup (lpm_trie *trie, const uint8_t *key, int *plen);
+
+/* Interface table */
+bool iftable_init (void);
+void iftable_exit (void);
+char *iftable_i2name (int ifindex, char *ifname);
+int iftable_name2i (const char *ifname);
 
 /* ProcFS functions */
 uint32_t procfs_read_uint32 (const char *path);
 char* procfs_read_string (const char *path);
 void procfs_write_uint32 (const char *path, uint32_t value);
+void sysctl_set (const char *key, int value);
+void sysctl_flush (void);
+void sysctl_init (void);
+void sysctl_exit (void);
 
 #endif /* _KERMOND_H_ */
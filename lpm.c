@@ -0,0 +1,276 @@
+/**
+ * @file lpm.c
+ * Path compressed binary trie for longest prefix match lookups
+ *
+ * Copyright 2017, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "kermond.h"
+
+/* Each node holds a prefix. Nodes without a value only exist
+ * to branch where two prefixes diverge. */
+typedef struct lpm_node
+{
+    struct lpm_node *child[2];
+    void *value;
+    uint8_t plen;
+    uint8_t key[LPM_KEY_MAX];
+} lpm_node;
+
+struct lpm_trie
+{
+    lpm_node *root;
+    int bits;
+    int count;
+};
+
+static inline int
+lpm_bit (const uint8_t *key, int i)
+{
+    return (key[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/* Number of leading bits that match, up to len */
+static int
+lpm_common (const uint8_t *a, const uint8_t *b, int len)
+{
+    int i = 0;
+
+    while (i + 8 <= len && a[i >> 3] == b[i >> 3])
+        i += 8;
+    while (i < len && lpm_bit (a, i) == lpm_bit (b, i))
+        i++;
+    return i;
+}
+
+static lpm_node *
+lpm_node_new (const uint8_t *key, int plen, void *value)
+{
+    lpm_node *node = g_malloc0 (sizeof (lpm_node));
+    int i;
+
+    memcpy (node->key, key, (plen + 7) / 8);
+    if (plen & 7)
+        node->key[plen >> 3] &= 0xff << (8 - (plen & 7));
+    for (i = (plen + 7) / 8; i < LPM_KEY_MAX; i++)
+        node->key[i] = 0;
+    node->plen = plen;
+    node->value = value;
+    return node;
+}
+
+/**
+ * Create an empty trie
+ * @param bits maximum prefix length (32 for IPv4, 128 for IPv6)
+ * @return the new trie
+ */
+lpm_trie *
+lpm_new (int bits)
+{
+    lpm_trie *trie = g_malloc0 (sizeof (lpm_trie));
+    trie->bits = bits;
+    return trie;
+}
+
+static void
+lpm_node_free (lpm_node *node, GDestroyNotify destroy)
+{
+    if (!node)
+        return;
+    lpm_node_free (node->child[0], destroy);
+    lpm_node_free (node->child[1], destroy);
+    if (node->value && destroy)
+        destroy (node->value);
+    g_free (node);
+}
+
+/**
+ * Free a trie
+ * @param trie trie to free
+ * @param destroy function to free each value (may be NULL)
+ */
+void
+lpm_free (lpm_trie *trie, GDestroyNotify destroy)
+{
+    if (!trie)
+        return;
+    lpm_node_free (trie->root, destroy);
+    g_free (trie);
+}
+
+/**
+ * Number of prefixes in the trie
+ * @param trie trie to count
+ * @return number of prefixes with a value
+ */
+int
+lpm_count (lpm_trie *trie)
+{
+    return trie->count;
+}
+
+/**
+ * Add a prefix to the trie
+ * @param trie trie to add to
+ * @param key network order address
+ * @param plen prefix length
+ * @param value value for the prefix (must not be NULL)
+ * @return the value previously stored for the prefix, or NULL
+ */
+void *
+lpm_insert (lpm_trie *trie, const uint8_t *key, int plen, void *value)
+{
+    lpm_node **pp = &trie->root;
+    lpm_node *node, *glue, *leaf;
+    void *old;
+    int common;
+
+    if (plen < 0 || plen > trie->bits || !value)
+        return NULL;
+
+    while ((node = *pp) != NULL)
+    {
+        common = lpm_common (node->key, key, MIN (node->plen, plen));
+        if (common < node->plen)
+        {
+            /* The new prefix sits above this node */
+            leaf = lpm_node_new (key, plen, value);
+            trie->count++;
+            if (common == plen)
+            {
+                leaf->child[lpm_bit (node->key, plen)] = node;
+                *pp = leaf;
+                return NULL;
+            }
+            /* The prefixes diverge, branch where they do */
+            glue = lpm_node_new (key, common, NULL);
+            glue->child[lpm_bit (key, common)] = leaf;
+            glue->child[lpm_bit (node->key, common)] = node;
+            *pp = glue;
+            return NULL;
+        }
+        if (node->plen == plen)
+        {
+            old = node->value;
+            node->value = value;
+            if (!old)
+                trie->count++;
+            return old;
+        }
+        pp = &node->child[lpm_bit (key, node->plen)];
+    }
+
+    *pp = lpm_node_new (key, plen, value);
+    trie->count++;
+    return NULL;
+}
+
+/**
+ * Find the value stored for an exact prefix
+ * @param trie trie to search
+ * @param key network order address
+ * @param plen prefix length
+ * @return the value or NULL if the prefix is not in the trie
+ */
+void *
+lpm_get (lpm_trie *trie, const uint8_t *key, int plen)
+{
+    lpm_node *node = trie->root;
+
+    while (node && node->plen <= plen)
+    {
+        if (lpm_common (node->key, key, node->plen) < node->plen)
+            return NULL;
+        if (node->plen == plen)
+            return node->value;
+        node = node->child[lpm_bit (key, node->plen)];
+    }
+    return NULL;
+}
+
+/**
+ * Remove a prefix from the trie
+ * @param trie trie to remove from
+ * @param key network order address
+ * @param plen prefix length
+ * @return the value that was stored for the prefix, or NULL
+ */
+void *
+lpm_remove (lpm_trie *trie, const uint8_t *key, int plen)
+{
+    lpm_node **pp = &trie->root;
+    lpm_node **parent = NULL;
+    lpm_node *node, *child;
+    void *value;
+
+    while ((node = *pp) != NULL && node->plen < plen)
+    {
+        if (lpm_common (node->key, key, node->plen) < node->plen)
+            return NULL;
+        parent = pp;
+        pp = &node->child[lpm_bit (key, node->plen)];
+    }
+    if (!node || node->plen != plen || !node->value ||
+        lpm_common (node->key, key, plen) < plen)
+        return NULL;
+
+    value = node->value;
+    node->value = NULL;
+    trie->count--;
+
+    /* Keep the node only while it still branches */
+    if (node->child[0] && node->child[1])
+        return value;
+    child = node->child[0] ? node->child[0] : node->child[1];
+    *pp = child;
+    g_free (node);
+
+    /* A branch node left with one child is no longer needed */
+    if (!child && parent && !(*parent)->value)
+    {
+        node = *parent;
+        *parent = node->child[0] ? node->child[0] : node->child[1];
+        g_free (node);
+    }
+    return value;
+}
+
+/**
+ * Find the longest prefix that covers an address
+ * @param trie trie to search
+ * @param key network order address (trie bits long)
+ * @param plen returns the length of the matching prefix (may be NULL)
+ * @return the value for the longest matching prefix, or NULL
+ */
+void *
+lpm_lookup (lpm_trie *trie, const uint8_t *key, int *plen)
+{
+    lpm_node *node = trie->root;
+    lpm_node *best = NULL;
+
+    while (node)
+    {
+        if (lpm_common (node->key, key, node->plen) < node->plen)
+            break;
+        if (node->value)
+            best = node;
+        if (node->plen >= trie->bits)
+            break;
+        node = node->child[lpm_bit (key, node->plen)];
+    }
+    if (best && plen)
+        *plen = best->plen;
+    return best ? best->value : NULL;
+}
@@ -18,6 +18,8 @@
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
 #include "kermond.h"
+#include <errno.h>
+#include <limits.h>
 
 /* PID file */
 #define APTERYX_KERMOND_PID "/var/run/apteryx-kermond.pid"
@@ -29,6 +31,12 @@ GMainLoop *g_loop = NULL;
 bool kermond_debug = false;
 bool kermond_verbose = false;
 
+/* Track routes without the libnl route cache */
+bool kermond_fib_mirror = false;
+
+/* Leave programmed state in place across a restart */
+bool kermond_graceful = false;
+
 static gboolean
 termination_handler (gpointer arg1)
 {
@@ -40,13 +48,17 @@ termination_handler (gpointer arg1)
 void
 help (char *app_name)
 {
-    printf ("Usage: %s [-h] [-b] [-v] [-d] [-p <pidfile>]\n"
+    printf ("Usage: %s [-h] [-b] [-v] [-d] [-p <pidfile>] [-r <bytes>] [-f] [-g]\n"
             "  -h   show this help\n"
             "  -b   background mode\n"
             "  -d   enable debug\n"
             "  -v   enable verbose debug\n"
             "  -m   comma separated list of modules to load (e.g. ifconfig,ifstatus)\n"
-            "  -p   use <pidfile> (defaults to " APTERYX_KERMOND_PID ")\n", app_name);
+            "  -p   use <pidfile> (defaults to " APTERYX_KERMOND_PID ")\n"
+            "  -r   netlink receive buffer size in bytes (defaults to %d)\n"
+            "  -f   track routes without the libnl route cache (uses less memory)\n"
+            "  -g   graceful restart (keep kernel routes and Apteryx state across restarts)\n",
+            app_name, NETLINK_RX_BUFFER);
     modules_dump ();
 }
 
@@ -54,12 +66,13 @@ int
 main (int argc, char *argv[])
 {
     const char *pid_file = APTERYX_KERMOND_PID;
+    int rx_buffer = NETLINK_RX_BUFFER;
     int i = 0;
     bool background = false;
     FILE *fp = NULL;
 
     /* Parse options */
-    while ((i = getopt (argc, argv, "hdvbm:p:")) != -1)
+    while ((i = getopt (argc, argv, "hdvbm:p:r:fg")) != -1)
     {
         switch (i)
         {
@@ -82,6 +95,28 @@ main (int argc, char *argv[])
         case 'p':
             pid_file = optarg;
             break;
+        case 'r':
+        {
+            char *end;
+            long size;
+
+            errno = 0;
+            size = strtol (optarg, &end, 10);
+            if (errno || end == optarg || *end != '\0' || size <= 0 || size > INT_MAX)
+            {
+                fprintf (stderr, "Invalid receive buffer size \"%s\"\n", optarg);
+                help (argv[0]);
+                return 0;
+            }
+            rx_buffer = size;
+            break;
+        }
+        case 'f':
+            kermond_fib_mirror = true;
+            break;
+        case 'g':
+            kermond_graceful = true;
+            break;
         case '?':
         case 'h':
         default:
@@ -103,8 +138,18 @@ main (int argc, char *argv[])
     /* Initialise Apteryx client library */
     apteryx_init (kermond_verbose);
 
+    /* Group updates into as few Apteryx transactions as possible */
+    apteryx_batch_enable (true);
+
+    /* Direct sysctl writes */
+    sysctl_init ();
+
     /* Initialise Netlink helper */
-    if (!netlink_init ())
+    if (!netlink_init (rx_buffer))
+        goto exit;
+
+    /* Track interface names for the modules */
+    if (!iftable_init ())
         goto exit;
 
     /* Initialise modules */
@@ -136,10 +181,18 @@ main (int argc, char *argv[])
 
   exit:
 
+    /* Send any outstanding updates */
+    apteryx_batch_enable (false);
+    sysctl_exit ();
+
     /* Shutdown modules */
     modules_exit ();
 
-    /* Cleanup netlink helper */
+    /* Stop tracking interfaces */
+    iftable_exit ();
+
+    /* Cleanup netlink helpers */
+    nft_exit ();
     netlink_exit ();
 
     /* Cleanup client library */
@@ -20,101 +20,76 @@
 #include "kermond.h"
 #include "ip-neighbor.h"
 
+/* Errors are reported when the write is applied, so the setting is
+ * always accepted here */
 static bool
-system_call (char *cmd)
+sysctl_call (char *key, int value)
 {
-    VERBOSE ("NEIGHBOR: %s\n", cmd);
-    if (system (cmd) != 0)
-    {
-        ERROR ("NEIGHBOR: Command failed (%s)\n", cmd);
-        return false;
-    }
-    free (cmd);
+    sysctl_set (key, value);
+    free (key);
     return true;
 }
 
 static bool
 watch_ipv4_settings (const char *path, const char *value)
 {
-    char ifname[64];
-    char parameter[64];
+    apteryx_match match;
+    const char *ifname;
 
     VERBOSE ("NEIGHBOR: %s = %s\n", path, value);
 
+    if (!apteryx_path_match (ip_neighbor_schema, path, &match))
+    {
+        ERROR ("NEIGHBOR: Unexpected path: %s\n", path);
+        return false;
+    }
+    ifname = match.keys[0];
+
+    switch (match.id)
+    {
     /* Opportunistic Neighbor Discovery */
-    if (path && strcmp (path, IP_NEIGHBOR_IPV4_OPPORTUNISTIC_ND_PATH) == 0)
+    case IP_NEIGHBOR_IPV4_OPPORTUNISTIC_ND_NODE:
     {
         int mode = apteryx_parse_boolean (path, value, false) ? 1 : 0;
-        char *cmd = g_strdup_printf ("sysctl -w net.ipv4.aggressive_nd=%d", mode);
-        return system_call (cmd);
+        return sysctl_call (strdup ("net/ipv4/aggressive_nd"), mode);
     }
-    /* Interface specific */
-    else if (path && sscanf (path, IP_NEIGHBOR_IPV4_INTERFACES_PATH "/%64[^/]/%64s",
-                     ifname, parameter) == 2)
+    /* Aging Timeout */
+    case IP_NEIGHBOR_IPV4_INTERFACES_AGING_TIMEOUT_NODE:
     {
-        /* Aging Timeout */
-        if (strcmp (parameter, IP_NEIGHBOR_IPV4_INTERFACES_AGING_TIMEOUT) == 0)
-        {
-            int timeout = IP_NEIGHBOR_IPV4_INTERFACES_AGING_TIMEOUT_DEFAULT;
-            if ((value && sscanf (value, "%d", &timeout) != 1) ||
-                timeout < 0 || timeout > 432000)
-            {
-                timeout = IP_NEIGHBOR_IPV4_INTERFACES_AGING_TIMEOUT_DEFAULT;
-                ERROR ("NEIGHBOR: Invalid aging-timeout value (%s) using default (%d)\n",
-                       value, timeout);
-            }
-            char *cmd = g_strdup_printf ("sysctl -w net.ipv4.neigh.%s.base_reachable_time_ms=%d",
-                                   ifname, timeout * 1000);
-            return system_call (cmd);
-        }
-        /* MAC Disparity */
-        else if (strcmp (parameter, IP_NEIGHBOR_IPV4_INTERFACES_MAC_DISPARITY) == 0)
-        {
-            int mode = apteryx_parse_boolean (path, value, false) ? 1 : 0;
-            char *cmd = g_strdup_printf ("sysctl -w net.ipv4.conf.%s.arp_mac_disparity=%d",
-                        ifname, mode);
-            return system_call (cmd);
-        }
-        /* Proxy Arp */
-        else if (strcmp (parameter, IP_NEIGHBOR_IPV4_INTERFACES_PROXY_ARP) == 0)
+        int timeout = IP_NEIGHBOR_IPV4_INTERFACES_AGING_TIMEOUT_DEFAULT;
+        if ((value && sscanf (value, "%d", &timeout) != 1) ||
+            timeout < 0 || timeout > 432000)
         {
-            int mode = 0;
-            if (value && strcmp (value,
-                    IP_NEIGHBOR_IPV4_INTERFACES_PROXY_ARP_DISABLED) == 0)
-            {
-                mode = 0;
-            }
-            else if (value && strcmp (value,
-                    IP_NEIGHBOR_IPV4_INTERFACES_PROXY_ARP_ENABLED) == 0)
-            {
-                mode = 1;
-            }
-            else if (value && strcmp (value,
-                    IP_NEIGHBOR_IPV4_INTERFACES_PROXY_ARP_LOCAL) == 0)
-            {
-                mode = 2;
-            }
-            else if (value && strcmp (value,
-                    IP_NEIGHBOR_IPV4_INTERFACES_PROXY_ARP_BOTH) == 0)
-            {
-                mode = 3;
-            }
-            else if (value)
-            {
-                ERROR ("Invalid %s value (%s) using default (%d)\n",
-                                path, value, mode);
-            }
-            char *cmd = g_strdup_printf ("sysctl -w net.ipv4.conf.%s.proxy_arp=%d", ifname, mode);
-            return system_call (cmd);
-        }
-        /* Opportunistic Neighbor Discovery */
-        else if (strcmp (parameter, IP_NEIGHBOR_IPV4_INTERFACES_OPTIMISTIC_ND) == 0)
-        {
-            int mode = apteryx_parse_boolean (path, value, true) ? 1 : 0;
-            char *cmd = g_strdup_printf ("sysctl -w net.ipv4.neigh.%s.optimistic_nd=%d",
-                        ifname, mode);
-            return system_call (cmd);
+            timeout = IP_NEIGHBOR_IPV4_INTERFACES_AGING_TIMEOUT_DEFAULT;
+            ERROR ("NEIGHBOR: Invalid aging-timeout value (%s) using default (%d)\n",
+                   value, timeout);
         }
+        return sysctl_call (g_strdup_printf ("net/ipv4/neigh/%s/base_reachable_time_ms",
+                            ifname), timeout * 1000);
+    }
+    /* MAC Disparity */
+    case IP_NEIGHBOR_IPV4_INTERFACES_MAC_DISPARITY_NODE:
+    {
+        int mode = apteryx_parse_boolean (path, value, false) ? 1 : 0;
+        return sysctl_call (g_strdup_printf ("net/ipv4/conf/%s/arp_mac_disparity",
+                            ifname), mode);
+    }
+    /* Proxy Arp */
+    case IP_NEIGHBOR_IPV4_INTERFACES_PROXY_ARP_NODE:
+    {
+        int mode = apteryx_parse_enum (path, value,
+                &ip_neighbor_ipv4_interfaces_proxy_arp_enum, 0);
+        return sysctl_call (g_strdup_printf ("net/ipv4/conf/%s/proxy_arp", ifname), mode);
+    }
+    /* Opportunistic Neighbor Discovery */
+    case IP_NEIGHBOR_IPV4_INTERFACES_OPTIMISTIC_ND_NODE:
+    {
+        int mode = apteryx_parse_boolean (path, value, true) ? 1 : 0;
+        return sysctl_call (g_strdup_printf ("net/ipv4/neigh/%s/optimistic_nd",
+                            ifname), mode);
+    }
+    default:
+        break;
     }
     ERROR ("NEIGHBOR: Unexpected path: %s\n", path);
     return false;
@@ -133,8 +108,7 @@ watch_ipv6_settings (const char *path, const char *value)
     if (path && strcmp (path, IP_NEIGHBOR_IPV6_OPPORTUNISTIC_ND_PATH) == 0)
     {
         int mode = apteryx_parse_boolean (path, value, false) ? 1 : 0;
-        char *cmd = g_strdup_printf ("sysctl -w net.ipv6.icmp.aggressive_nd=%d", mode);
-        return system_call (cmd);
+        return sysctl_call (strdup ("net/ipv6/icmp/aggressive_nd"), mode);
     }
     ERROR ("NEIGHBOR: Unexpected path: %s\n", path);
     return false;
@@ -19,6 +19,12 @@
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
 #include "kermond.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/rtnetlink.h>
+#include <arpa/inet.h>
 
 /* Netlink debug paramters */
 struct nl_dump_params netlink_dp = { };
@@ -28,29 +34,457 @@ typedef struct cache_descriptor
     char *kind;
     struct nl_cache *cache;
     GList *callbacks;
+    GHashTable *filters;
 } cache_descriptor;
 static GList *caches = NULL;
 
-static pthread_t monitor_thread = -1;
+static guint monitor_source = 0;
 static struct nl_cache_mngr *mngr = NULL;
+static struct nl_sock *mngr_sock = NULL;
+static struct nl_sock *sync_sock = NULL;
 
-static void *
-netlink_monitor (void *p)
+/* Time to collect changes before passing them to the modules */
+#define NETLINK_COALESCE_MS 20
+
+/* Pending change to a kernel object */
+typedef struct netlink_event
+{
+    cache_descriptor *desc;
+    struct nl_object *key;
+    int action;
+    struct nl_object *old_obj;
+    struct nl_object *new_obj;
+    struct nl_object *deleted;
+    GList *link;
+} netlink_event;
+
+/* Pending changes indexed by (kind, object identity) and in arrival order */
+static GHashTable *pending = NULL;
+static GQueue pending_order = G_QUEUE_INIT;
+static guint flush_source = 0;
+
+static guint
+event_hash (gconstpointer p)
+{
+    const netlink_event *ev = (const netlink_event *) p;
+    uint32_t hashkey = 0;
+
+    nl_object_keygen (ev->key, &hashkey, UINT32_MAX);
+    return hashkey ^ g_direct_hash (ev->desc);
+}
+
+static gboolean
+event_equal (gconstpointer a, gconstpointer b)
+{
+    const netlink_event *ea = (const netlink_event *) a;
+    const netlink_event *eb = (const netlink_event *) b;
+
+    return ea->desc == eb->desc && nl_object_identical (ea->key, eb->key);
+}
+
+static void
+event_put (struct nl_object **obj)
+{
+    if (*obj)
+        nl_object_put (*obj);
+    *obj = NULL;
+}
+
+static void
+event_free (netlink_event *ev)
+{
+    event_put (&ev->key);
+    event_put (&ev->old_obj);
+    event_put (&ev->new_obj);
+    event_put (&ev->deleted);
+    free (ev);
+}
+
+static void
+event_dispatch (cache_descriptor *desc, int action,
+                struct nl_object *old_obj, struct nl_object *new_obj)
 {
+    GList *iter;
+
+    for (iter = g_list_first (desc->callbacks); iter; iter = g_list_next (iter))
+    {
+        netlink_callback cb = (netlink_callback) iter->data;
+        cb (action, old_obj, new_obj);
+    }
+}
+
+/* Merge a new change into a pending event. Returns false if the
+ * changes cancel each other out and the event can be dropped */
+static bool
+event_coalesce (netlink_event *ev, int action,
+                struct nl_object *old_obj, struct nl_object *new_obj)
+{
+    if (action == NL_ACT_DEL)
+    {
+        /* Never published so there is nothing to remove */
+        if (ev->action == NL_ACT_NEW && !ev->deleted)
+        {
+            event_put (&old_obj);
+            event_put (&new_obj);
+            return false;
+        }
+        event_put (&ev->old_obj);
+        event_put (&ev->new_obj);
+        event_put (&ev->deleted);
+        ev->action = NL_ACT_DEL;
+        ev->old_obj = old_obj;
+        ev->new_obj = new_obj;
+    }
+    else if (ev->action == NL_ACT_DEL)
+    {
+        /* Object was removed and re-added, so publish both */
+        ev->deleted = ev->old_obj ? ev->old_obj : ev->new_obj;
+        if (ev->deleted == ev->old_obj)
+            event_put (&ev->new_obj);
+        ev->old_obj = NULL;
+        event_put (&old_obj);
+        ev->action = NL_ACT_NEW;
+        ev->new_obj = new_obj;
+    }
+    else
+    {
+        /* Only the latest state of the object is interesting */
+        if (action == NL_ACT_NEW)
+        {
+            ev->action = NL_ACT_NEW;
+            event_put (&ev->old_obj);
+        }
+        event_put (&old_obj);
+        event_put (&ev->new_obj);
+        ev->new_obj = new_obj;
+    }
+    return true;
+}
+
+static gboolean
+netlink_flush (gpointer data)
+{
+    GQueue events;
+    netlink_event *ev;
+
+    /* Take all pending events */
+    events = pending_order;
+    g_queue_init (&pending_order);
+    g_hash_table_remove_all (pending);
+    flush_source = 0;
+
+    /* Pass the latest state of each object to the modules */
+    VERBOSE ("NETLINK: Flushing %d events\n", events.length);
+    while ((ev = (netlink_event *) g_queue_pop_head (&events)))
+    {
+        if (ev->deleted)
+            event_dispatch (ev->desc, NL_ACT_DEL, ev->deleted, NULL);
+        event_dispatch (ev->desc, ev->action, ev->old_obj, ev->new_obj);
+        event_free (ev);
+    }
+
+    /* Send the resulting changes to Apteryx in one go */
+    apteryx_batch_flush ();
+    return G_SOURCE_REMOVE;
+}
+
+static void
+event_queue (cache_descriptor *desc, int action,
+             struct nl_object *old_obj, struct nl_object *new_obj)
+{
+    netlink_event lookup = { .desc = desc, .key = new_obj ? new_obj : old_obj };
+    netlink_event *ev;
+
+    if (!lookup.key)
+        return;
+
+    /* Cache objects are updated in place and we run in the same loop
+     * as the cache manager, so a reference always sees the latest state */
+    if (new_obj)
+        nl_object_get (new_obj);
+    if (old_obj)
+        nl_object_get (old_obj);
+
+    ev = (netlink_event *) g_hash_table_lookup (pending, &lookup);
+    if (!ev)
+    {
+        ev = calloc (1, sizeof (netlink_event));
+        ev->desc = desc;
+        ev->key = new_obj ? new_obj : old_obj;
+        nl_object_get (ev->key);
+        ev->action = action;
+        ev->old_obj = old_obj;
+        ev->new_obj = new_obj;
+        g_hash_table_add (pending, ev);
+        g_queue_push_tail (&pending_order, ev);
+        ev->link = pending_order.tail;
+    }
+    else if (!event_coalesce (ev, action, old_obj, new_obj))
+    {
+        g_hash_table_remove (pending, ev);
+        g_queue_delete_link (&pending_order, ev->link);
+        event_free (ev);
+    }
+    else if (ev->action == NL_ACT_DEL)
+    {
+        /* Removals of anything queued since (addresses and neighbors on a
+         * link) must be dispatched while the object can still be resolved */
+        g_queue_unlink (&pending_order, ev->link);
+        g_queue_push_tail_link (&pending_order, ev->link);
+    }
+    if (!flush_source && !g_queue_is_empty (&pending_order))
+        flush_source = g_timeout_add (NETLINK_COALESCE_MS, netlink_flush, NULL);
+}
+
+static void
+event_purge (cache_descriptor *desc)
+{
+    GList *iter, *next;
+
+    for (iter = pending_order.head; iter; iter = next)
+    {
+        netlink_event *ev = (netlink_event *) iter->data;
+        next = iter->next;
+        if (desc && ev->desc != desc)
+            continue;
+        g_hash_table_remove (pending, ev);
+        g_queue_delete_link (&pending_order, iter);
+        event_free (ev);
+    }
+}
+
+static void
+resync_cb (struct nl_cache *cache, struct nl_object *obj, int action, void *p)
+{
+    cache_descriptor *desc = (cache_descriptor *) p;
+
+    /* Only objects that differ from the cache are reported */
+    event_queue (desc, action, NULL, obj);
+}
+
+static void
+netlink_resync (void)
+{
+    GList *iter;
     int err;
 
-    DEBUG ("NETLINK: Starting monitor\n");
-    while (err >= 0 && g_main_loop_is_running (g_loop))
+    /* We cannot tell which messages were lost so check every cache */
+    for (iter = g_list_first (caches); iter; iter = g_list_next (iter))
+    {
+        cache_descriptor *desc = (cache_descriptor *) iter->data;
+        DEBUG ("NETLINK: Resync %s\n", desc->kind);
+        err = nl_cache_resync (sync_sock, desc->cache, resync_cb, desc);
+        if (err < 0)
+            ERROR ("NETLINK: Resync %s failed: %s\n", desc->kind, nl_geterror (err));
+    }
+}
+
+static gboolean
+netlink_monitor (gint fd, GIOCondition condition, gpointer data)
+{
+    int err;
+
+    err = nl_cache_mngr_data_ready (mngr);
+    if (err == -NLE_NOMEM)
+    {
+        /* Socket overrun (ENOBUFS) so the caches may be stale */
+        ERROR ("NETLINK: Receive buffer overrun, resynchronising\n");
+        netlink_resync ();
+        return G_SOURCE_CONTINUE;
+    }
+    if (err < 0 && err != -NLE_INTR && err != -NLE_AGAIN)
+    {
+        FATAL ("Netlink: failed to read cache mngr: %s\n", nl_geterror (err));
+        monitor_source = 0;
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/* Netlink message types for each kind of cache we can filter */
+static const struct
+{
+    const char *kind;
+    uint16_t types[2];
+} filter_kinds[] = {
+    { "route/link", { RTM_NEWLINK, RTM_DELLINK } },
+    { "route/addr", { RTM_NEWADDR, RTM_DELADDR } },
+    { "route/neigh", { RTM_NEWNEIGH, RTM_DELNEIGH } },
+    { "route/route", { RTM_NEWROUTE, RTM_DELROUTE } },
+};
+
+/* Jump targets while building the filter */
+enum
+{
+    FILTER_NEXT,
+    FILTER_SKIP,
+    FILTER_ROUTE,
+    FILTER_ACCEPT,
+    FILTER_DROP,
+};
+
+typedef struct filter_insn
+{
+    struct sock_filter insn;
+    int jt;
+    int jf;
+} filter_insn;
+
+static void
+filter_add (GArray *prog, uint16_t code, uint32_t k, int jt, int jf)
+{
+    filter_insn fi = { BPF_STMT (code, k), jt, jf };
+    g_array_append_val (prog, fi);
+}
+
+/* Messages that we only care about if some module does */
+static unsigned int
+cache_filter (cache_descriptor *desc)
+{
+    unsigned int filter = ~0U;
+    GHashTableIter iter;
+    gpointer value;
+
+    /* Only filter what every user of the cache is happy to lose */
+    g_hash_table_iter_init (&iter, desc->filters);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        filter &= GPOINTER_TO_UINT (value);
+    return filter;
+}
+
+/* Attach a classic BPF program to the cache manager socket so the kernel
+ * drops messages for caches we are not managing, and route messages that
+ * none of the route users want. Messages are in host byte order but BPF
+ * loads are in network byte order, hence the htons/htonl */
+static void
+netlink_filter_update (void)
+{
+    GArray *prog = g_array_new (false, false, sizeof (filter_insn));
+    struct sock_filter *insns;
+    struct sock_fprog fprog;
+    unsigned int route_filter = 0;
+    int route_pos = -1;
+    GList *iter;
+    guint i, j;
+
+    /* Check the message type */
+    filter_add (prog, BPF_LD | BPF_H | BPF_ABS, offsetof (struct nlmsghdr, nlmsg_type),
+                FILTER_NEXT, FILTER_NEXT);
+    for (i = NLMSG_NOOP; i <= NLMSG_OVERRUN; i++)
+        filter_add (prog, BPF_JMP | BPF_JEQ | BPF_K, htons (i), FILTER_ACCEPT, FILTER_NEXT);
+    for (iter = g_list_first (caches); iter; iter = g_list_next (iter))
     {
-        err = nl_cache_mngr_poll (mngr, 1000);
-        if (err < 0 && err != -NLE_INTR)
+        cache_descriptor *desc = (cache_descriptor *) iter->data;
+        bool found = false;
+        int target = FILTER_ACCEPT;
+
+        for (i = 0; i < G_N_ELEMENTS (filter_kinds); i++)
         {
-            FATAL ("Netlink: failed to poll cache mngr: %s\n", nl_geterror (err));
+            if (strcmp (desc->kind, filter_kinds[i].kind) != 0)
+                continue;
+            found = true;
+            if (filter_kinds[i].types[0] == RTM_NEWROUTE)
+            {
+                route_filter = cache_filter (desc);
+                if (route_filter)
+                    target = FILTER_ROUTE;
+            }
+            for (j = 0; j < G_N_ELEMENTS (filter_kinds[i].types); j++)
+                filter_add (prog, BPF_JMP | BPF_JEQ | BPF_K, htons (filter_kinds[i].types[j]),
+                            target, FILTER_NEXT);
+        }
+
+        /* Not something we know how to filter */
+        if (!found)
+        {
+            g_array_free (prog, true);
+            prog = NULL;
             break;
         }
     }
-    DEBUG ("NETLINK: Monitor exiting\n");
-    return NULL;
+
+    /* Check route messages */
+    if (prog && route_filter)
+    {
+        filter_add (prog, BPF_RET | BPF_K, 0, FILTER_NEXT, FILTER_NEXT);
+        route_pos = prog->len;
+        if (route_filter & NETLINK_FILTER_ROUTE_NON_IP)
+        {
+            filter_add (prog, BPF_LD | BPF_B | BPF_ABS,
+                        NLMSG_HDRLEN + offsetof (struct rtmsg, rtm_family),
+                        FILTER_NEXT, FILTER_NEXT);
+            filter_add (prog, BPF_JMP | BPF_JEQ | BPF_K, AF_INET, FILTER_SKIP, FILTER_NEXT);
+            filter_add (prog, BPF_JMP | BPF_JEQ | BPF_K, AF_INET6, FILTER_NEXT, FILTER_DROP);
+        }
+        if (route_filter & NETLINK_FILTER_ROUTE_LOCAL)
+        {
+            filter_add (prog, BPF_LD | BPF_B | BPF_ABS,
+                        NLMSG_HDRLEN + offsetof (struct rtmsg, rtm_table),
+                        FILTER_NEXT, FILTER_NEXT);
+            filter_add (prog, BPF_JMP | BPF_JEQ | BPF_K, RT_TABLE_LOCAL, FILTER_DROP, FILTER_NEXT);
+        }
+        if (route_filter & NETLINK_FILTER_ROUTE_CLONED)
+        {
+            filter_add (prog, BPF_LD | BPF_W | BPF_ABS,
+                        NLMSG_HDRLEN + offsetof (struct rtmsg, rtm_flags),
+                        FILTER_NEXT, FILTER_NEXT);
+            filter_add (prog, BPF_JMP | BPF_JSET | BPF_K, htonl (RTM_F_CLONED),
+                        FILTER_DROP, FILTER_NEXT);
+        }
+        filter_add (prog, BPF_RET | BPF_K, 0xffffffff, FILTER_NEXT, FILTER_NEXT);
+    }
+
+    /* No filter if any cache needs everything */
+    if (!prog)
+    {
+        setsockopt (nl_socket_get_fd (mngr_sock), SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+        return;
+    }
+
+    /* Drop and accept */
+    filter_add (prog, BPF_RET | BPF_K, 0, FILTER_NEXT, FILTER_NEXT);
+    filter_add (prog, BPF_RET | BPF_K, 0xffffffff, FILTER_NEXT, FILTER_NEXT);
+
+    /* Resolve jumps relative to the next instruction */
+    insns = g_new0 (struct sock_filter, prog->len);
+    for (i = 0; i < prog->len; i++)
+    {
+        filter_insn *fi = &g_array_index (prog, filter_insn, i);
+        int targets[] = { fi->jt, fi->jf };
+        for (j = 0; j < 2; j++)
+        {
+            switch (targets[j])
+            {
+            case FILTER_NEXT:
+                targets[j] = 0;
+                break;
+            case FILTER_SKIP:
+                targets[j] = 1;
+                break;
+            case FILTER_ROUTE:
+                targets[j] = route_pos - (i + 1);
+                break;
+            case FILTER_DROP:
+                targets[j] = prog->len - 2 - (i + 1);
+                break;
+            case FILTER_ACCEPT:
+                targets[j] = prog->len - 1 - (i + 1);
+                break;
+            }
+        }
+        insns[i] = fi->insn;
+        insns[i].jt = targets[0];
+        insns[i].jf = targets[1];
+    }
+
+    fprog.len = prog->len;
+    fprog.filter = insns;
+    DEBUG ("NETLINK: Attaching %d instruction filter\n", fprog.len);
+    if (setsockopt (nl_socket_get_fd (mngr_sock), SOL_SOCKET, SO_ATTACH_FILTER,
+                    &fprog, sizeof (fprog)) < 0)
+        ERROR ("NETLINK: Failed to attach socket filter: %s\n", strerror (errno));
+    g_free (insns);
+    g_array_free (prog, true);
 }
 
 static void
@@ -71,17 +505,13 @@ change_cb (struct nl_cache *cache, struct nl_object *old_obj,
 {
 #endif
     cache_descriptor *desc = (cache_descriptor *) p;
-    GList *iter;
 
-    for (iter = g_list_first (desc->callbacks); iter; iter = g_list_next (iter))
-    {
-        netlink_callback cb = (netlink_callback) iter->data;
-        cb (action, old_obj, new_obj);
-    }
+    /* Queue the change for the writer */
+    event_queue (desc, action, old_obj, new_obj);
 }
 
 bool
-netlink_register (char *kind, netlink_callback cb)
+netlink_register_filtered (char *kind, netlink_callback cb, unsigned int filter)
 {
     cache_descriptor *desc = NULL;
     GList *iter;
@@ -108,6 +538,7 @@ netlink_register (char *kind, netlink_callback cb)
     {
         desc = calloc (1, sizeof (cache_descriptor));
         desc->kind = strdup (kind);
+        desc->filters = g_hash_table_new (g_direct_hash, g_direct_equal);
         caches = g_list_prepend (caches, desc);
 
         /* Allocate the cache */
@@ -130,12 +561,23 @@ netlink_register (char *kind, netlink_callback cb)
         }
     }
     desc->callbacks = g_list_prepend (desc->callbacks, cb);
+    g_hash_table_insert (desc->filters, cb, GUINT_TO_POINTER (filter));
+    netlink_filter_update ();
 
-    /* Force callbacks for all items */
+    /* Force callbacks for all items as one bulk update */
+    DEBUG ("NETLINK: Syncing %d %s objects\n", nl_cache_nitems (desc->cache), kind);
+    apteryx_batch_bulk (true);
     nl_cache_foreach (desc->cache, startup_cb, cb);
+    apteryx_batch_bulk (false);
     return true;
 }
 
+bool
+netlink_register (char *kind, netlink_callback cb)
+{
+    return netlink_register_filtered (kind, cb, 0);
+}
+
 void
 netlink_unregister (char *kind, netlink_callback cb)
 {
@@ -155,19 +597,420 @@ netlink_unregister (char *kind, netlink_callback cb)
 
     /* Remove our callback */
     desc->callbacks = g_list_remove (desc->callbacks, cb);
+    g_hash_table_remove (desc->filters, cb);
 
     /* Destroy if their are no other users */
     if (desc->callbacks == NULL)
     {
+        event_purge (desc);
         caches = g_list_remove (caches, desc);
+        g_hash_table_destroy (desc->filters);
         free (desc->kind);
         free (desc);
     }
+    netlink_filter_update ();
+}
+
+/* Size a socket's receive buffer. SO_RCVBUF is silently capped at
+ * net.core.rmem_max, so force it where we are allowed to. */
+static void
+netlink_set_rcvbuf (struct nl_sock *sk, const char *name, int size)
+{
+    int fd = nl_socket_get_fd (sk);
+    int applied = 0;
+    socklen_t len = sizeof (applied);
+
+    if (setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof (size)) < 0 &&
+        setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size)) < 0)
+    {
+        ERROR ("NETLINK: Failed to set %s receive buffer to %d: %s\n",
+               name, size, strerror (errno));
+        return;
+    }
+
+    /* The kernel reports double the size to account for its overhead */
+    if (getsockopt (fd, SOL_SOCKET, SO_RCVBUF, &applied, &len) == 0)
+    {
+        if (applied / 2 < size)
+        {
+            NOTICE ("NETLINK: %s receive buffer is %d bytes, not %d (see net.core.rmem_max)\n",
+                    name, applied / 2, size);
+        }
+        else
+            DEBUG ("NETLINK: %s receive buffer is %d bytes\n", name, applied / 2);
+    }
+}
+
+/* Pipelined requests. Messages are sent in batches on one socket
+ * with up to NETLINK_REQUEST_WINDOW waiting for an ACK. */
+#define NETLINK_REQUEST_WINDOW 512
+#define NETLINK_REQUEST_BATCH 64
+typedef struct request_entry
+{
+    struct nl_msg *msg;
+    netlink_result_cb cb;
+    void *data;
+} request_entry;
+static struct nl_sock *req_sock = NULL;
+static guint req_source = 0;
+static GMutex req_lock = { };
+static GQueue req_queue = G_QUEUE_INIT;
+static GHashTable *req_inflight = NULL;
+static uint32_t req_seq = 0;
+static guint req_flush_source = 0;
+
+/* Requests that could not be sent from netlink_request, failed from the
+ * main loop so callers never see their callback run inline */
+static GList *req_failed = NULL;
+static guint req_failed_source = 0;
+
+static void
+request_done (uint32_t seq, int err)
+{
+    request_entry *req;
+
+    g_mutex_lock (&req_lock);
+    req = g_hash_table_lookup (req_inflight, GUINT_TO_POINTER (seq));
+    if (req)
+        g_hash_table_remove (req_inflight, GUINT_TO_POINTER (seq));
+    g_mutex_unlock (&req_lock);
+    if (!req)
+        return;
+    if (req->cb)
+        req->cb (err, req->data);
+    free (req);
+}
+
+static int
+request_ack_cb (struct nl_msg *msg, void *arg)
+{
+    request_done (nlmsg_hdr (msg)->nlmsg_seq, 0);
+    return NL_OK;
+}
+
+static int
+request_err_cb (struct sockaddr_nl *nla, struct nlmsgerr *nlerr, void *arg)
+{
+    request_done (nlerr->msg.nlmsg_seq, nlerr->error);
+    return NL_SKIP;
+}
+
+/* Call back and free requests that will never be answered */
+static void
+request_fail_list (GList *reqs, int err)
+{
+    GList *iter;
+
+    for (iter = reqs; iter; iter = iter->next)
+    {
+        request_entry *req = iter->data;
+        if (req->cb)
+            req->cb (err, req->data);
+        if (req->msg)
+            nlmsg_free (req->msg);
+        free (req);
+    }
+    g_list_free (reqs);
+}
+
+/* Fail the requests left by a deferred send */
+static void
+request_report_failed (void)
+{
+    GList *reqs;
+
+    g_mutex_lock (&req_lock);
+    reqs = req_failed;
+    req_failed = NULL;
+    if (req_failed_source)
+        g_source_remove (req_failed_source);
+    req_failed_source = 0;
+    g_mutex_unlock (&req_lock);
+    request_fail_list (reqs, -EIO);
+}
+
+static gboolean
+request_failed_cb (gpointer data)
+{
+    g_mutex_lock (&req_lock);
+    req_failed_source = 0;
+    g_mutex_unlock (&req_lock);
+    request_report_failed ();
+    return G_SOURCE_REMOVE;
+}
+
+/* Send as much of the queue as the window allows
+ * @param defer leave failed requests for the main loop instead of calling back
+ * @return false if a batch could not be sent */
+static bool
+request_send (bool defer)
+{
+    static const uint8_t pad[NLMSG_ALIGNTO] = { };
+    GByteArray *buf = g_byte_array_new ();
+    GList *failed = NULL;
+    request_entry *req;
+    struct nlmsghdr *hdr;
+    uint32_t first;
+    uint32_t seq;
+    int count;
+    int err = 0;
+
+    g_mutex_lock (&req_lock);
+    while (!g_queue_is_empty (&req_queue) &&
+           g_hash_table_size (req_inflight) < NETLINK_REQUEST_WINDOW)
+    {
+        g_byte_array_set_size (buf, 0);
+        first = req_seq + 1;
+        for (count = 0; count < NETLINK_REQUEST_BATCH &&
+             g_hash_table_size (req_inflight) < NETLINK_REQUEST_WINDOW &&
+             (req = g_queue_pop_head (&req_queue)) != NULL; count++)
+        {
+            hdr = nlmsg_hdr (req->msg);
+            hdr->nlmsg_seq = ++req_seq;
+            hdr->nlmsg_flags |= NLM_F_ACK;
+            g_byte_array_append (buf, (guint8 *) hdr, hdr->nlmsg_len);
+            g_byte_array_append (buf, pad, NLMSG_ALIGN (hdr->nlmsg_len) - hdr->nlmsg_len);
+            g_hash_table_insert (req_inflight, GUINT_TO_POINTER (req_seq), req);
+            nlmsg_free (req->msg);
+            req->msg = NULL;
+        }
+        err = nl_sendto (req_sock, buf->data, buf->len);
+        if (err < 0)
+        {
+            ERROR ("NETLINK: Failed to send %d requests: %s\n", count, nl_geterror (err));
+            /* None of the batch reached the kernel, so no ACKs will come */
+            for (seq = first; seq != req_seq + 1; seq++)
+            {
+                req = g_hash_table_lookup (req_inflight, GUINT_TO_POINTER (seq));
+                if (!req)
+                    continue;
+                g_hash_table_remove (req_inflight, GUINT_TO_POINTER (seq));
+                failed = g_list_prepend (failed, req);
+            }
+            break;
+        }
+    }
+    failed = g_list_reverse (failed);
+    if (defer && failed)
+    {
+        req_failed = g_list_concat (req_failed, failed);
+        failed = NULL;
+        if (!req_failed_source)
+            req_failed_source = g_idle_add (request_failed_cb, NULL);
+    }
+    g_mutex_unlock (&req_lock);
+    g_byte_array_free (buf, TRUE);
+    request_fail_list (failed, -EIO);
+    return err >= 0;
+}
+
+static gboolean
+request_flush (gpointer data)
+{
+    g_mutex_lock (&req_lock);
+    req_flush_source = 0;
+    g_mutex_unlock (&req_lock);
+    request_send (false);
+    return G_SOURCE_REMOVE;
+}
+
+/* Fail everything in flight, used when the ACKs can no longer be trusted */
+static void
+request_fail_all (int err)
+{
+    GList *seqs, *iter;
+
+    g_mutex_lock (&req_lock);
+    seqs = g_hash_table_get_keys (req_inflight);
+    g_mutex_unlock (&req_lock);
+    for (iter = seqs; iter; iter = iter->next)
+        request_done (GPOINTER_TO_UINT (iter->data), err);
+    g_list_free (seqs);
+}
+
+/* Fail everything still waiting to be sent */
+static void
+request_fail_queued (int err)
+{
+    GList *reqs = NULL;
+    request_entry *req;
+
+    g_mutex_lock (&req_lock);
+    while ((req = g_queue_pop_head (&req_queue)) != NULL)
+        reqs = g_list_prepend (reqs, req);
+    g_mutex_unlock (&req_lock);
+    request_fail_list (g_list_reverse (reqs), err);
+}
+
+/* Number of requests still waiting to be sent or answered */
+static guint
+request_pending (guint *inflight)
+{
+    guint pending;
+
+    g_mutex_lock (&req_lock);
+    *inflight = g_hash_table_size (req_inflight);
+    pending = *inflight + g_queue_get_length (&req_queue) + g_list_length (req_failed);
+    g_mutex_unlock (&req_lock);
+    return pending;
+}
+
+static gboolean
+request_monitor (gint fd, GIOCondition condition, gpointer data)
+{
+    int err = nl_recvmsgs_default (req_sock);
+
+    if (err == -NLE_NOMEM)
+    {
+        ERROR ("NETLINK: Request socket overrun, results lost\n");
+        request_fail_all (-ENOBUFS);
+    }
+    request_send (false);
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Queue a request for the kernel. Requests are sent in order, batched
+ * with others queued at the same time, and acknowledged asynchronously.
+ * The callback is called from the main loop with the result, never from
+ * within this call, so callers may hold locks the callback takes.
+ * @param msg request to send (consumed)
+ * @param cb called with 0 or a negative errno when the kernel replies (may be NULL)
+ * @param data passed to the callback
+ * @return true if the request was queued
+ */
+bool
+netlink_request (struct nl_msg *msg, netlink_result_cb cb, void *data)
+{
+    request_entry *req;
+
+    if (!msg)
+        return false;
+    if (!req_sock)
+    {
+        nlmsg_free (msg);
+        return false;
+    }
+    req = calloc (1, sizeof (request_entry));
+    req->msg = msg;
+    req->cb = cb;
+    req->data = data;
+    g_mutex_lock (&req_lock);
+    g_queue_push_tail (&req_queue, req);
+    if (g_queue_get_length (&req_queue) >= NETLINK_REQUEST_BATCH)
+    {
+        g_mutex_unlock (&req_lock);
+        request_send (true);
+        return true;
+    }
+    if (!req_flush_source)
+        req_flush_source = g_idle_add (request_flush, NULL);
+    g_mutex_unlock (&req_lock);
+    return true;
+}
+
+/**
+ * Send all queued requests and wait for the kernel to answer them
+ */
+void
+netlink_request_wait (void)
+{
+    struct pollfd pfd = { };
+    guint inflight;
+
+    if (!req_sock)
+        return;
+    pfd.fd = nl_socket_get_fd (req_sock);
+    pfd.events = POLLIN;
+    request_report_failed ();
+    if (!request_send (false))
+    {
+        request_fail_queued (-EIO);
+        return;
+    }
+    while (request_pending (&inflight))
+    {
+        if (!inflight)
+            ; /* Only deferred failures left to report */
+        else if (poll (&pfd, 1, 1000) <= 0)
+        {
+            ERROR ("NETLINK: Timeout waiting for %d requests\n", inflight);
+            request_fail_all (-ETIMEDOUT);
+        }
+        else if (nl_recvmsgs_default (req_sock) == -NLE_NOMEM)
+            request_fail_all (-ENOBUFS);
+        /* Callbacks may have queued more and failed to send them */
+        request_report_failed ();
+        if (!request_send (false))
+        {
+            /* The socket is unusable, nothing left will be answered */
+            request_fail_all (-EIO);
+            request_fail_queued (-EIO);
+            return;
+        }
+    }
+}
+
+static bool
+request_init (void)
+{
+    int err;
+
+    req_sock = nl_socket_alloc ();
+    nl_socket_disable_seq_check (req_sock);
+    nl_socket_disable_auto_ack (req_sock);
+    nl_socket_modify_cb (req_sock, NL_CB_ACK, NL_CB_CUSTOM, request_ack_cb, NULL);
+    nl_socket_modify_err_cb (req_sock, NL_CB_CUSTOM, request_err_cb, NULL);
+    err = nl_connect (req_sock, NETLINK_ROUTE);
+    if (err >= 0)
+        err = nl_socket_set_nonblocking (req_sock);
+    if (err < 0)
+    {
+        ERROR ("NETLINK: Connect request socket failed: %s\n", nl_geterror (err));
+        nl_socket_free (req_sock);
+        req_sock = NULL;
+        return false;
+    }
+    /* Room for the replies to a full window */
+    netlink_set_rcvbuf (req_sock, "request", NETLINK_REQUEST_WINDOW * 4096);
+    req_inflight = g_hash_table_new (g_direct_hash, g_direct_equal);
+    req_source = g_unix_fd_add (nl_socket_get_fd (req_sock), G_IO_IN, request_monitor, NULL);
+    return true;
+}
+
+static void
+request_exit (void)
+{
+    request_entry *req;
+
+    if (!req_sock)
+        return;
+    netlink_request_wait ();
+    if (req_flush_source)
+        g_source_remove (req_flush_source);
+    req_flush_source = 0;
+    if (req_failed_source)
+        g_source_remove (req_failed_source);
+    req_failed_source = 0;
+    if (req_source)
+        g_source_remove (req_source);
+    req_source = 0;
+    while ((req = g_queue_pop_head (&req_queue)) != NULL)
+    {
+        nlmsg_free (req->msg);
+        free (req);
+    }
+    g_hash_table_destroy (req_inflight);
+    req_inflight = NULL;
+    nl_socket_free (req_sock);
+    req_sock = NULL;
 }
 
 bool
-netlink_init (void)
+netlink_init (int rx_buffer)
 {
+    int err;
+
     DEBUG ("NETLINK: Initialising\n");
 
     /* Debug parameters */
@@ -175,12 +1018,36 @@ netlink_init (void)
     netlink_dp.dp_fd = stdout;
 
     /* Cache manager */
-    nl_cache_mngr_alloc (NULL, NETLINK_ROUTE, NL_AUTO_PROVIDE, &mngr);
+    mngr_sock = nl_socket_alloc ();
+    err = nl_cache_mngr_alloc (mngr_sock, NETLINK_ROUTE, NL_AUTO_PROVIDE, &mngr);
+    if (err < 0)
+    {
+        FATAL ("Netlink: Allocate cache manager failed: %s\n", nl_geterror (err));
+        return false;
+    }
+
+    /* Give bursts of changes room before the kernel has to drop them */
+    netlink_set_rcvbuf (mngr_sock, "event", rx_buffer);
 
-    /* Create the monitoring thread */
-    pthread_create (&monitor_thread, NULL, netlink_monitor, NULL);
-    pthread_setname_np (monitor_thread, "netlink");
-    pthread_setschedprio (monitor_thread, -10);
+    /* Separate socket for dumping the caches after an overrun */
+    sync_sock = nl_socket_alloc ();
+    err = nl_connect (sync_sock, NETLINK_ROUTE);
+    if (err < 0)
+    {
+        FATAL ("Netlink: Connect sync socket failed: %s\n", nl_geterror (err));
+        return false;
+    }
+
+    /* Pending changes */
+    pending = g_hash_table_new (event_hash, event_equal);
+
+    /* Pipelined requests */
+    if (!request_init ())
+        return false;
+
+    /* Process cache manager messages from the main loop */
+    monitor_source = g_unix_fd_add (nl_cache_mngr_get_fd (mngr), G_IO_IN,
+                                    netlink_monitor, NULL);
 
     return true;
 }
@@ -194,10 +1061,27 @@ netlink_exit ()
 
     DEBUG ("NETLINK: Exiting\n");
 
-    /* Remove the netlink monitoring thread */
-    if (monitor_thread != -1)
-        pthread_join (monitor_thread, NULL);
+    /* Stop watching the netlink socket */
+    if (monitor_source)
+        g_source_remove (monitor_source);
+    monitor_source = 0;
+
+    /* Drop any changes we did not get to */
+    if (flush_source)
+        g_source_remove (flush_source);
+    flush_source = 0;
+    event_purge (NULL);
+    g_hash_table_destroy (pending);
+
+    /* Wait for outstanding requests */
+    request_exit ();
 
     /* Free the cache manager */
     nl_cache_mngr_free (mngr);
+    mngr = NULL;
+    nl_socket_free (mngr_sock);
+    mngr_sock = NULL;
+    nl_close (sync_sock);
+    nl_socket_free (sync_sock);
+    sync_sock = NULL;
 }
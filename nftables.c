@@ -0,0 +1,542 @@
+/**
+ * @file nftables.c
+ * Build and commit nftables batches over nfnetlink
+ *
+ * Copyright 2017, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "kermond.h"
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+#include <arpa/inet.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+/* A batch of nftables messages committed as one transaction */
+struct nft_batch
+{
+    GList *msgs;
+    uint32_t seq;
+    /* Rule currently being built */
+    struct nl_msg *rule;
+    struct nlattr *exprs;
+};
+
+/* Socket shared by all commits */
+static struct nl_sock *nft_sock = NULL;
+static GMutex nft_lock = { };
+
+static struct nl_msg *
+nft_msg (nft_batch *b, int family, uint16_t type, int flags)
+{
+    struct nfgenmsg hdr = {
+        .nfgen_family = family,
+        .version = NFNETLINK_V0,
+        .res_id = 0,
+    };
+    struct nl_msg *msg = nlmsg_alloc ();
+
+    if (!nlmsg_put (msg, NL_AUTO_PORT, b->seq++, type, sizeof (hdr), NLM_F_REQUEST | flags))
+    {
+        nlmsg_free (msg);
+        return NULL;
+    }
+    memcpy (nlmsg_data (nlmsg_hdr (msg)), &hdr, sizeof (hdr));
+    return msg;
+}
+
+static struct nl_msg *
+nft_cmd (nft_batch *b, int family, int cmd, int flags)
+{
+    return nft_msg (b, family, (NFNL_SUBSYS_NFTABLES << 8) | cmd, flags);
+}
+
+static void
+nft_queue (nft_batch *b, struct nl_msg *msg)
+{
+    if (msg)
+        b->msgs = g_list_append (b->msgs, msg);
+}
+
+/**
+ * Create an empty nftables batch
+ * @return new batch to be committed or freed by the caller
+ */
+nft_batch *
+nft_batch_new (void)
+{
+    nft_batch *b = g_malloc0 (sizeof (nft_batch));
+    b->seq = (uint32_t) time (NULL);
+    return b;
+}
+
+/**
+ * Free a batch without sending it
+ * @param b batch to free
+ */
+void
+nft_batch_free (nft_batch *b)
+{
+    if (!b)
+        return;
+    if (b->rule)
+        nlmsg_free (b->rule);
+    g_list_free_full (b->msgs, (GDestroyNotify) nlmsg_free);
+    g_free (b);
+}
+
+/**
+ * Add a table (no error if it already exists)
+ * @param b batch to add to
+ * @param family NFPROTO_* family of the table
+ * @param table name of the table
+ */
+void
+nft_batch_add_table (nft_batch *b, int family, const char *table)
+{
+    struct nl_msg *msg = nft_cmd (b, family, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+    if (msg)
+        nla_put_string (msg, NFTA_TABLE_NAME, table);
+    nft_queue (b, msg);
+}
+
+/**
+ * Delete a table and everything in it
+ * @param b batch to add to
+ * @param family NFPROTO_* family of the table
+ * @param table name of the table
+ */
+void
+nft_batch_del_table (nft_batch *b, int family, const char *table)
+{
+    struct nl_msg *msg = nft_cmd (b, family, NFT_MSG_DELTABLE, 0);
+    if (msg)
+        nla_put_string (msg, NFTA_TABLE_NAME, table);
+    nft_queue (b, msg);
+}
+
+/**
+ * Add a filter base chain with an accept policy
+ * @param b batch to add to
+ * @param family NFPROTO_* family of the table
+ * @param table name of the table
+ * @param chain name of the chain
+ * @param hook NF_INET_* hook to attach to
+ * @param priority hook priority
+ */
+void
+nft_batch_add_chain (nft_batch *b, int family, const char *table,
+                     const char *chain, int hook, int priority)
+{
+    struct nl_msg *msg = nft_cmd (b, family, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+    struct nlattr *nest;
+
+    if (!msg)
+        return;
+    nla_put_string (msg, NFTA_CHAIN_TABLE, table);
+    nla_put_string (msg, NFTA_CHAIN_NAME, chain);
+    nest = nla_nest_start (msg, NFTA_CHAIN_HOOK | NLA_F_NESTED);
+    nla_put_u32 (msg, NFTA_HOOK_HOOKNUM, htonl (hook));
+    nla_put_u32 (msg, NFTA_HOOK_PRIORITY, htonl (priority));
+    nla_nest_end (msg, nest);
+    nla_put_u32 (msg, NFTA_CHAIN_POLICY, htonl (NF_ACCEPT));
+    nla_put_string (msg, NFTA_CHAIN_TYPE, "filter");
+    nft_queue (b, msg);
+}
+
+/**
+ * Remove all rules from a chain
+ * @param b batch to add to
+ * @param family NFPROTO_* family of the table
+ * @param table name of the table
+ * @param chain name of the chain
+ */
+void
+nft_batch_flush_chain (nft_batch *b, int family, const char *table, const char *chain)
+{
+    struct nl_msg *msg = nft_cmd (b, family, NFT_MSG_DELRULE, 0);
+    if (msg)
+    {
+        nla_put_string (msg, NFTA_RULE_TABLE, table);
+        nla_put_string (msg, NFTA_RULE_CHAIN, chain);
+    }
+    nft_queue (b, msg);
+}
+
+/**
+ * Add a named set (no error if it already exists)
+ * @param b batch to add to
+ * @param family NFPROTO_* family of the table
+ * @param table name of the table
+ * @param set name of the set
+ * @param key_type nft data type of the keys (e.g. 7 for ipv4_addr)
+ * @param key_len length of the keys in bytes
+ * @param interval true if the set holds ranges
+ */
+void
+nft_batch_add_set (nft_batch *b, int family, const char *table, const char *set,
+                   uint32_t key_type, int key_len, bool interval)
+{
+    struct nl_msg *msg = nft_cmd (b, family, NFT_MSG_NEWSET, NLM_F_CREATE);
+
+    if (!msg)
+        return;
+    nla_put_string (msg, NFTA_SET_TABLE, table);
+    nla_put_string (msg, NFTA_SET_NAME, set);
+    nla_put_u32 (msg, NFTA_SET_FLAGS, htonl (interval ? NFT_SET_INTERVAL : 0));
+    nla_put_u32 (msg, NFTA_SET_KEY_TYPE, htonl (key_type));
+    nla_put_u32 (msg, NFTA_SET_KEY_LEN, htonl (key_len));
+    nft_queue (b, msg);
+}
+
+/**
+ * Delete a named set
+ * @param b batch to add to
+ * @param family NFPROTO_* family of the table
+ * @param table name of the table
+ * @param set name of the set
+ */
+void
+nft_batch_del_set (nft_batch *b, int family, const char *table, const char *set)
+{
+    struct nl_msg *msg = nft_cmd (b, family, NFT_MSG_DELSET, 0);
+    if (msg)
+    {
+        nla_put_string (msg, NFTA_SET_TABLE, table);
+        nla_put_string (msg, NFTA_SET_NAME, set);
+    }
+    nft_queue (b, msg);
+}
+
+/**
+ * Remove every element from a set
+ * @param b batch to add to
+ * @param family NFPROTO_* family of the table
+ * @param table name of the table
+ * @param set name of the set
+ */
+void
+nft_batch_flush_set (nft_batch *b, int family, const char *table, const char *set)
+{
+    struct nl_msg *msg = nft_cmd (b, family, NFT_MSG_DELSETELEM, 0);
+    if (msg)
+    {
+        nla_put_string (msg, NFTA_SET_ELEM_LIST_TABLE, table);
+        nla_put_string (msg, NFTA_SET_ELEM_LIST_SET, set);
+    }
+    nft_queue (b, msg);
+}
+
+static void
+nft_set_elem (struct nl_msg *msg, const uint8_t *key, int len, bool end)
+{
+    struct nlattr *elem = nla_nest_start (msg, NFTA_LIST_ELEM | NLA_F_NESTED);
+    struct nlattr *nest = nla_nest_start (msg, NFTA_SET_ELEM_KEY | NLA_F_NESTED);
+
+    nla_put (msg, NFTA_DATA_VALUE, len, key);
+    nla_nest_end (msg, nest);
+    if (end)
+        nla_put_u32 (msg, NFTA_SET_ELEM_FLAGS, htonl (NFT_SET_ELEM_INTERVAL_END));
+    nla_nest_end (msg, elem);
+}
+
+/**
+ * Add or remove a prefix in an interval set
+ * @param b batch to add to
+ * @param family NFPROTO_* family of the table
+ * @param table name of the table
+ * @param set name of the set
+ * @param addr network order address
+ * @param len length of the address in bytes
+ * @param plen prefix length
+ * @param add true to add the prefix, false to remove it
+ */
+void
+nft_batch_set_prefix (nft_batch *b, int family, const char *table, const char *set,
+                      const uint8_t *addr, int len, int plen, bool add)
+{
+    struct nl_msg *msg = nft_cmd (b, family, add ? NFT_MSG_NEWSETELEM : NFT_MSG_DELSETELEM,
+                                  add ? NLM_F_CREATE : 0);
+    uint8_t start[16] = { };
+    uint8_t end[16];
+    struct nlattr *elems;
+    bool wrapped = true;
+    int i;
+
+    if (!msg || len > sizeof (start) || plen > len * 8)
+    {
+        nlmsg_free (msg);
+        return;
+    }
+
+    /* The range runs from the network address up to (not including)
+     * the next network, which is left off at the top of the space */
+    memcpy (start, addr, len);
+    for (i = 0; i < len; i++)
+    {
+        int bits = MIN (MAX (plen - i * 8, 0), 8);
+        start[i] &= bits ? 0xff << (8 - bits) : 0;
+    }
+    memcpy (end, start, len);
+    if (plen > 0)
+    {
+        i = (plen - 1) / 8;
+        end[i] += 1 << (7 - ((plen - 1) & 7));
+        wrapped = end[i] == 0;
+        while (wrapped && i > 0)
+        {
+            i--;
+            wrapped = ++end[i] == 0;
+        }
+    }
+
+    nla_put_string (msg, NFTA_SET_ELEM_LIST_TABLE, table);
+    nla_put_string (msg, NFTA_SET_ELEM_LIST_SET, set);
+    elems = nla_nest_start (msg, NFTA_SET_ELEM_LIST_ELEMENTS | NLA_F_NESTED);
+    nft_set_elem (msg, start, len, false);
+    if (!wrapped)
+        nft_set_elem (msg, end, len, true);
+    nla_nest_end (msg, elems);
+    nft_queue (b, msg);
+}
+
+/**
+ * Start appending a rule to a chain. Add expressions with the
+ * nft_rule_* functions and finish with nft_batch_rule_end.
+ * @param b batch to add to
+ * @param family NFPROTO_* family of the table
+ * @param table name of the table
+ * @param chain name of the chain
+ */
+void
+nft_batch_rule_begin (nft_batch *b, int family, const char *table, const char *chain)
+{
+    assert (b->rule == NULL);
+    b->rule = nft_cmd (b, family, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+    if (!b->rule)
+        return;
+    nla_put_string (b->rule, NFTA_RULE_TABLE, table);
+    nla_put_string (b->rule, NFTA_RULE_CHAIN, chain);
+    b->exprs = nla_nest_start (b->rule, NFTA_RULE_EXPRESSIONS | NLA_F_NESTED);
+}
+
+/**
+ * Finish the current rule
+ * @param b batch the rule is in
+ */
+void
+nft_batch_rule_end (nft_batch *b)
+{
+    if (!b->rule)
+        return;
+    nla_nest_end (b->rule, b->exprs);
+    nft_queue (b, b->rule);
+    b->rule = NULL;
+    b->exprs = NULL;
+}
+
+static struct nlattr *
+nft_expr_begin (nft_batch *b, const char *name, struct nlattr **data)
+{
+    struct nlattr *elem = nla_nest_start (b->rule, NFTA_LIST_ELEM | NLA_F_NESTED);
+    nla_put_string (b->rule, NFTA_EXPR_NAME, name);
+    *data = nla_nest_start (b->rule, NFTA_EXPR_DATA | NLA_F_NESTED);
+    return elem;
+}
+
+static void
+nft_expr_end (nft_batch *b, struct nlattr *elem, struct nlattr *data)
+{
+    nla_nest_end (b->rule, data);
+    nla_nest_end (b->rule, elem);
+}
+
+/**
+ * Load packet meta data into the rule register
+ * @param b batch with a rule in progress
+ * @param key NFT_META_* key to load
+ */
+void
+nft_rule_meta (nft_batch *b, int key)
+{
+    struct nlattr *elem, *data;
+
+    if (!b->rule)
+        return;
+    elem = nft_expr_begin (b, "meta", &data);
+    nla_put_u32 (b->rule, NFTA_META_KEY, htonl (key));
+    nla_put_u32 (b->rule, NFTA_META_DREG, htonl (NFT_REG_1));
+    nft_expr_end (b, elem, data);
+}
+
+/**
+ * Load packet data into the rule register
+ * @param b batch with a rule in progress
+ * @param base NFT_PAYLOAD_* header to load from
+ * @param offset offset from the start of the header
+ * @param len number of bytes to load
+ */
+void
+nft_rule_payload (nft_batch *b, int base, int offset, int len)
+{
+    struct nlattr *elem, *data;
+
+    if (!b->rule)
+        return;
+    elem = nft_expr_begin (b, "payload", &data);
+    nla_put_u32 (b->rule, NFTA_PAYLOAD_DREG, htonl (NFT_REG_1));
+    nla_put_u32 (b->rule, NFTA_PAYLOAD_BASE, htonl (base));
+    nla_put_u32 (b->rule, NFTA_PAYLOAD_OFFSET, htonl (offset));
+    nla_put_u32 (b->rule, NFTA_PAYLOAD_LEN, htonl (len));
+    nft_expr_end (b, elem, data);
+}
+
+/**
+ * Stop evaluating the rule unless the register equals the given data
+ * @param b batch with a rule in progress
+ * @param value data to compare against
+ * @param len length of the data
+ */
+void
+nft_rule_cmp (nft_batch *b, const void *value, int len)
+{
+    struct nlattr *elem, *data, *nest;
+
+    if (!b->rule)
+        return;
+    elem = nft_expr_begin (b, "cmp", &data);
+    nla_put_u32 (b->rule, NFTA_CMP_SREG, htonl (NFT_REG_1));
+    nla_put_u32 (b->rule, NFTA_CMP_OP, htonl (NFT_CMP_EQ));
+    nest = nla_nest_start (b->rule, NFTA_CMP_DATA | NLA_F_NESTED);
+    nla_put (b->rule, NFTA_DATA_VALUE, len, value);
+    nla_nest_end (b->rule, nest);
+    nft_expr_end (b, elem, data);
+}
+
+/**
+ * Apply a verdict to packets that reach this point of the rule
+ * @param b batch with a rule in progress
+ * @param verdict NF_ACCEPT, NF_DROP or NFT_* verdict
+ */
+void
+nft_rule_verdict (nft_batch *b, int verdict)
+{
+    struct nlattr *elem, *data, *nest, *vnest;
+
+    if (!b->rule)
+        return;
+    elem = nft_expr_begin (b, "immediate", &data);
+    nla_put_u32 (b->rule, NFTA_IMMEDIATE_DREG, htonl (NFT_REG_VERDICT));
+    nest = nla_nest_start (b->rule, NFTA_IMMEDIATE_DATA | NLA_F_NESTED);
+    vnest = nla_nest_start (b->rule, NFTA_DATA_VERDICT | NLA_F_NESTED);
+    nla_put_u32 (b->rule, NFTA_VERDICT_CODE, htonl (verdict));
+    nla_nest_end (b->rule, vnest);
+    nla_nest_end (b->rule, nest);
+    nft_expr_end (b, elem, data);
+}
+
+static void
+nft_append (GByteArray *buf, struct nl_msg *msg)
+{
+    static const uint8_t pad[NLMSG_ALIGNTO] = { };
+    struct nlmsghdr *hdr = nlmsg_hdr (msg);
+
+    g_byte_array_append (buf, (guint8 *) hdr, hdr->nlmsg_len);
+    g_byte_array_append (buf, pad, NLMSG_ALIGN (hdr->nlmsg_len) - hdr->nlmsg_len);
+}
+
+/**
+ * Send a batch to the kernel as a single transaction and wait for
+ * the result. Either every message is applied or none are.
+ * The batch is freed.
+ * @param b batch to commit
+ * @return true on success, false otherwise
+ */
+bool
+nft_batch_commit (nft_batch *b)
+{
+    struct nl_msg *begin, *end;
+    GByteArray *buf;
+    GList *iter;
+    int err;
+
+    if (!b)
+        return false;
+    if (!b->msgs)
+    {
+        nft_batch_free (b);
+        return true;
+    }
+
+    /* Only the last command is acked, errors abort the whole batch */
+    nlmsg_hdr (g_list_last (b->msgs)->data)->nlmsg_flags |= NLM_F_ACK;
+
+    buf = g_byte_array_new ();
+    begin = nft_msg (b, AF_UNSPEC, NFNL_MSG_BATCH_BEGIN, 0);
+    end = nft_msg (b, AF_UNSPEC, NFNL_MSG_BATCH_END, 0);
+    ((struct nfgenmsg *) nlmsg_data (nlmsg_hdr (begin)))->res_id = htons (NFNL_SUBSYS_NFTABLES);
+    ((struct nfgenmsg *) nlmsg_data (nlmsg_hdr (end)))->res_id = htons (NFNL_SUBSYS_NFTABLES);
+    nft_append (buf, begin);
+    for (iter = b->msgs; iter; iter = iter->next)
+        nft_append (buf, (struct nl_msg *) iter->data);
+    nft_append (buf, end);
+    nlmsg_free (begin);
+    nlmsg_free (end);
+
+    g_mutex_lock (&nft_lock);
+    if (!nft_sock)
+    {
+        nft_sock = nl_socket_alloc ();
+        if ((err = nl_connect (nft_sock, NETLINK_NETFILTER)) < 0)
+        {
+            ERROR ("NFTABLES: Failed to connect socket: %s\n", nl_geterror (err));
+            nl_socket_free (nft_sock);
+            nft_sock = NULL;
+            g_mutex_unlock (&nft_lock);
+            g_byte_array_free (buf, TRUE);
+            nft_batch_free (b);
+            return false;
+        }
+        /* Batch messages carry their own sequence numbers */
+        nl_socket_disable_seq_check (nft_sock);
+    }
+    err = nl_sendto (nft_sock, buf->data, buf->len);
+    if (err >= 0)
+        err = nl_wait_for_ack (nft_sock);
+    g_mutex_unlock (&nft_lock);
+
+    if (err < 0)
+    {
+        ERROR ("NFTABLES: Batch of %d messages failed: %s\n",
+               g_list_length (b->msgs), nl_geterror (err));
+    }
+    g_byte_array_free (buf, TRUE);
+    nft_batch_free (b);
+    return (err >= 0);
+}
+
+/**
+ * Release the nfnetlink socket
+ */
+void
+nft_exit (void)
+{
+    g_mutex_lock (&nft_lock);
+    if (nft_sock)
+        nl_socket_free (nft_sock);
+    nft_sock = NULL;
+    g_mutex_unlock (&nft_lock);
+}
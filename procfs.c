@@ -18,6 +18,10 @@
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
 #include "kermond.h"
+#include "kermond-counters.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 uint32_t
 procfs_read_uint32 (const char *path)
@@ -63,3 +67,153 @@ procfs_write_uint32 (const char *path, uint32_t value)
         fclose (fp);
     }
 }
+
+/* Pending sysctl writes in the order they were made */
+typedef struct sysctl_write
+{
+    char *key;
+    int value;
+} sysctl_write;
+static GHashTable *sysctl_pending = NULL;
+static GQueue sysctl_order = G_QUEUE_INIT;
+static GMutex sysctl_lock = { };
+static guint sysctl_source = 0;
+
+/* Where sysctls live */
+static const char *sysctl_root = "/proc/sys";
+
+/* Writes skipped as the value was already set */
+static uint64_t sysctl_skipped = 0;
+
+static bool
+sysctl_write_now (const char *key, int value)
+{
+    char *path = g_strdup_printf ("%s/%s", sysctl_root, key);
+    char buffer[32];
+    char *current;
+    char *end;
+    long cval;
+    bool ret = false;
+    int len;
+    int fd;
+
+    /* Some writes have side effects so leave correct values alone */
+    current = procfs_read_string (path);
+    if (current)
+    {
+        errno = 0;
+        cval = strtol (current, &end, 10);
+        if (errno == 0 && end != current && *end == '\0' && cval == value)
+        {
+            VERBOSE ("SYSCTL: %s already %d\n", key, value);
+            sysctl_skipped++;
+            free (path);
+            return true;
+        }
+    }
+
+    VERBOSE ("SYSCTL: %s=%d\n", key, value);
+    len = snprintf (buffer, sizeof (buffer), "%d", value);
+    fd = open (path, O_WRONLY);
+    if (fd < 0)
+    {
+        ERROR ("SYSCTL: Failed to open %s (%s)\n", path, strerror (errno));
+    }
+    else
+    {
+        if (write (fd, buffer, len) == len)
+            ret = true;
+        else
+            ERROR ("SYSCTL: Failed to write %d to %s (%s)\n", value, path, strerror (errno));
+        close (fd);
+    }
+    free (path);
+    return ret;
+}
+
+/**
+ * Apply all pending sysctl writes
+ */
+void
+sysctl_flush (void)
+{
+    GQueue writes;
+    sysctl_write *sw;
+
+    g_mutex_lock (&sysctl_lock);
+    writes = sysctl_order;
+    g_queue_init (&sysctl_order);
+    if (sysctl_pending)
+        g_hash_table_remove_all (sysctl_pending);
+    if (sysctl_source)
+        g_source_remove (sysctl_source);
+    sysctl_source = 0;
+    g_mutex_unlock (&sysctl_lock);
+
+    while ((sw = (sysctl_write *) g_queue_pop_head (&writes)))
+    {
+        sysctl_write_now (sw->key, sw->value);
+        free (sw->key);
+        free (sw);
+    }
+}
+
+static gboolean
+sysctl_idle (gpointer data)
+{
+    g_mutex_lock (&sysctl_lock);
+    sysctl_source = 0;
+    g_mutex_unlock (&sysctl_lock);
+    sysctl_flush ();
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * Set a sysctl value
+ * Writes are queued and applied together once the current burst of
+ * changes is over. Repeated writes to the same key only apply the last.
+ * The result is only known then, so failures are logged by the writer
+ * rather than returned here.
+ * @param key path to the sysctl relative to /proc/sys (e.g. net/ipv4/icmp_ratelimit)
+ * @param value new value
+ */
+void
+sysctl_set (const char *key, int value)
+{
+    sysctl_write *sw;
+
+    g_mutex_lock (&sysctl_lock);
+    if (!sysctl_pending)
+        sysctl_pending = g_hash_table_new (g_str_hash, g_str_equal);
+    sw = (sysctl_write *) g_hash_table_lookup (sysctl_pending, key);
+    if (!sw)
+    {
+        sw = (sysctl_write *) calloc (1, sizeof (sysctl_write));
+        sw->key = strdup (key);
+        g_hash_table_insert (sysctl_pending, sw->key, sw);
+        g_queue_push_tail (&sysctl_order, sw);
+    }
+    sw->value = value;
+    if (!sysctl_source)
+        sysctl_source = g_idle_add (sysctl_idle, NULL);
+    g_mutex_unlock (&sysctl_lock);
+}
+
+/**
+ * Initialise the sysctl writer
+ */
+void
+sysctl_init (void)
+{
+    apteryx_counter_register (KERMOND_COUNTERS_SYSCTL_SKIPPED_WRITES, &sysctl_skipped);
+}
+
+/**
+ * Apply any outstanding sysctl writes and shut down the writer
+ */
+void
+sysctl_exit (void)
+{
+    sysctl_flush ();
+    apteryx_counter_unregister (KERMOND_COUNTERS_SYSCTL_SKIPPED_WRITES);
+}
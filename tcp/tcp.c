@@ -30,7 +30,6 @@ static bool
 watch_tcp_settings (const char *path, const char *value)
 {
     char parameter[64];
-    char *cmd = NULL;
     int rc = 0;
 
     /* Parse family, index and the parameter that has changed */
@@ -55,7 +54,7 @@ watch_tcp_settings (const char *path, const char *value)
                        value, val);
             }
         }
-        cmd = g_strdup_printf ("sysctl -w net.ipv4.tcp_synack_retries=%d", val);
+        sysctl_set ("net/ipv4/tcp_synack_retries", val);
     }
     else
     {
@@ -63,14 +62,6 @@ watch_tcp_settings (const char *path, const char *value)
         return true;
     }
 
-    /* Make a change if required */
-    if (cmd)
-    {
-        VERBOSE ("TCP: %s\n", cmd);
-        rc = system (cmd);
-        free (cmd);
-    }
-
     return (rc == 0);
 }
 
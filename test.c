@@ -26,6 +26,8 @@
 #include <netlink/route/link.h>
 #include <netlink/route/addr.h>
 #include <netlink/route/neighbour.h>
+#include <netlink/msg.h>
+#include <linux/rtnetlink.h>
 
 /* Mainloop handle */
 GMainLoop *g_loop = NULL;
@@ -33,6 +35,7 @@ GMainLoop *g_loop = NULL;
 /* Debug */
 bool kermond_debug = true;
 bool kermond_verbose = false;
+bool kermond_graceful = false;
 
 GList *cmds = NULL;
 
@@ -49,6 +52,25 @@ __wrap_system (const char *cmd)
     return 0;
 }
 
+void
+__wrap_sysctl_set (const char *key, int value)
+{
+    char *cmd = g_strdup_printf ("sysctl -w %s=%d", key, value);
+    g_strdelimit (cmd, "/", '.');
+    __wrap_system (cmd);
+    free (cmd);
+}
+
+int nft_commits = 0;
+
+bool
+__wrap_nft_batch_commit (nft_batch *b)
+{
+    nft_commits++;
+    nft_batch_free (b);
+    return true;
+}
+
 bool link_active = false;
 int addr_family = AF_INET;
 
@@ -191,14 +213,89 @@ __wrap_apteryx_set_full (const char *path, const char *value, uint64_t ts,
 }
 
 char *apteryx_prune_path;
+bool apteryx_prune_counting = false;
+int apteryx_prunes = 0;
 bool
 __wrap_apteryx_prune (const char *path)
 {
+    /* Tests that expect several prunes only count them */
+    apteryx_prunes++;
+    if (apteryx_prune_counting)
+        return true;
     g_assert_null (apteryx_prune_path);
     apteryx_prune_path = g_strdup (path);
     return true;
 }
 
+bool
+__wrap_apteryx_unprovide (const char *path, apteryx_provide_callback cb)
+{
+    return true;
+}
+
+/* Requests are logged as "<type>[ replace][ excl];" and answered by
+ * netlink_request_complete, as the main loop would after the call */
+GString *netlink_requests = NULL;
+typedef struct netlink_result
+{
+    netlink_result_cb cb;
+    void *data;
+} netlink_result;
+static GQueue netlink_results = G_QUEUE_INIT;
+
+bool
+__wrap_netlink_request (struct nl_msg *msg, netlink_result_cb cb, void *data)
+{
+    struct nlmsghdr *nlh = nlmsg_hdr (msg);
+    const char *type;
+
+    switch (nlh->nlmsg_type)
+    {
+    case RTM_NEWROUTE:
+        type = "NEWROUTE";
+        break;
+    case RTM_DELROUTE:
+        type = "DELROUTE";
+        break;
+    case RTM_NEWNEXTHOP:
+        type = "NEWNEXTHOP";
+        break;
+    case RTM_DELNEXTHOP:
+        type = "DELNEXTHOP";
+        break;
+    default:
+        type = "UNKNOWN";
+        break;
+    }
+    if (!netlink_requests)
+        netlink_requests = g_string_new (NULL);
+    g_string_append_printf (netlink_requests, "%s%s%s;", type,
+                            (nlh->nlmsg_flags & NLM_F_REPLACE) ? " replace" : "",
+                            (nlh->nlmsg_flags & NLM_F_EXCL) ? " excl" : "");
+    nlmsg_free (msg);
+    if (cb)
+    {
+        netlink_result *result = g_malloc (sizeof (netlink_result));
+        result->cb = cb;
+        result->data = data;
+        g_queue_push_tail (&netlink_results, result);
+    }
+    return true;
+}
+
+/* Answer every outstanding request, including those queued by the callbacks */
+void
+netlink_request_complete (int err)
+{
+    netlink_result *result;
+
+    while ((result = g_queue_pop_head (&netlink_results)) != NULL)
+    {
+        result->cb (err, result->data);
+        g_free (result);
+    }
+}
+
 uint32_t procfs_uint32_t;
 uint32_t
 __wrap_procfs_read_uint32 (const char *path)
@@ -254,6 +351,7 @@ int main (int argc, char *argv[])
     ADD_TEST (test_entity_new_dynamic_ipv4_no_address);
     ADD_TEST (test_entity_new_dynamic_ipv4);
     ADD_TEST (test_entity_del_dynamic_ipv4);
+    ADD_TEST (test_entity_export_dynamic_ipv4);
     ADD_TEST (test_entity_action_invalid);
     ADD_TEST (test_entity_addr_null);
     ADD_TEST (test_entity_addr_no_family);
@@ -267,6 +365,7 @@ int main (int argc, char *argv[])
     ADD_TEST (test_entity_del_dynamic_ipv6);
     ADD_TEST (test_entity_dynamic_ipv6_new_address);
     ADD_TEST (test_entity_dynamic_ipv6_del_address);
+    ADD_TEST (test_entity_export_address_counted_once);
     ADD_TEST (test_icmp4_path_null);
     ADD_TEST (test_icmp4_invalid_path);
     ADD_TEST (test_icmp4_invalid_parameter);
@@ -274,6 +373,7 @@ int main (int argc, char *argv[])
     ADD_TEST (test_icmpv4_dest_unreach_enable);
     ADD_TEST (test_icmpv4_dest_unreach_disable);
     ADD_TEST (test_icmpv4_dest_unreach_value_invalid);
+    ADD_TEST (test_icmp_dest_unreach_both);
     ADD_TEST (test_icmpv4_error_ratelimit_value_null);
     ADD_TEST (test_icmpv4_error_ratelimit_value_0);
     ADD_TEST (test_icmpv4_error_ratelimit_value_2147483647);
@@ -318,6 +418,8 @@ int main (int argc, char *argv[])
     ADD_TEST (test_ifstatus_link_new);
     ADD_TEST (test_ifstatus_link_alias);
     ADD_TEST (test_ifstatus_link_del);
+    ADD_TEST (test_ifstatus_link_change_only_changed);
+    ADD_TEST (test_ifstatus_link_change_unchanged);
     ADD_TEST (test_ifstatus_admin_status_default_down);
     ADD_TEST (test_ifstatus_admin_status_up);
     ADD_TEST (test_ifstatus_oper_status);
@@ -342,11 +444,36 @@ int main (int argc, char *argv[])
     ADD_TEST (test_ifstatus_txqlen_2000);
     ADD_TEST (test_ifstatus_txq_default_1);
     ADD_TEST (test_ifstatus_txq_2);
+    ADD_TEST (test_rib_route_add);
+    ADD_TEST (test_rib_route_incomplete);
+    ADD_TEST (test_rib_route_unchanged);
+    ADD_TEST (test_rib_route_replace);
+    ADD_TEST (test_rib_route_replace_failed);
+    ADD_TEST (test_rib_route_make_before_break);
+    ADD_TEST (test_rib_route_make_before_break_failed);
+    ADD_TEST (test_rib_route_delete);
+    ADD_TEST (test_rib_sweep_ours_only);
+    ADD_TEST (test_rib_nexthop_shared);
+    ADD_TEST (test_rib_nexthop_inline);
+    ADD_TEST (test_rib_nexthop_unref);
+    ADD_TEST (test_rib_nexthop_id_reuse);
+    ADD_TEST (test_rib_nexthop_id_exhausted);
+    ADD_TEST (test_rib_nexthop_move);
+    ADD_TEST (test_rib_nexthop_move_partial);
+    ADD_TEST (test_path_match_leaf);
+    ADD_TEST (test_path_match_container);
+    ADD_TEST (test_path_match_leaf_list);
+    ADD_TEST (test_path_match_unknown);
+    ADD_TEST (test_path_match_invalid);
     ADD_TEST (test_address_invalid);
     ADD_TEST (test_address_null);
     ADD_TEST (test_address_incomplete);
     ADD_TEST (test_address_ipv4);
     ADD_TEST (test_address_ipv6);
+    ADD_TEST (test_address_ipv6_lifetime_only);
+    ADD_TEST (test_address_del_then_add);
+    ADD_TEST (test_address_exit);
+    ADD_TEST (test_address_exit_graceful);
     ADD_TEST (test_static_addr4_path_null);
     ADD_TEST (test_static_addr4_path_invalid);
     ADD_TEST (test_static_addr4_ip_invalid);
@@ -369,6 +496,7 @@ int main (int argc, char *argv[])
     ADD_TEST (test_neighbor_null);
     ADD_TEST (test_neighbor_incomplete);
     ADD_TEST (test_neighbor_ipv4);
+    ADD_TEST (test_neighbor_ipv4_state_only);
     ADD_TEST (test_neighbor_ipv6);
     ADD_TEST (test_static_neighbor4_path_null);
     ADD_TEST (test_static_neighbor4_path_invalid);
@@ -422,6 +550,28 @@ int main (int argc, char *argv[])
     ADD_TEST (test_neighv6_opp_nd_value_disable);
     ADD_TEST (test_neighv6_opp_nd_value_enable);
     ADD_TEST (test_neighv6_opp_nd_value_invalid);
+    ADD_TEST (test_sysctl_write);
+    ADD_TEST (test_sysctl_coalesce);
+    ADD_TEST (test_sysctl_skip_unchanged);
+    ADD_TEST (test_sysctl_missing);
+    ADD_TEST (test_lpm_insert);
+    ADD_TEST (test_lpm_remove);
+    ADD_TEST (test_lpm_remove_glue);
+    ADD_TEST (test_lpm_lookup_ipv4);
+    ADD_TEST (test_lpm_lookup_ipv6);
+    ADD_TEST (test_netlink_coalesce_new_del);
+    ADD_TEST (test_netlink_coalesce_del_new);
+    ADD_TEST (test_netlink_coalesce_del_new_del);
+    ADD_TEST (test_netlink_coalesce_new_change);
+    ADD_TEST (test_netlink_coalesce_change_change);
+    ADD_TEST (test_netlink_coalesce_change_new);
+    ADD_TEST (test_netlink_coalesce_change_del);
+    ADD_TEST (test_netlink_coalesce_del_order);
+    ADD_TEST (test_apteryx_boolean_slots);
+    ADD_TEST (test_apteryx_boolean_true);
+    ADD_TEST (test_apteryx_boolean_false);
+    ADD_TEST (test_apteryx_boolean_null);
+    ADD_TEST (test_apteryx_boolean_invalid);
     ADD_TEST (test_tcp_path_null);
     ADD_TEST (test_tcp_invalid_path);
     ADD_TEST (test_tcp_invalid_parameter);
@@ -69,6 +69,7 @@
 #define ADDRV4 IP4ADDR
 #define ADDRV6 IP6ADDR
 extern GList *cmds;
+extern int nft_commits;
 extern bool link_active;
 extern int addr_family;
 extern struct rtnl_link *link_changes;
@@ -81,7 +82,11 @@ extern GNode *apteryx_tree;
 extern char *apteryx_path;
 extern char *apteryx_value;
 extern char *apteryx_prune_path;
+extern bool apteryx_prune_counting;
+extern int apteryx_prunes;
 extern uint32_t procfs_uint32_t;
 extern char *procfs_string;
+extern GString *netlink_requests;
+void netlink_request_complete (int err);
 
 #endif /* _TEST_H_ */
@@ -0,0 +1,83 @@
+/**
+ * @file test_apteryx.c
+ * Unit tests for the Apteryx helpers
+ *
+ * Copyright 2017, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "apteryx.c"
+
+#include "test.h"
+
+void test_apteryx_boolean_slots ()
+{
+    NP_TEST_START
+    int i;
+    int value;
+
+    /* Every name hashes to the slot it was placed in */
+    for (i = 0; i < boolean_enum.size; i++)
+    {
+        if (!boolean_slots[i].name)
+            continue;
+        NP_ASSERT_EQUAL (apteryx_enum_hash (&boolean_enum, boolean_slots[i].name), i);
+        NP_ASSERT_TRUE (apteryx_enum_lookup (&boolean_enum, boolean_slots[i].name, &value));
+        NP_ASSERT_EQUAL (value, boolean_slots[i].value);
+    }
+    for (i = 0; i < boolean_enum.count; i++)
+    {
+        NP_ASSERT_TRUE (apteryx_enum_lookup (&boolean_enum, boolean_values[i].name, &value));
+        NP_ASSERT_EQUAL (value, boolean_values[i].value);
+        NP_ASSERT_STR_EQUAL (apteryx_enum_name (&boolean_enum, value), boolean_values[i].name);
+    }
+    NP_TEST_END ("");
+}
+
+void test_apteryx_boolean_true ()
+{
+    NP_TEST_START
+    const char *names[] = { "true", "TRUE", "True", "1", "yes", "YES", "Yes" };
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS (names); i++)
+        NP_ASSERT_TRUE (apteryx_parse_boolean ("/test", names[i], false));
+    NP_TEST_END ("");
+}
+
+void test_apteryx_boolean_false ()
+{
+    NP_TEST_START
+    const char *names[] = { "false", "FALSE", "False", "0", "no", "NO", "No" };
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS (names); i++)
+        NP_ASSERT_FALSE (apteryx_parse_boolean ("/test", names[i], true));
+    NP_TEST_END ("");
+}
+
+void test_apteryx_boolean_null ()
+{
+    NP_TEST_START
+    NP_ASSERT_TRUE (apteryx_parse_boolean ("/test", NULL, true));
+    NP_ASSERT_FALSE (apteryx_parse_boolean ("/test", NULL, false));
+    NP_TEST_END ("");
+}
+
+void test_apteryx_boolean_invalid ()
+{
+    NP_TEST_START
+    NP_ASSERT_TRUE (apteryx_parse_boolean ("/test", "on", true));
+    NP_TEST_END ("Invalid /test value (on) using default (1)\n");
+}
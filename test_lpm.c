@@ -0,0 +1,144 @@
+/**
+ * @file test_lpm.c
+ * Unit tests for the longest prefix match trie
+ *
+ * Copyright 2017, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "lpm.c"
+
+#include "test.h"
+#include <arpa/inet.h>
+
+static uint8_t *
+v4 (const char *addr, uint8_t *key)
+{
+    memset (key, 0, LPM_KEY_MAX);
+    NP_ASSERT_EQUAL (inet_pton (AF_INET, addr, key), 1);
+    return key;
+}
+
+static uint8_t *
+v6 (const char *addr, uint8_t *key)
+{
+    memset (key, 0, LPM_KEY_MAX);
+    NP_ASSERT_EQUAL (inet_pton (AF_INET6, addr, key), 1);
+    return key;
+}
+
+void test_lpm_insert ()
+{
+    NP_TEST_START
+    lpm_trie *trie = lpm_new (32);
+    uint8_t key[LPM_KEY_MAX];
+    NP_ASSERT_NULL (lpm_insert (trie, v4 ("10.0.0.0", key), 8, "a"));
+    NP_ASSERT_NULL (lpm_insert (trie, v4 ("10.1.0.0", key), 16, "b"));
+    NP_ASSERT_EQUAL (lpm_count (trie), 2);
+    NP_ASSERT_STR_EQUAL (lpm_get (trie, v4 ("10.0.0.0", key), 8), "a");
+    NP_ASSERT_STR_EQUAL (lpm_get (trie, v4 ("10.1.0.0", key), 16), "b");
+    NP_ASSERT_NULL (lpm_get (trie, v4 ("10.0.0.0", key), 12));
+    NP_ASSERT_NULL (lpm_get (trie, v4 ("10.2.0.0", key), 16));
+    /* Host bits beyond the prefix are ignored */
+    NP_ASSERT_STR_EQUAL (lpm_insert (trie, v4 ("10.1.2.3", key), 16, "c"), "b");
+    NP_ASSERT_EQUAL (lpm_count (trie), 2);
+    NP_ASSERT_NULL (lpm_insert (trie, v4 ("10.0.0.0", key), 33, "d"));
+    NP_ASSERT_EQUAL (lpm_count (trie), 2);
+    lpm_free (trie, NULL);
+    NP_TEST_END ("")
+}
+
+void test_lpm_remove ()
+{
+    NP_TEST_START
+    lpm_trie *trie = lpm_new (32);
+    uint8_t key[LPM_KEY_MAX];
+    lpm_insert (trie, v4 ("10.0.0.0", key), 8, "a");
+    lpm_insert (trie, v4 ("10.1.0.0", key), 16, "b");
+    NP_ASSERT_NULL (lpm_remove (trie, v4 ("10.2.0.0", key), 16));
+    NP_ASSERT_NULL (lpm_remove (trie, v4 ("10.0.0.0", key), 12));
+    NP_ASSERT_STR_EQUAL (lpm_remove (trie, v4 ("10.0.0.0", key), 8), "a");
+    NP_ASSERT_EQUAL (lpm_count (trie), 1);
+    NP_ASSERT_NULL (lpm_lookup (trie, v4 ("10.2.0.1", key), NULL));
+    NP_ASSERT_STR_EQUAL (lpm_lookup (trie, v4 ("10.1.0.1", key), NULL), "b");
+    NP_ASSERT_STR_EQUAL (lpm_remove (trie, v4 ("10.1.0.0", key), 16), "b");
+    NP_ASSERT_EQUAL (lpm_count (trie), 0);
+    NP_ASSERT_NULL (trie->root);
+    lpm_free (trie, NULL);
+    NP_TEST_END ("")
+}
+
+void test_lpm_remove_glue ()
+{
+    NP_TEST_START
+    lpm_trie *trie = lpm_new (32);
+    uint8_t key[LPM_KEY_MAX];
+    lpm_insert (trie, v4 ("10.1.0.0", key), 16, "a");
+    lpm_insert (trie, v4 ("10.2.0.0", key), 16, "b");
+    /* The two prefixes branch at a node without a value */
+    NP_ASSERT_EQUAL (trie->root->plen, 14);
+    NP_ASSERT_NULL (trie->root->value);
+    NP_ASSERT_STR_EQUAL (lpm_remove (trie, v4 ("10.1.0.0", key), 16), "a");
+    /* That node goes with the branch */
+    NP_ASSERT_EQUAL (trie->root->plen, 16);
+    NP_ASSERT_STR_EQUAL (trie->root->value, "b");
+    NP_ASSERT_NULL (trie->root->child[0]);
+    NP_ASSERT_NULL (trie->root->child[1]);
+    lpm_free (trie, NULL);
+    NP_TEST_END ("")
+}
+
+void test_lpm_lookup_ipv4 ()
+{
+    NP_TEST_START
+    lpm_trie *trie = lpm_new (32);
+    uint8_t key[LPM_KEY_MAX];
+    int plen = -1;
+    NP_ASSERT_NULL (lpm_lookup (trie, v4 ("192.168.1.1", key), &plen));
+    NP_ASSERT_EQUAL (plen, -1);
+    lpm_insert (trie, v4 ("0.0.0.0", key), 0, "default");
+    lpm_insert (trie, v4 ("192.168.1.0", key), 24, "subnet");
+    lpm_insert (trie, v4 ("192.168.1.1", key), 32, "host");
+    NP_ASSERT_STR_EQUAL (lpm_lookup (trie, v4 ("192.168.1.1", key), &plen), "host");
+    NP_ASSERT_EQUAL (plen, 32);
+    NP_ASSERT_STR_EQUAL (lpm_lookup (trie, v4 ("192.168.1.2", key), &plen), "subnet");
+    NP_ASSERT_EQUAL (plen, 24);
+    NP_ASSERT_STR_EQUAL (lpm_lookup (trie, v4 ("8.8.8.8", key), &plen), "default");
+    NP_ASSERT_EQUAL (plen, 0);
+    lpm_remove (trie, v4 ("0.0.0.0", key), 0);
+    NP_ASSERT_NULL (lpm_lookup (trie, v4 ("8.8.8.8", key), NULL));
+    NP_ASSERT_STR_EQUAL (lpm_lookup (trie, v4 ("192.168.1.1", key), NULL), "host");
+    lpm_free (trie, NULL);
+    NP_TEST_END ("")
+}
+
+void test_lpm_lookup_ipv6 ()
+{
+    NP_TEST_START
+    lpm_trie *trie = lpm_new (128);
+    uint8_t key[LPM_KEY_MAX];
+    int plen = -1;
+    lpm_insert (trie, v6 ("::", key), 0, "default");
+    lpm_insert (trie, v6 ("fc00::", key), 64, "subnet");
+    lpm_insert (trie, v6 ("fc00::1", key), 128, "host");
+    NP_ASSERT_STR_EQUAL (lpm_lookup (trie, v6 ("fc00::1", key), &plen), "host");
+    NP_ASSERT_EQUAL (plen, 128);
+    NP_ASSERT_STR_EQUAL (lpm_lookup (trie, v6 ("fc00::2", key), &plen), "subnet");
+    NP_ASSERT_EQUAL (plen, 64);
+    NP_ASSERT_STR_EQUAL (lpm_lookup (trie, v6 ("2001:db8::1", key), &plen), "default");
+    NP_ASSERT_EQUAL (plen, 0);
+    NP_ASSERT_EQUAL (lpm_count (trie), 3);
+    lpm_free (trie, NULL);
+    NP_TEST_END ("")
+}
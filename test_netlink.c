@@ -0,0 +1,181 @@
+/**
+ * @file test_netlink.c
+ * Unit tests for netlink change coalescing
+ *
+ * Copyright 2017, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "netlink.c"
+
+#include "test.h"
+#include <netlink/route/addr.h>
+
+static struct nl_object *
+make_obj (void)
+{
+    return (struct nl_object *) rtnl_addr_alloc ();
+}
+
+/* A reference for the event, as the cache callback would take */
+static struct nl_object *
+ref (struct nl_object *obj)
+{
+    if (obj)
+        nl_object_get (obj);
+    return obj;
+}
+
+static netlink_event *
+make_event (int action, struct nl_object *old_obj, struct nl_object *new_obj)
+{
+    netlink_event *ev = calloc (1, sizeof (netlink_event));
+    ev->action = action;
+    ev->old_obj = ref (old_obj);
+    ev->new_obj = ref (new_obj);
+    return ev;
+}
+
+/* Only the test holds a reference once the event is gone */
+static void
+check_released (netlink_event *ev, struct nl_object *a, struct nl_object *b,
+                struct nl_object *c)
+{
+    event_free (ev);
+    NP_ASSERT_EQUAL (nl_object_get_refcnt (a), 1);
+    NP_ASSERT_EQUAL (nl_object_get_refcnt (b), 1);
+    NP_ASSERT_EQUAL (nl_object_get_refcnt (c), 1);
+    nl_object_put (a);
+    nl_object_put (b);
+    nl_object_put (c);
+}
+
+void test_netlink_coalesce_new_del ()
+{
+    NP_TEST_START
+    struct nl_object *a = make_obj (), *b = make_obj (), *c = make_obj ();
+    netlink_event *ev = make_event (NL_ACT_NEW, NULL, a);
+    /* Never published so the pair cancels out */
+    NP_ASSERT_FALSE (event_coalesce (ev, NL_ACT_DEL, NULL, ref (b)));
+    check_released (ev, a, b, c);
+    NP_TEST_END ("");
+}
+
+void test_netlink_coalesce_del_new ()
+{
+    NP_TEST_START
+    struct nl_object *a = make_obj (), *b = make_obj (), *c = make_obj ();
+    netlink_event *ev = make_event (NL_ACT_DEL, NULL, a);
+    /* Removed and re-added, so the delete is kept ahead of the add */
+    NP_ASSERT_TRUE (event_coalesce (ev, NL_ACT_NEW, NULL, ref (b)));
+    NP_ASSERT_EQUAL (ev->action, NL_ACT_NEW);
+    NP_ASSERT_TRUE (ev->deleted == a);
+    NP_ASSERT_NULL (ev->old_obj);
+    NP_ASSERT_TRUE (ev->new_obj == b);
+    check_released (ev, a, b, c);
+    NP_TEST_END ("");
+}
+
+void test_netlink_coalesce_del_new_del ()
+{
+    NP_TEST_START
+    struct nl_object *a = make_obj (), *b = make_obj (), *c = make_obj ();
+    netlink_event *ev = make_event (NL_ACT_DEL, a, NULL);
+    NP_ASSERT_TRUE (event_coalesce (ev, NL_ACT_NEW, NULL, ref (b)));
+    NP_ASSERT_TRUE (ev->deleted == a);
+    /* The object was published so it still has to be removed */
+    NP_ASSERT_TRUE (event_coalesce (ev, NL_ACT_DEL, NULL, ref (c)));
+    NP_ASSERT_EQUAL (ev->action, NL_ACT_DEL);
+    NP_ASSERT_NULL (ev->deleted);
+    NP_ASSERT_NULL (ev->old_obj);
+    NP_ASSERT_TRUE (ev->new_obj == c);
+    check_released (ev, a, b, c);
+    NP_TEST_END ("");
+}
+
+void test_netlink_coalesce_new_change ()
+{
+    NP_TEST_START
+    struct nl_object *a = make_obj (), *b = make_obj (), *c = make_obj ();
+    netlink_event *ev = make_event (NL_ACT_NEW, NULL, a);
+    /* Still new to the modules, with the latest state */
+    NP_ASSERT_TRUE (event_coalesce (ev, NL_ACT_CHANGE, ref (a), ref (b)));
+    NP_ASSERT_EQUAL (ev->action, NL_ACT_NEW);
+    NP_ASSERT_NULL (ev->old_obj);
+    NP_ASSERT_TRUE (ev->new_obj == b);
+    check_released (ev, a, b, c);
+    NP_TEST_END ("");
+}
+
+void test_netlink_coalesce_change_change ()
+{
+    NP_TEST_START
+    struct nl_object *a = make_obj (), *b = make_obj (), *c = make_obj ();
+    netlink_event *ev = make_event (NL_ACT_CHANGE, a, b);
+    /* The first old state and the last new state are kept */
+    NP_ASSERT_TRUE (event_coalesce (ev, NL_ACT_CHANGE, ref (b), ref (c)));
+    NP_ASSERT_EQUAL (ev->action, NL_ACT_CHANGE);
+    NP_ASSERT_TRUE (ev->old_obj == a);
+    NP_ASSERT_TRUE (ev->new_obj == c);
+    check_released (ev, a, b, c);
+    NP_TEST_END ("");
+}
+
+void test_netlink_coalesce_change_new ()
+{
+    NP_TEST_START
+    struct nl_object *a = make_obj (), *b = make_obj (), *c = make_obj ();
+    netlink_event *ev = make_event (NL_ACT_CHANGE, a, b);
+    NP_ASSERT_TRUE (event_coalesce (ev, NL_ACT_NEW, NULL, ref (c)));
+    NP_ASSERT_EQUAL (ev->action, NL_ACT_NEW);
+    NP_ASSERT_NULL (ev->old_obj);
+    NP_ASSERT_TRUE (ev->new_obj == c);
+    check_released (ev, a, b, c);
+    NP_TEST_END ("");
+}
+
+void test_netlink_coalesce_change_del ()
+{
+    NP_TEST_START
+    struct nl_object *a = make_obj (), *b = make_obj (), *c = make_obj ();
+    netlink_event *ev = make_event (NL_ACT_CHANGE, a, b);
+    NP_ASSERT_TRUE (event_coalesce (ev, NL_ACT_DEL, NULL, ref (c)));
+    NP_ASSERT_EQUAL (ev->action, NL_ACT_DEL);
+    NP_ASSERT_NULL (ev->old_obj);
+    NP_ASSERT_TRUE (ev->new_obj == c);
+    check_released (ev, a, b, c);
+    NP_TEST_END ("");
+}
+
+void test_netlink_coalesce_del_order ()
+{
+    NP_TEST_START
+    cache_descriptor link = { .kind = "route/link" }, addr = { .kind = "route/addr" };
+    struct nl_object *a = make_obj (), *b = make_obj (), *c = make_obj ();
+    pending = g_hash_table_new (event_hash, event_equal);
+    event_queue (&link, NL_ACT_CHANGE, a, a);
+    event_queue (&addr, NL_ACT_DEL, NULL, b);
+    /* The link goes after the address that was removed along with it */
+    event_queue (&link, NL_ACT_DEL, NULL, c);
+    NP_ASSERT_EQUAL (g_queue_get_length (&pending_order), 2);
+    NP_ASSERT_TRUE (((netlink_event *) g_queue_peek_head (&pending_order))->desc == &addr);
+    NP_ASSERT_TRUE (((netlink_event *) g_queue_peek_tail (&pending_order))->desc == &link);
+    event_purge (NULL);
+    g_hash_table_destroy (pending);
+    pending = NULL;
+    nl_object_put (a);
+    nl_object_put (b);
+    nl_object_put (c);
+    NP_TEST_END ("");
+}
@@ -0,0 +1,111 @@
+/**
+ * @file test_procfs.c
+ * Unit tests for the sysctl writer
+ *
+ * Copyright 2017, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "procfs.c"
+
+#include "test.h"
+
+static char *
+setup_test (void)
+{
+    char *root = g_dir_make_tmp ("kermond-sysctl-XXXXXX", NULL);
+    NP_ASSERT_NOT_NULL (root);
+    sysctl_root = root;
+    sysctl_skipped = 0;
+    return root;
+}
+
+static void
+sysctl_file_set (const char *root, const char *key, const char *value)
+{
+    char *path = g_strdup_printf ("%s/%s", root, key);
+    NP_ASSERT_TRUE (g_file_set_contents (path, value, -1, NULL));
+    free (path);
+}
+
+static void
+sysctl_file_check (const char *root, const char *key, const char *value)
+{
+    char *path = g_strdup_printf ("%s/%s", root, key);
+    char *contents = NULL;
+    NP_ASSERT_TRUE (g_file_get_contents (path, &contents, NULL, NULL));
+    NP_ASSERT_STR_EQUAL (contents, value);
+    g_free (contents);
+    unlink (path);
+    free (path);
+}
+
+void test_sysctl_write ()
+{
+    NP_TEST_START
+    char *root = setup_test ();
+    sysctl_file_set (root, "a", "0");
+    sysctl_set ("a", 1);
+    sysctl_flush ();
+    sysctl_file_check (root, "a", "1");
+    NP_ASSERT_EQUAL (sysctl_skipped, 0);
+    rmdir (root);
+    g_free (root);
+    NP_TEST_END ("")
+}
+
+void test_sysctl_coalesce ()
+{
+    NP_TEST_START
+    char *root = setup_test ();
+    sysctl_file_set (root, "a", "0");
+    sysctl_file_set (root, "b", "0");
+    sysctl_set ("a", 1);
+    sysctl_set ("b", 3);
+    sysctl_set ("a", 2);
+    NP_ASSERT_EQUAL (g_queue_get_length (&sysctl_order), 2);
+    sysctl_flush ();
+    NP_ASSERT_EQUAL (g_queue_get_length (&sysctl_order), 0);
+    sysctl_file_check (root, "a", "2");
+    sysctl_file_check (root, "b", "3");
+    rmdir (root);
+    g_free (root);
+    NP_TEST_END ("")
+}
+
+void test_sysctl_skip_unchanged ()
+{
+    NP_TEST_START
+    char *root = setup_test ();
+    sysctl_file_set (root, "a", "5\n");
+    sysctl_set ("a", 5);
+    sysctl_flush ();
+    NP_ASSERT_EQUAL (sysctl_skipped, 1);
+    sysctl_file_check (root, "a", "5\n");
+    rmdir (root);
+    g_free (root);
+    NP_TEST_END ("")
+}
+
+void test_sysctl_missing ()
+{
+    NP_TEST_START
+    char *root = setup_test ();
+    sysctl_set ("missing", 1);
+    sysctl_flush ();
+    NP_ASSERT_EQUAL (sysctl_skipped, 0);
+    rmdir (root);
+    g_free (root);
+    NP_TEST_END ("SYSCTL: Failed to open */missing (No such file or directory)\n")
+}